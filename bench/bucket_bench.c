@@ -0,0 +1,524 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Bucket lock contention benchmark.  Worker threads announce random peers
+ * to random torrents through the real bucket locks of ot_mutex.c and the
+ * torrent and peer vectors of ot_vector.c: lock the bucket, find or insert
+ * the torrent, add or remove a peer, unlock.  One in eight announces is a
+ * stop, so the swarms keep churning.
+ *
+ * Reader threads (-r) scrape random torrents meanwhile, under the shared
+ * bucket lock like scrape_torrent.  Built with WANT_LOCKLESS_SCRAPE
+ * (bucket_bench_lockless) they read like scrape_torrent_lockless instead,
+ * and fall back to the shared lock when writers keep getting in the way.
+ *
+ * With -S each announcing thread owns a contiguous range of buckets and
+ * only announces to torrents in it, like the UDP workers of udp_shards.
+ *
+ * A slow torrent database can be simulated with -d: each announce sleeps
+ * that long before taking the bucket lock, as the staged announce path
+ * does, or with -D while holding it, as it did before.
+ *
+ * The Jamfile also builds it with the open addressing torrent index
+ * (bucket_bench_torrent_hash) and with the peer hash sets
+ * (bucket_bench_peer_hash).
+ *
+ * Prints announces and scrapes per second, how often a bucket was found
+ * locked (EVENT_BUCKET_LOCKED) and the lock wait and hold histograms of
+ * /stats?mode=locks.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io.h" /* for int64 */
+#include "uint32.h"
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_stats.h"
+#include "ot_vector.h"
+#include "terasaur/ts_export.h"
+
+#ifdef WANT_TORRENT_HASH
+#define BENCH_TORRENT_INDEX "hash table"
+#else
+#define BENCH_TORRENT_INDEX "sorted"
+#endif
+
+#ifdef WANT_PEER_HASH
+#define BENCH_PEER_STORAGE "hash set"
+#else
+#define BENCH_PEER_STORAGE "sorted"
+#endif
+
+#ifdef WANT_LOCKLESS_SCRAPE
+#define BENCH_SCRAPES "lockless"
+#else
+#define BENCH_SCRAPES "shared lock"
+#endif
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_LOCK_STATS_SIZE 16384
+
+/* Stand-ins for the tracker around ot_mutex.c and ot_vector.c */
+unsigned int g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+time_t g_now_seconds;
+volatile int g_opentracker_running = 1;
+size_t g_torrent_lock_peers = 0;
+int g_self_pipe[2] = { -1, -1 };
+
+static unsigned long long _bucket_locked = 0;
+
+void stats_issue_event(ot_status_event event, PROTO_FLAG proto, uintptr_t event_data) {
+    (void)proto;
+    (void)event_data;
+    if (event == EVENT_BUCKET_LOCKED) {
+        __sync_fetch_and_add(&_bucket_locked, 1);
+    }
+}
+
+void iovec_free(int *iovec_entries, struct iovec **iovector) {
+    (void)iovec_entries;
+    (void)iovector;
+}
+
+void exerr(char *message) {
+    fprintf(stderr, "%s\n", message);
+    exit(111);
+}
+
+void free_peerlist(ot_peerlist *peer_list) {
+    free(peer_list->peers.data);
+#ifdef WANT_LOCKLESS_SCRAPE
+    ts_epoch_retire(peer_list);
+#else
+    free(peer_list);
+#endif
+}
+
+typedef struct {
+    pthread_t thread;
+    uint64_t random;
+    unsigned long long announces;
+    unsigned long long scrapes;
+    unsigned long long scrape_fallbacks;
+    /* With -S, the torrents in the thread's buckets */
+    unsigned long *shard_torrents;
+    unsigned long shard_size;
+} bench_thread;
+
+static volatile int _running = 1;
+static unsigned long _torrents = 100000;
+static unsigned int _peers = 16;
+static useconds_t _db_delay = 0;
+static int _db_delay_locked = 0;
+
+static uint64_t _random(bench_thread *thread) {
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 7;
+    thread->random ^= thread->random << 17;
+    return thread->random;
+}
+
+/* Torrent i always gets the same hash, spread evenly over the buckets */
+static void _torrent_hash(unsigned long i, ot_hash hash) {
+    uint64_t x = i + 1;
+    size_t j;
+    for (j = 0; j < sizeof(ot_hash); ++j) {
+        x = x * 0x5851f42d4c957f2dULL + 0x14057b7ef767814fULL;
+        hash[j] = (uint8_t)(x >> 56);
+    }
+}
+
+static void _make_peer(uint32_t i, int seeding, ot_peer *peer) {
+    uint8_t *bytes = (uint8_t*)peer;
+    bytes[0] = 10;
+    bytes[1] = (uint8_t)(i >> 16);
+    bytes[2] = (uint8_t)(i >> 8);
+    bytes[3] = (uint8_t)i;
+    bytes[4] = 0x1a;
+    bytes[5] = 0xe1;
+    OT_PEERTIME(peer) = 0;
+    OT_PEERFLAG(peer) = seeding ? PEER_FLAG_SEEDING : 0;
+}
+
+static void _random_peer(bench_thread *thread, ot_peer *peer) {
+    uint64_t r = _random(thread);
+    _make_peer((uint32_t)(r % _peers), (r >> 32) % 3 == 0, peer);
+}
+
+static void _add_peer(ot_peerlist *peer_list, ot_peer *peer) {
+    int exactmatch;
+    ot_peer *peer_dest = vector_find_or_insert_peer(&peer_list->peers, peer, &exactmatch);
+    if (!peer_dest) {
+        return;
+    }
+    if (!exactmatch) {
+        peer_list->peer_count++;
+        if (OT_PEERFLAG(peer) & PEER_FLAG_SEEDING) {
+            peer_list->seed_count++;
+        }
+    } else if ((OT_PEERFLAG(peer_dest) ^ OT_PEERFLAG(peer)) & PEER_FLAG_SEEDING) {
+        peer_list->seed_count += (OT_PEERFLAG(peer) & PEER_FLAG_SEEDING) ? 1 : -1;
+    }
+    *peer_dest = *peer;
+}
+
+/* What add_peer_to_torrent_and_return_peers and the stop path do under the
+   bucket lock, without the peer list reply */
+static void _announce(bench_thread *thread, ot_hash hash) {
+    int exactmatch, delta_torrentcount = 0;
+    ot_vector *torrents_list;
+    ot_torrent *torrent;
+    ot_peerlist *peer_list;
+    ot_peer peer;
+
+    _random_peer(thread, &peer);
+    if (_db_delay && !_db_delay_locked) {
+        usleep(_db_delay);
+    }
+
+    torrents_list = mutex_bucket_lock_by_hash(hash);
+    if (_db_delay && _db_delay_locked) {
+        usleep(_db_delay);
+    }
+    torrent = vector_find_or_insert_torrent(torrents_list, hash, &exactmatch);
+    if (!torrent) {
+        mutex_bucket_unlock_by_hash(hash, 0);
+        return;
+    }
+    if (!exactmatch) {
+        memcpy(torrent->hash, hash, sizeof(ot_hash));
+        if (!(torrent->peer_list = calloc(1, sizeof(ot_peerlist)))) {
+            vector_remove_torrent(torrents_list, torrent);
+            mutex_bucket_unlock_by_hash(hash, 0);
+            return;
+        }
+        delta_torrentcount = 1;
+    }
+    peer_list = torrent->peer_list;
+
+    if (_random(thread) % 8 == 0) {
+        switch (vector_remove_peer(&peer_list->peers, &peer)) {
+        case 2:
+            peer_list->seed_count--; /* Fall through */
+        case 1:
+            peer_list->peer_count--;
+        default:
+            break;
+        }
+    } else {
+        _add_peer(peer_list, &peer);
+    }
+    mutex_bucket_unlock_by_hash(hash, delta_torrentcount);
+}
+
+/* Give a preloaded torrent 7/8 of its peers, about where the stops keep
+   it, and split the sorted peers of large swarms into buckets like the
+   clean worker does */
+static void _fill(bench_thread *thread, ot_hash hash) {
+    ot_vector *torrents_list = mutex_bucket_lock_by_hash(hash);
+    ot_torrent *torrent = vector_find_torrent(torrents_list->data, OT_TORRENT_SLOTS(torrents_list), hash);
+    uint32_t i;
+
+    for (i = 0; torrent && i < _peers; ++i) {
+        uint64_t r = _random(thread);
+        ot_peer peer;
+        if (r % 8) {
+            _make_peer(i, (r >> 32) % 3 == 0, &peer);
+            _add_peer(torrent->peer_list, &peer);
+        }
+    }
+    if (torrent && torrent->peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT) {
+        vector_redistribute_buckets(torrent->peer_list);
+    }
+    mutex_bucket_unlock_by_hash(hash, 0);
+}
+
+static void *_announce_worker(void *arg) {
+    bench_thread *thread = arg;
+    ot_hash hash;
+
+    mutex_bucket_caller(OT_LOCK_ANNOUNCE);
+    while (_running) {
+        uint64_t r = _random(thread);
+        if (thread->shard_torrents) {
+            if (!thread->shard_size) {
+                break;
+            }
+            _torrent_hash(thread->shard_torrents[r % thread->shard_size], hash);
+        } else {
+            _torrent_hash(r % _torrents, hash);
+        }
+        _announce(thread, hash);
+        ++thread->announces;
+    }
+    return NULL;
+}
+
+static int _scrape_locked(ot_hash hash, size_t *seeds, size_t *peers) {
+    ot_vector *torrents_list = mutex_bucket_lock_shared_by_hash(hash);
+    ot_torrent *torrent = vector_find_torrent(torrents_list->data, OT_TORRENT_SLOTS(torrents_list), hash);
+    if (torrent) {
+        *seeds = torrent->peer_list->seed_count;
+        *peers = torrent->peer_list->peer_count;
+    }
+    mutex_bucket_unlock_shared_by_hash(hash);
+    return torrent != NULL;
+}
+
+#ifdef WANT_LOCKLESS_SCRAPE
+/* Same tries as scrape_torrent_lockless */
+#define BENCH_LOCKLESS_TRIES 4
+
+/* Returns -1 if no try went through undisturbed */
+static int _scrape_lockless(ot_hash hash, size_t *seeds, size_t *peers) {
+    int tries, found = -1;
+
+    ts_epoch_enter();
+    for (tries = 0; found < 0 && tries < BENCH_LOCKLESS_TRIES; ++tries) {
+        unsigned int seq;
+        ot_vector *torrents_list = mutex_bucket_read_begin(hash, &seq);
+        void *data = torrents_list->data;
+        size_t slots = OT_TORRENT_SLOTS(torrents_list);
+        ot_torrent *torrent;
+        ot_peerlist *peer_list;
+
+        if (mutex_bucket_read_retry(hash, seq)) {
+            continue;
+        }
+        torrent = vector_find_torrent(data, slots, hash);
+        peer_list = torrent ? torrent->peer_list : NULL;
+        if (mutex_bucket_read_retry(hash, seq)) {
+            continue;
+        }
+        if ((found = peer_list != NULL)) {
+            *seeds = peer_list->seed_count;
+            *peers = peer_list->peer_count;
+        }
+        if (mutex_bucket_read_retry(hash, seq)) {
+            found = -1;
+        }
+    }
+    ts_epoch_leave();
+    return found;
+}
+#endif
+
+static void *_scrape_worker(void *arg) {
+    bench_thread *thread = arg;
+    size_t seeds = 0, peers = 0;
+    ot_hash hash;
+
+    mutex_bucket_caller(OT_LOCK_SCRAPE);
+    while (_running) {
+        _torrent_hash(_random(thread) % _torrents, hash);
+#ifdef WANT_LOCKLESS_SCRAPE
+        if (_scrape_lockless(hash, &seeds, &peers) < 0) {
+            ++thread->scrape_fallbacks;
+            _scrape_locked(hash, &seeds, &peers);
+        }
+#else
+        _scrape_locked(hash, &seeds, &peers);
+#endif
+        ++thread->scrapes;
+    }
+    return NULL;
+}
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Split the torrents by the bucket ranges of udp_bind_shards */
+static void _shard(bench_thread *threads, int thread_count) {
+    int const buckets_per_shard = (OT_BUCKET_COUNT + thread_count - 1) / thread_count;
+    unsigned long *shard_torrents = malloc(_torrents * sizeof(unsigned long));
+    unsigned long t;
+    int i;
+
+    if (!shard_torrents) {
+        exerr("Could not allocate torrent shards.");
+    }
+    for (i = 0; i < thread_count; ++i) {
+        threads[i].shard_size = 0;
+    }
+    for (t = 0; t < _torrents; ++t) {
+        ot_hash hash;
+        _torrent_hash(t, hash);
+        threads[(uint32_read_big((char*)hash) >> OT_BUCKET_COUNT_SHIFT) / buckets_per_shard].shard_size++;
+    }
+    for (i = 0; i < thread_count; ++i) {
+        threads[i].shard_torrents = shard_torrents;
+        shard_torrents += threads[i].shard_size;
+        threads[i].shard_size = 0;
+    }
+    for (t = 0; t < _torrents; ++t) {
+        ot_hash hash;
+        bench_thread *thread;
+        _torrent_hash(t, hash);
+        thread = threads + (uint32_read_big((char*)hash) >> OT_BUCKET_COUNT_SHIFT) / buckets_per_shard;
+        thread->shard_torrents[thread->shard_size++] = t;
+    }
+}
+
+static void _usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-r threads] [-s seconds] [-n torrents] [-p peers] [-b bits] [-d usec [-D]] [-f] [-S]\n"
+            "  -t  announcing threads (4)\n"
+            "  -r  scraping threads (0)\n"
+            "  -s  seconds to run (5)\n"
+            "  -n  torrents announced to (100000)\n"
+            "  -p  peers per torrent (16)\n"
+            "  -b  2^bits torrent buckets, like bucket_count_bits in tstracker.conf (%d)\n"
+            "  -d  simulated database time per announce, before the bucket lock (0)\n"
+            "  -D  spend the -d time while holding the bucket lock instead\n"
+            "  -f  fill the swarms before the run instead of starting with one peer\n"
+            "  -S  give each announcing thread its own bucket range, like udp_shards\n",
+            name, OT_BUCKET_COUNT_BITS_DEFAULT);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static bench_thread threads[BENCH_MAX_THREADS];
+    static char lock_stats[BENCH_LOCK_STATS_SIZE];
+    int thread_count = 4, reader_count = 0, seconds = 5, option, i;
+    unsigned long t;
+    unsigned long long announces = 0, scrapes = 0, scrape_fallbacks = 0;
+    double started, elapsed, preload_elapsed;
+    bench_thread preload;
+    useconds_t db_delay = 0;
+    int fill = 0, shards = 0;
+
+    while ((option = getopt(argc, argv, "t:r:s:n:p:b:d:DfSh")) != -1) {
+        switch (option) {
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'r':
+            reader_count = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            _torrents = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            _peers = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            g_bucket_count_bits = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            db_delay = (useconds_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            _db_delay_locked = 1;
+            break;
+        case 'f':
+            fill = 1;
+            break;
+        case 'S':
+            shards = 1;
+            break;
+        default:
+            _usage(argv[0]);
+        }
+    }
+    if (thread_count < 1 || reader_count < 0 || thread_count + reader_count > BENCH_MAX_THREADS || seconds < 1 || !_torrents || !_peers
+        || g_bucket_count_bits < OT_BUCKET_COUNT_BITS_MIN || g_bucket_count_bits > OT_BUCKET_COUNT_BITS_MAX) {
+        _usage(argv[0]);
+    }
+
+    g_now_seconds = time(NULL);
+    mutex_init();
+
+    /* Every torrent exists before the clock starts.  The preload is timed
+       on its own: it inserts at random places in the buckets, which is
+       where bucket size shows */
+    started = _now();
+    preload.random = 0x9e3779b97f4a7c15ULL;
+    for (t = 0; t < _torrents; ++t) {
+        ot_hash hash;
+        _torrent_hash(t, hash);
+        _announce(&preload, hash);
+    }
+    preload_elapsed = _now() - started;
+    for (t = 0; fill && t < _torrents; ++t) {
+        ot_hash hash;
+        _torrent_hash(t, hash);
+        _fill(&preload, hash);
+    }
+    if (shards) {
+        _shard(threads, thread_count);
+    }
+    _bucket_locked = 0;
+    _db_delay = db_delay;
+
+    started = _now();
+    for (i = 0; i < thread_count + reader_count; ++i) {
+        threads[i].random = 0x2545f4914f6cdd1dULL * (i + 1);
+        if (pthread_create(&threads[i].thread, NULL, i < thread_count ? _announce_worker : _scrape_worker, threads + i)) {
+            exerr("Could not start a bench thread.");
+        }
+    }
+#ifdef WANT_LOCKLESS_SCRAPE
+    /* Stands in for the clean worker, which reclaims on every pass */
+    while (_now() - started < seconds) {
+        usleep(10000);
+        ts_epoch_reclaim();
+    }
+#else
+    sleep(seconds);
+#endif
+    _running = 0;
+    for (i = 0; i < thread_count + reader_count; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        announces += threads[i].announces;
+        scrapes += threads[i].scrapes;
+        scrape_fallbacks += threads[i].scrape_fallbacks;
+    }
+    elapsed = _now() - started;
+
+    printf("threads %d+%d, buckets %d, torrents %lu (%zu present), peers per torrent %u, %.1fs\n",
+           thread_count, reader_count, OT_BUCKET_COUNT, _torrents, mutex_get_torrent_count(), _peers, elapsed);
+    printf("torrent index: %s, peers: %s%s, scrapes: %s%s\n", BENCH_TORRENT_INDEX, BENCH_PEER_STORAGE,
+           fill ? ", swarms filled" : "", BENCH_SCRAPES, shards ? ", announcers sharded" : "");
+    if (_db_delay) {
+        printf("database:      %uus per announce, %s the bucket lock\n", (unsigned int)_db_delay,
+               _db_delay_locked ? "holding" : "before");
+    }
+    printf("preload:       %lu torrents in %.2fs (%.0f/s)\n", _torrents, preload_elapsed, _torrents / preload_elapsed);
+    printf("announces:     %llu (%.0f/s)\n", announces, announces / elapsed);
+    if (reader_count) {
+        printf("scrapes:       %llu (%.0f/s), %llu fell back to the shared lock\n", scrapes, scrapes / elapsed,
+               scrape_fallbacks);
+    }
+    printf("bucket locked: %llu (%.3f%% of announces and scrapes)\n\n", _bucket_locked,
+           announces + scrapes ? 100.0 * _bucket_locked / (announces + scrapes) : 0.0);
+    mutex_stats_locks(lock_stats);
+    fputs(lock_stats, stdout);
+    return 0;
+}
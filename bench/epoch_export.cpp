@@ -0,0 +1,41 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * The ts_epoch_* calls of ts_export.cpp for bucket_bench_lockless, which
+ * links epoch.cpp without the rest of the tracker.
+ */
+
+#include "terasaur/epoch.hpp"
+
+using namespace terasaur;
+
+extern "C" void ts_epoch_enter() {
+    epoch::enter();
+}
+
+extern "C" void ts_epoch_leave() {
+    epoch::leave();
+}
+
+extern "C" void ts_epoch_retire(void* ptr) {
+    epoch::retire(ptr);
+}
+
+extern "C" void ts_epoch_reclaim() {
+    epoch::reclaim();
+}
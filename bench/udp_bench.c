@@ -0,0 +1,325 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * UDP announce load against a running tracker, for comparing udp_shards
+ * with the plain worker pool over loopback.  Each thread has its own socket
+ * and keeps a window of announces in flight (UDP tracker protocol, BEP 15),
+ * one in eight of them a stop.  Replies are counted; requests without a
+ * reply within 200ms are counted as lost and replaced.  Run it on other
+ * cores than the tracker's workers, or it competes with them for CPU.
+ *
+ * The tracker only answers announces for torrents it knows.  Write the
+ * torrents announced to with -w, point the local torrent database backend
+ * at the file, then run against the tracker:
+ *
+ *   udp_bench -n 100000 -w /tmp/bench_torrents
+ *   (tstracker.conf: backend = local, local_path = /tmp/bench_torrents)
+ *   udp_bench -n 100000 -t 8 -s 10
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_CONNECT_MAGIC 0x41727101980ULL
+#define BENCH_ANNOUNCE_SIZE 98
+#define BENCH_REPLY_SIZE 2048
+#define BENCH_TIMEOUT_US 200000
+/* Connection ids stay valid for at least an hour, see udp_make_connectionid */
+#define BENCH_RECONNECT_SECONDS 600
+
+typedef struct {
+    pthread_t thread;
+    uint64_t random;
+    int sock;
+    uint8_t connection_id[8];
+    unsigned long long sent;
+    unsigned long long replies;
+    unsigned long long rejected;
+    unsigned long long errors;
+    unsigned long long lost;
+} bench_thread;
+
+static volatile int _running = 1;
+static struct sockaddr_in _tracker;
+static unsigned long _torrents = 100000;
+static unsigned int _window = 32;
+
+static uint64_t _random(bench_thread *thread) {
+    thread->random ^= thread->random << 13;
+    thread->random ^= thread->random >> 7;
+    thread->random ^= thread->random << 17;
+    return thread->random;
+}
+
+/* The torrent hashes of bucket_bench */
+static void _torrent_hash(unsigned long i, uint8_t hash[20]) {
+    uint64_t x = i + 1;
+    size_t j;
+    for (j = 0; j < 20; ++j) {
+        x = x * 0x5851f42d4c957f2dULL + 0x14057b7ef767814fULL;
+        hash[j] = (uint8_t)(x >> 56);
+    }
+}
+
+static void _put32(uint8_t *packet, uint32_t value) {
+    value = htonl(value);
+    memcpy(packet, &value, 4);
+}
+
+static void _put64(uint8_t *packet, uint64_t value) {
+    _put32(packet, (uint32_t)(value >> 32));
+    _put32(packet + 4, (uint32_t)value);
+}
+
+static uint32_t _get32(const uint8_t *packet) {
+    uint32_t value;
+    memcpy(&value, packet, 4);
+    return ntohl(value);
+}
+
+/* Returns 0 once the tracker handed out a connection id */
+static int _connect(bench_thread *thread) {
+    uint8_t packet[16], reply[BENCH_REPLY_SIZE];
+    uint32_t transaction = (uint32_t)_random(thread);
+    int tries;
+
+    _put64(packet, BENCH_CONNECT_MAGIC);
+    _put32(packet + 8, 0);
+    _put32(packet + 12, transaction);
+    for (tries = 0; tries < 10 && _running; ++tries) {
+        ssize_t size;
+        if (send(thread->sock, packet, sizeof(packet), 0) < 0) {
+            return -1;
+        }
+        while ((size = recv(thread->sock, reply, sizeof(reply), 0)) >= 0) {
+            /* Answers to announces still in flight are skipped */
+            if (size >= 16 && _get32(reply) == 0 && _get32(reply + 4) == transaction) {
+                memcpy(thread->connection_id, reply + 8, 8);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static int _announce(bench_thread *thread) {
+    uint8_t packet[BENCH_ANNOUNCE_SIZE];
+    uint64_t r = _random(thread);
+    int const stop = r % 8 == 0, seeding = (r >> 3) % 3 == 0;
+    uint16_t port = (uint16_t)(1024 + (r >> 8) % 16);
+
+    memset(packet, 0, sizeof(packet));
+    memcpy(packet, thread->connection_id, 8);
+    _put32(packet + 8, 1);
+    _put32(packet + 12, (uint32_t)(r >> 32));
+    _torrent_hash((_random(thread) >> 1) % _torrents, packet + 16);
+    _put64(packet + 36, r);               /* peer id */
+    _put64(packet + 64, seeding ? 0 : 1); /* left */
+    _put32(packet + 80, stop ? 3 : 0);    /* event */
+    _put32(packet + 92, 50);              /* numwant */
+    port = htons(port);
+    memcpy(packet + 96, &port, 2);
+    return send(thread->sock, packet, sizeof(packet), 0) < 0 ? -1 : 0;
+}
+
+static void *_worker(void *arg) {
+    bench_thread *thread = arg;
+    uint8_t reply[BENCH_REPLY_SIZE];
+    time_t connected = 0;
+    unsigned int in_flight = 0;
+
+    while (_running) {
+        ssize_t size;
+        if (time(NULL) - connected >= BENCH_RECONNECT_SECONDS) {
+            if (_connect(thread)) {
+                fprintf(stderr, "udp_bench: no connection id from the tracker\n");
+                break;
+            }
+            connected = time(NULL);
+            in_flight = 0;
+        }
+        while (in_flight < _window && !_announce(thread)) {
+            ++thread->sent;
+            ++in_flight;
+        }
+        if ((size = recv(thread->sock, reply, sizeof(reply), 0)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                thread->lost += in_flight;
+                in_flight = 0;
+            }
+            continue;
+        }
+        /* Unknown torrents get an announce reply without any counts */
+        if (size >= 20 && _get32(reply) == 1) {
+            ++thread->replies;
+        } else if (size == 8 && _get32(reply) == 1) {
+            ++thread->rejected;
+        } else {
+            ++thread->errors;
+        }
+        if (in_flight) {
+            --in_flight;
+        }
+    }
+    return NULL;
+}
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Torrent records for the local torrent database backend */
+static int _write_torrents(const char *path) {
+    FILE *file = fopen(path, "w");
+    unsigned long t;
+    size_t j;
+
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    fprintf(file, "# %lu torrents announced to by udp_bench\n", _torrents);
+    for (t = 0; t < _torrents; ++t) {
+        uint8_t hash[20];
+        _torrent_hash(t, hash);
+        fputs("torrent ", file);
+        for (j = 0; j < sizeof(hash); ++j) {
+            fprintf(file, "%02x", hash[j]);
+        }
+        fprintf(file, " %ld\n", (long)time(NULL));
+    }
+    return fclose(file) ? 1 : 0;
+}
+
+static void _usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-a address] [-P port] [-t threads] [-s seconds] [-n torrents] [-q window] [-w file]\n"
+            "  -a  tracker address (127.0.0.1)\n"
+            "  -P  tracker UDP port (6969)\n"
+            "  -t  sending threads, one socket each (4)\n"
+            "  -s  seconds to run (5)\n"
+            "  -n  torrents announced to (100000)\n"
+            "  -q  announces in flight per thread (32)\n"
+            "  -w  write the torrents for the local torrent database backend and exit\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static bench_thread threads[BENCH_MAX_THREADS];
+    const char *address = "127.0.0.1", *torrent_file = NULL;
+    int thread_count = 4, seconds = 5, port = 6969, option, i;
+    unsigned long long sent = 0, replies = 0, rejected = 0, errors = 0, lost = 0;
+    struct timeval timeout = { 0, BENCH_TIMEOUT_US };
+    double started, elapsed;
+
+    while ((option = getopt(argc, argv, "a:P:t:s:n:q:w:h")) != -1) {
+        switch (option) {
+        case 'a':
+            address = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            _torrents = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            _window = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            torrent_file = optarg;
+            break;
+        default:
+            _usage(argv[0]);
+        }
+    }
+    if (thread_count < 1 || thread_count > BENCH_MAX_THREADS || seconds < 1 || !_torrents || !_window
+        || port < 1 || port > 65535) {
+        _usage(argv[0]);
+    }
+    if (torrent_file) {
+        return _write_torrents(torrent_file);
+    }
+
+    memset(&_tracker, 0, sizeof(_tracker));
+    _tracker.sin_family = AF_INET;
+    _tracker.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, address, &_tracker.sin_addr) != 1) {
+        _usage(argv[0]);
+    }
+
+    for (i = 0; i < thread_count; ++i) {
+        bench_thread *thread = threads + i;
+        thread->random = 0x2545f4914f6cdd1dULL * (i + 1);
+        if ((thread->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+            || setsockopt(thread->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+            || connect(thread->sock, (struct sockaddr*)&_tracker, sizeof(_tracker))) {
+            perror("udp_bench: socket");
+            return 1;
+        }
+    }
+
+    started = _now();
+    for (i = 0; i < thread_count; ++i) {
+        if (pthread_create(&threads[i].thread, NULL, _worker, threads + i)) {
+            fprintf(stderr, "udp_bench: could not start a thread\n");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    _running = 0;
+    for (i = 0; i < thread_count; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].sock);
+        sent += threads[i].sent;
+        replies += threads[i].replies;
+        rejected += threads[i].rejected;
+        errors += threads[i].errors;
+        lost += threads[i].lost;
+    }
+    elapsed = _now() - started;
+
+    printf("threads %d, window %u, torrents %lu, %s:%d, %.1fs\n", thread_count, _window, _torrents, address, port,
+           elapsed);
+    printf("sent:     %llu (%.0f/s)\n", sent, sent / elapsed);
+    printf("replies:  %llu (%.0f/s)\n", replies, replies / elapsed);
+    printf("rejected: %llu (unknown torrents)\n", rejected);
+    printf("errors:   %llu\n", errors);
+    printf("lost:     %llu (%.3f%%)\n", lost, sent ? 100.0 * lost / sent : 0.0);
+    return 0;
+}
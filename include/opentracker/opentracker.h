@@ -8,4 +8,12 @@
 int opentracker_main();
 int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto );
 
+/* terasaur -- begin mod */
+/* UDP worker pool started by opentracker_main.  Set these only after the
+   socket is bound, ot_try_bind starts workers itself while g_udp_workers
+   is set. */
+extern unsigned int g_udp_workers;
+extern int64_t      g_udp_socket;
+/* terasaur -- end mod */
+
 #endif
@@ -12,8 +12,15 @@
 /* So after each bucket wait 1 / OT_BUCKET_COUNT intervals */
 #define OT_CLEAN_SLEEP ( ( ( OT_CLEAN_INTERVAL_MINUTES ) * 60 * 1000000 ) / ( OT_BUCKET_COUNT ) )
 
+/* terasaur -- begin mod */
+#include "terasaur/ts_export.h"
+/* terasaur -- end mod */
+
 void clean_init( void );
 void clean_deinit( void );
-int  clean_single_torrent( ot_torrent *torrent );
+/* terasaur: if peers were removed or held back counts are due, a stats
+   snapshot is left in stats (unless NULL) to be published with
+   ts_update_torrent_stats after unlocking */
+int  clean_single_torrent( ot_torrent *torrent, ts_torrent_stats *stats );
 
 #endif
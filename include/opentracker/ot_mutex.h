@@ -17,6 +17,41 @@ ot_vector *mutex_bucket_lock_by_hash( ot_hash hash );
 void mutex_bucket_unlock( int bucket, int delta_torrentcount );
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount );
 
+/* terasaur -- begin mod */
+ot_vector *mutex_bucket_lock_shared( int bucket );
+ot_vector *mutex_bucket_lock_shared_by_hash( ot_hash hash );
+
+void mutex_bucket_unlock_shared( int bucket );
+void mutex_bucket_unlock_shared_by_hash( ot_hash hash );
+
+/* Who takes bucket locks, for the lock stats */
+typedef enum {
+  OT_LOCK_OTHER,
+  OT_LOCK_ANNOUNCE,
+  OT_LOCK_SCRAPE,
+  OT_LOCK_CLEAN,
+  OT_LOCK_FULLSCRAPE,
+  OT_LOCK_STATS,
+  OT_LOCK_CALLER_COUNT
+} ot_lock_caller;
+
+void mutex_bucket_caller( ot_lock_caller caller );
+size_t mutex_stats_locks( char *reply );
+
+#ifdef WANT_LOCKLESS_SCRAPE
+ot_vector *mutex_bucket_read_begin( ot_hash hash, unsigned int *seq );
+int mutex_bucket_read_retry( ot_hash hash, unsigned int seq );
+#endif
+
+/* Torrents with their own lock, see ot_mutex.c */
+int mutex_torrent_promote( ot_peerlist *peer_list );
+int mutex_torrent_demote( ot_peerlist *peer_list );
+void mutex_torrent_hold( ot_peerlist *peer_list );
+void mutex_torrent_lock( ot_peerlist *peer_list );
+void mutex_torrent_unlock( ot_peerlist *peer_list );
+void mutex_torrent_release( ot_peerlist *peer_list );
+/* terasaur -- end mod */
+
 size_t mutex_get_torrent_count();
 
 typedef enum {
@@ -43,6 +78,11 @@ typedef enum {
   TASK_STATS_EVERYTHING            = 0x0106,
   TASK_STATS_FULLLOG               = 0x0107,
   TASK_STATS_WOODPECKERS           = 0x0108,
+  /* terasaur -- begin mod */
+  TASK_STATS_TORRENTDB             = 0x0109,
+  TASK_STATS_LOCKS                 = 0x010a,
+  TASK_STATS_SLAB                  = 0x010b,
+  /* terasaur -- end mod */
   
   TASK_FULLSCRAPE                  = 0x0200, /* Default mode */
   TASK_FULLSCRAPE_TPB_BINARY       = 0x0201,
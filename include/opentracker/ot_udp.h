@@ -9,4 +9,9 @@
 void udp_init( int64 sock, unsigned int worker_count );
 int  handle_udp6( int64 serversocket, struct ot_workstruct *ws );
 
+/* terasaur -- begin mod */
+int  udp_bind_shards( ot_ip6 ip, uint16_t port, unsigned int shard_count );
+void udp_init_shards( );
+/* terasaur -- end mod */
+
 #endif
@@ -12,6 +12,53 @@
 #define OT_VECTOR_SHRINK_THRESH 4
 #define OT_VECTOR_SHRINK_RATIO  2
 
+/* terasaur -- begin mod */
+/* Torrent buckets are sorted arrays, or with WANT_TORRENT_HASH open
+   addressing hash tables of a power of two slots, at most 7/8 full.  Either
+   way their torrents are in the first OT_TORRENT_SLOTS(vector) entries of
+   data, walkers skip entries without a peer_list.  size is the number of
+   torrents in both cases. */
+#ifdef WANT_TORRENT_HASH
+#define OT_TORRENT_HASH_MIN_SLOTS 16
+#define OT_TORRENT_SLOTS(vector) ((vector)->space)
+#else
+#define OT_TORRENT_SLOTS(vector) ((vector)->size)
+#endif
+
+/* Peer lists are sorted arrays, split into sorted buckets once they grow
+   large, or with WANT_PEER_HASH a single open addressing hash set keyed by
+   address and port.  Walk a peer vector with OT_PEER_SLOTS and skip slots
+   for which OT_PEER_SLOT_USED is false. */
+#ifndef WANT_V6
+/* Address and port as one number, the time and flag bytes masked out */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define OT_PEER_KEY_MASK 0x0000ffffffffffffULL
+#else
+#define OT_PEER_KEY_MASK 0xffffffffffff0000ULL
+#endif
+
+static inline uint64_t vector_peer_key( const ot_peer *peer ) {
+  uint64_t key;
+  __builtin_memcpy( &key, peer, sizeof( key ) );
+  return key & OT_PEER_KEY_MASK;
+}
+#endif
+
+#ifdef WANT_PEER_HASH
+#ifdef WANT_V6
+#error "WANT_PEER_HASH keys peers by their 6 byte IPv4 address and port"
+#endif
+#define OT_PEER_HASH_MIN_SLOTS 8
+
+/* A key of 0 marks a free slot, so there is no peer 0.0.0.0:0 */
+#define OT_PEER_SLOTS(vector) ((vector)->space)
+#define OT_PEER_SLOT_USED(peer) (vector_peer_key(peer) != 0)
+#else
+#define OT_PEER_SLOTS(vector) ((vector)->size)
+#define OT_PEER_SLOT_USED(peer) 1
+#endif
+/* terasaur -- end mod */
+
 #define OT_PEER_BUCKET_MINCOUNT 512
 #define OT_PEER_BUCKET_MAXCOUNT 256
 
@@ -28,6 +75,13 @@ ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exac
 
 int      vector_remove_peer( ot_vector *vector, ot_peer *peer );
 void     vector_remove_torrent( ot_vector *vector, ot_torrent *match );
+/* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+void     vector_remove_peer_at( ot_vector *vector, ot_peer *match );
+#endif
+ot_torrent *vector_find_torrent( const void *data, size_t slots, ot_hash hash );
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, ot_hash hash, int *exactmatch );
+/* terasaur -- end mod */
 void     vector_redistribute_buckets( ot_peerlist * peer_list );
 void     vector_fixup_peers( ot_vector * vector );
 
@@ -45,13 +45,36 @@ typedef struct { ot_ip6 address; int bits; }
 
 /* Number of tracker admin ip addresses allowed */
 #define OT_ADMINIP_MAX 64
+/* terasaur -- begin mod */
+/* Bucket locks no longer limit the number of threads, see ot_mutex.c
 #define OT_MAX_THREADS 16
+*/
+/* terasaur -- end mod */
 
 #define OT_PEER_TIMEOUT 45
 
-/* We maintain a list of 1024 pointers to sorted list of ot_torrent structs
- Sort key is, of course, its hash */
-#define OT_BUCKET_COUNT_BITS 10
+/* terasaur -- begin mod */
+/* Seedbank peers are re-merged at least this often (in minutes) so that
+   cleaning never times them out */
+#define TS_SEEDBANK_REFRESH (OT_PEER_TIMEOUT/3)
+/* terasaur -- end mod */
+
+/* terasaur -- begin mod */
+/* We maintain a list of 2^OT_BUCKET_COUNT_BITS pointers to sorted list of
+ ot_torrent structs. Sort key is, of course, its hash. The bit count is
+ set from the config before trackerlogic_init and never changes after */
+#define OT_BUCKET_COUNT_BITS_DEFAULT 10
+#define OT_BUCKET_COUNT_BITS_MIN 4
+#define OT_BUCKET_COUNT_BITS_MAX 20
+extern unsigned int g_bucket_count_bits;
+#define OT_BUCKET_COUNT_BITS g_bucket_count_bits
+
+/* Torrents with at least this many peers get a lock of their own, so that
+   announces to them no longer hold their whole bucket.  0 disables it.  Set
+   from the config before trackerlogic_init */
+#define OT_TORRENT_LOCK_PEERS_DEFAULT 8192
+extern size_t g_torrent_lock_peers;
+/* terasaur -- end mod */
 
 #define OT_BUCKET_COUNT (1<<OT_BUCKET_COUNT_BITS)
 #define OT_BUCKET_COUNT_SHIFT (32-OT_BUCKET_COUNT_BITS)
@@ -103,6 +126,18 @@ struct ot_peerlist {
    pointer to ot_vector[32] buckets if data != NULL and space == 0
 */
   ot_vector      peers;
+  /* terasaur -- begin mod */
+  /* version of the cached seedbank list last merged into peers, 0 if none */
+  uint32_t       seedbank_version;
+  ot_time        seedbank_merged;
+  /* counts last handed to the stats writer and when, in seconds */
+  uint32_t       published_seed_count;
+  uint32_t       published_peer_count;
+  ot_time        stats_published;
+  /* own lock of a torrent with many peers, NULL if the bucket lock covers it,
+     see mutex_torrent_promote */
+  struct ot_torrent_lock *lock;
+  /* terasaur -- end mod */
 };
 #define OT_PEERLIST_HASBUCKETS(peer_list) ((peer_list)->peers.size > (peer_list)->peers.space)
 
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CONTROL_SOCKET_HPP_INCLUDED
+#define CONTROL_SOCKET_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+
+namespace terasaur {
+namespace control_socket {
+
+/**
+ * UNIX datagram socket on which the control plane (mqclient) tells the
+ * tracker about torrent and seedbank changes it has just written to the
+ * database.  Each datagram carries one message, all integers in network
+ * byte order:
+ *
+ *   uint8 version, uint8 op, then by op:
+ *
+ *   TORRENT_SET      info_hash[20], int64 published (epoch seconds),
+ *                    uint8 count, int32 seedbank_id[count]
+ *   TORRENT_REMOVE   info_hash[20]
+ *   SEEDBANK_SET     int32 seedbank_id, uint16 port,
+ *                    address[16] (IPv6, or IPv4 mapped)
+ *   SEEDBANK_REMOVE  int32 seedbank_id
+ *
+ * Messages are applied to the torrent index, torrent cache and seedbank
+ * cache at once, so those can keep entries for a long time.  Nothing is
+ * sent back.
+ */
+#define TS_CONTROL_VERSION 1
+#define TS_CONTROL_TORRENT_SET 1
+#define TS_CONTROL_TORRENT_REMOVE 2
+#define TS_CONTROL_SEEDBANK_SET 3
+#define TS_CONTROL_SEEDBANK_REMOVE 4
+
+// public declarations
+bool open(std::string const& path, std::string const& owner);
+void start();
+void stop();
+bool is_open();
+void write_stats(std::ostream& out);
+
+} // namespace control_socket
+} // namespace terasaur
+
+#endif
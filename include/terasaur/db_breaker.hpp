@@ -0,0 +1,44 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef DB_BREAKER_HPP_INCLUDED
+#define DB_BREAKER_HPP_INCLUDED
+
+#include <ctime>
+#include <iostream>
+
+namespace terasaur {
+namespace db_breaker {
+
+/**
+ * Circuit breaker around torrent database calls.  After failure_threshold
+ * failed or slow calls in a row the breaker opens and allow() turns calls
+ * away without touching the database.  While open, one call per
+ * retry_interval seconds is let through as a probe; the first success closes
+ * the breaker again.
+ */
+
+// public declarations
+void init(unsigned int failure_threshold, time_t retry_interval, long slow_call_ms);
+bool allow();
+void record(bool success, long elapsed_ms);
+bool is_open();
+void write_stats(std::ostream& out);
+
+} // namespace db_breaker
+} // namespace terasaur
+
+#endif
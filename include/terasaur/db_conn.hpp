@@ -0,0 +1,66 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef DB_CONN_HPP_INCLUDED
+#define DB_CONN_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <mongo/client/dbclient.h> // mongodb client
+
+namespace terasaur {
+namespace db_conn {
+
+/**
+ * Long-lived MongoDB connections, one per thread.  UDP workers, the HTTP
+ * event loop and the background writers each get their own connection on
+ * first use and keep it, instead of checking one out of the shared pool on
+ * every call.  A failed connection is replaced with exponential backoff.
+ */
+struct thread_conn_t;
+
+/**
+ * Per-call handle on the calling thread's connection.  Drop-in for
+ * ScopedDbConnection: get() never returns NULL, but the connection may be
+ * failed while waiting out a reconnect backoff, so callers keep checking
+ * isFailed().  Records call latency and errors for the stats page.
+ */
+class scoped_conn {
+public:
+    scoped_conn();
+    ~scoped_conn();
+    mongo::DBClientBase* get() const;
+    void error();
+    void done();
+private:
+    scoped_conn(scoped_conn const&);
+    scoped_conn& operator=(scoped_conn const&);
+
+    thread_conn_t* _thread_conn;
+    boost::posix_time::ptime _start;
+    bool _error;
+    bool _done;
+};
+
+// public declarations
+void init(std::string const& connection_string);
+void write_stats(std::ostream& out);
+
+} // namespace db_conn
+} // namespace terasaur
+
+#endif
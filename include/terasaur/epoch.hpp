@@ -0,0 +1,47 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef EPOCH_HPP_INCLUDED
+#define EPOCH_HPP_INCLUDED
+
+#include <iostream>
+
+namespace terasaur {
+namespace epoch {
+
+/**
+ * Epoch based reclamation for memory that lockless readers may still be
+ * looking at.  Readers bracket their accesses with enter() and leave().
+ * Writers unlink memory as usual but hand it to retire() instead of free().
+ * reclaim() moves the global epoch on once every active reader has caught
+ * up with it, and frees what was retired two epochs back, when no reader
+ * can reach it any more.
+ *
+ * enter() and leave() do not nest.  retire() and reclaim() may be called
+ * from any thread.
+ */
+
+// public declarations
+void enter();
+void leave();
+void retire(void* ptr);
+void reclaim();
+void write_stats(std::ostream& out);
+
+} // namespace epoch
+} // namespace terasaur
+
+#endif
@@ -0,0 +1,40 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HASH_UTIL_HPP_INCLUDED
+#define HASH_UTIL_HPP_INCLUDED
+
+#include <cstring>
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+
+namespace terasaur {
+
+/**
+ * Info hashes are already uniformly distributed, so any 8 bytes of the hash
+ * make a good bucket index.  Skip the leading bytes, which opentracker uses
+ * to pick its own torrent bucket.
+ */
+struct sha1_hash_hasher {
+    std::size_t operator()(libtorrent::sha1_hash const& info_hash) const {
+        std::size_t value;
+        std::memcpy(&value, info_hash.begin() + 8, sizeof(value));
+        return value;
+    }
+};
+
+} // namespace terasaur
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SLAB_H_INCLUDED
+#define SLAB_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+/* Opentracker */
+#include "trackerlogic.h" /* for ot_peer, ot_peerlist */
+
+/**
+ * Size class allocators for peer lists and small peer arrays.  Peer arrays
+ * are sized in peers, and must be freed and resized with the count they were
+ * allocated with.  Arrays of more than TS_SLAB_MAX_PEERS peers come from
+ * malloc.
+ *
+ * Without WANT_SLAB all of these are plain malloc, realloc and free.
+ */
+#define TS_SLAB_MAX_PEERS 64
+
+#ifdef WANT_SLAB
+void *ts_slab_alloc_peers(size_t count);
+void *ts_slab_realloc_peers(void *peers, size_t old_count, size_t new_count);
+void ts_slab_free_peers(void *peers, size_t count);
+#else
+#define ts_slab_alloc_peers(count) malloc((count) * sizeof(ot_peer))
+#define ts_slab_realloc_peers(peers, old_count, new_count) ((void)(old_count), realloc((peers), (new_count) * sizeof(ot_peer)))
+#define ts_slab_free_peers(peers, count) ((void)(count), free(peers))
+#endif
+
+/* Lockless scrapes hand peer lists to ts_epoch_retire, which frees them */
+#if defined(WANT_SLAB) && !defined(WANT_LOCKLESS_SCRAPE)
+ot_peerlist *ts_slab_alloc_peerlist(void);
+void ts_slab_free_peerlist(ot_peerlist *peer_list);
+#else
+#define ts_slab_alloc_peerlist() ((ot_peerlist*)malloc(sizeof(ot_peerlist)))
+#define ts_slab_free_peerlist(peer_list) free(peer_list)
+#endif
+
+size_t ts_slab_stats(char *reply, size_t reply_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef STATS_JOURNAL_HPP_INCLUDED
+#define STATS_JOURNAL_HPP_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "terasaur/torrentdb.hpp" // for stats_update_t
+
+namespace terasaur {
+namespace stats_journal {
+
+/**
+ * Bounded on-disk queue of stats updates the torrent database could not
+ * take.  The stats writer appends to it while the database is unavailable
+ * and replays it, oldest first, once the database is back.  The journal
+ * survives restarts; whatever is left in it is replayed after the next start.
+ */
+
+// public declarations
+bool open(std::string const& path, std::size_t max_entries);
+bool append(std::vector<torrentdb::stats_update_t> const& updates);
+std::size_t read(std::vector<torrentdb::stats_update_t>& updates, std::size_t max_count);
+void consume(std::size_t count);
+std::size_t depth();
+void write_stats(std::ostream& out);
+
+} // namespace stats_journal
+} // namespace terasaur
+
+#endif
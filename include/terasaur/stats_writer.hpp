@@ -0,0 +1,45 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef STATS_WRITER_HPP_INCLUDED
+#define STATS_WRITER_HPP_INCLUDED
+
+#include <ctime>
+#include <iostream>
+#include "terasaur/torrentdb.hpp" // for stats_update_t
+
+namespace terasaur {
+namespace stats_writer {
+
+/**
+ * Write-behind queue for torrent stats.  Announce and clean paths hand their
+ * counts to enqueue(), which only touches memory.  A dedicated writer thread
+ * coalesces pending updates per info hash and flushes them to the torrent
+ * database in batches.
+ */
+
+// public declarations
+void start(std::size_t batch_size, long flush_interval_ms, time_t min_interval);
+void stop();
+void enqueue(torrentdb::stats_update_t const& params);
+time_t min_interval();
+void count_suppressed();
+void write_stats(std::ostream& out);
+
+} // namespace stats_writer
+} // namespace terasaur
+
+#endif
@@ -0,0 +1,45 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef THREAD_UTIL_HPP_INCLUDED
+#define THREAD_UTIL_HPP_INCLUDED
+
+#include <signal.h>
+#include <pthread.h>
+#include <boost/thread/thread.hpp>
+
+namespace terasaur {
+namespace thread_util {
+
+/**
+ * Start a background thread with all signals blocked.  opentracker handles
+ * SIGINT and SIGALRM on its main thread, and its SIGINT handler exits the
+ * process, running atexit hooks that join our threads.
+ */
+template <typename F>
+boost::thread* create_thread(F f) {
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    boost::thread* thread = new boost::thread(f);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return thread;
+}
+
+} // namespace thread_util
+} // namespace terasaur
+
+#endif
@@ -17,23 +17,22 @@
 #ifndef TORRENT_HPP_INCLUDED
 #define TORRENT_HPP_INCLUDED
 
+#include <ctime>
+#include <vector>
 #include <mongo/bson/bson.h> // for Date_t
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 
-using boost::posix_time::ptime;
-
 namespace terasaur {
 
 // Used to pass data out of torrentdb
 struct torrent {
     libtorrent::sha1_hash info_hash;
-    ptime published;
+    time_t published; // seconds since the epoch
+    std::vector<int> seedbank_ids;
 
     torrent();
     torrent(mongo::BSONObj const& torrent_record);
     virtual ~torrent() {}
-    bool is_published();
 };
 
 } // namespace terasaur
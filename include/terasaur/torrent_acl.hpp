@@ -17,8 +17,10 @@
 #ifndef TORRENT_ACL_HPP_INCLUDED
 #define TORRENT_ACL_HPP_INCLUDED
 
+#include <ctime>
 #include <mongo/bson/bson.h>
 #include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "terasaur/torrent_cache.hpp" // for seedbank_list_ptr
 using libtorrent::sha1_hash;
 
 namespace terasaur {
@@ -26,9 +28,10 @@ namespace torrent_acl {
 
 // public declarations
 bool hashisvalid(sha1_hash const& info_hash);
+torrent_cache::seedbank_list_ptr look_up_seedbanks(sha1_hash const& info_hash);
 
 // private declarations
-bool _is_published(mongo::Date_t const& published);
+bool _is_published(time_t published);
 
 } // namespace torrent_acl
 } // namespace terasaur
@@ -0,0 +1,70 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TORRENT_CACHE_HPP_INCLUDED
+#define TORRENT_CACHE_HPP_INCLUDED
+
+extern "C" {
+#include "trackerlogic.h" // for ot_peer
+}
+#include <ctime>
+#include <iostream>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+
+using libtorrent::sha1_hash;
+
+namespace terasaur {
+namespace torrent_cache {
+
+typedef std::vector<ot_peer> seedbank_list_t;
+typedef boost::shared_ptr<seedbank_list_t const> seedbank_list_ptr;
+
+/**
+ * Result of a torrent lookup as remembered by the cache.  A negative entry
+ * (found == false) records that the torrent database had no such info hash.
+ *
+ * Found entries also carry the torrent's seedbanks, ready to be merged into
+ * the peer list.  The list is immutable and shared between readers.
+ * seedbank_version is derived from the list contents, so it only changes
+ * when the seedbanks do.  It is never 0 for a cached list.
+ */
+struct cache_entry_t {
+    bool found;
+    time_t published; // seconds since the epoch
+    time_t expires;
+    seedbank_list_ptr seedbanks;
+    uint32_t seedbank_version;
+    cache_entry_t() : found(false), published(0), expires(0), seedbanks(), seedbank_version(0) {}
+};
+
+// public declarations
+void init(std::size_t max_entries, time_t positive_ttl, time_t negative_ttl);
+bool enabled();
+bool get(sha1_hash const& info_hash, cache_entry_t& entry);
+bool peek(sha1_hash const& info_hash, cache_entry_t& entry);
+bool get_stale(sha1_hash const& info_hash, cache_entry_t& entry);
+void put_found(sha1_hash const& info_hash, time_t published, seedbank_list_ptr const& seedbanks);
+void put_not_found(sha1_hash const& info_hash);
+void invalidate(sha1_hash const& info_hash);
+void clear();
+void write_stats(std::ostream& out);
+
+} // namespace torrent_cache
+} // namespace terasaur
+
+#endif
@@ -0,0 +1,53 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TORRENT_FILTER_HPP_INCLUDED
+#define TORRENT_FILTER_HPP_INCLUDED
+
+#include <iostream>
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+
+using libtorrent::sha1_hash;
+
+namespace terasaur {
+namespace torrent_filter {
+
+/**
+ * Bloom filter over every info hash in the torrent index.  Announces for
+ * hashes the filter has never seen are rejected without touching the cache,
+ * the index or the database.  Torrents added to the index are added to the
+ * filter right away.  Removals need a rebuild, which a background thread
+ * does after each full index load or once the filter fills past capacity.
+ *
+ * Until the first build, may_contain() lets everything through.  Misses are
+ * only final while the control socket is open, see torrent_acl::hashisvalid.
+ */
+
+// public declarations
+void init(double bits_per_entry);
+bool rebuild();
+void request_rebuild();
+void start_rebuilder();
+void stop_rebuilder();
+bool may_contain(sha1_hash const& info_hash);
+void add(sha1_hash const& info_hash);
+void record_false_positive();
+void write_stats(std::ostream& out);
+
+} // namespace torrent_filter
+} // namespace terasaur
+
+#endif
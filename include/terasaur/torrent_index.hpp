@@ -0,0 +1,69 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TORRENT_INDEX_HPP_INCLUDED
+#define TORRENT_INDEX_HPP_INCLUDED
+
+#include <ctime>
+#include <iostream>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "terasaur/torrent.hpp"
+
+using boost::posix_time::ptime;
+using libtorrent::sha1_hash;
+
+namespace terasaur {
+namespace torrent_index {
+
+/**
+ * Memory resident copy of the authorization fields of the torrent
+ * collection.  It is loaded in one pass at startup and then kept current by
+ * a background thread that pulls records by their updated time.  A miss is
+ * not authoritative: torrents added since the last refresh are still looked
+ * up in the database and then added here.
+ */
+struct index_entry_t {
+    time_t published; // seconds since the epoch
+    std::vector<int> seedbank_ids;
+};
+
+/**
+ * Receives every info hash in the index from for_each_hash.
+ */
+class hash_visitor {
+public:
+    virtual ~hash_visitor() {}
+    virtual void visit(sha1_hash const& info_hash) = 0;
+};
+
+// public declarations
+bool load();
+bool is_loaded();
+std::size_t size();
+void for_each_hash(hash_visitor& visitor);
+bool lookup(sha1_hash const& info_hash, index_entry_t& entry);
+void insert(terasaur::torrent const& torrent);
+void remove(sha1_hash const& info_hash);
+void start_refresher(time_t refresh_interval, time_t full_reload_interval);
+void stop_refresher();
+void write_stats(std::ostream& out);
+
+} // namespace torrent_index
+} // namespace terasaur
+
+#endif
@@ -24,12 +24,9 @@ extern "C" {
 #include "terasaur/torrent.hpp"
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 #include <vector>
+#include <iostream>
 #include <mongo/client/dbclient.h> // mongodb client
-#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
-#include <mongo/client/connpool.h>
-using boost::scoped_ptr;
-using mongo::ScopedDbConnection;
 
 using libtorrent::sha1_hash;
 using std::string;
@@ -48,23 +45,31 @@ struct stats_update_t {
     sha1_hash info_hash;
     uint32_t seeds;
     uint32_t peers;
-    bool increment_completed;
-    stats_update_t() : info_hash(0), seeds(0), peers(0), increment_completed(false) {}
+    uint32_t completed; // number of new completed downloads to add
+    stats_update_t() : info_hash(0), seeds(0), peers(0), completed(0) {}
+};
+
+/**
+ * Receives the torrent records streamed by scan_torrents.
+ */
+class torrent_visitor {
+public:
+    virtual ~torrent_visitor() {}
+    virtual void visit(terasaur::torrent const& torrent) = 0;
 };
 
 // public declarations
 void set_param(string key, string val);
 bool init_conn();
+bool scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated);
+bool load_seedbanks();
 boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash);
 std::vector<string_int_tuple> get_seedbanks(sha1_hash const& info_hash);
-void update_stats(stats_update_t const& params);
-
-// private declarations
-BSONObj _look_up_info_hash(scoped_ptr<ScopedDbConnection> const& scoped_conn, sha1_hash const& info_hash);
-std::vector<string_int_tuple> _get_seedbanks(scoped_ptr<ScopedDbConnection> const& scoped_conn, sha1_hash const& info_hash);
-string_int_tuple _get_seedbank_for_id(scoped_ptr<ScopedDbConnection> const& scoped_conn, int seedbank_id);
-BSONObj _look_up_seedbank(scoped_ptr<ScopedDbConnection> const& scoped_conn, int seedbank_id);
-void _execute_update_stats(scoped_ptr<ScopedDbConnection> const& scoped_conn, stats_update_t const& params);
+std::vector<string_int_tuple> get_seedbanks_for_ids(std::vector<int> const& seedbank_ids);
+bool update_stats_batch(std::vector<stats_update_t> const& batch);
+void set_seedbank(int seedbank_id, string_int_tuple const& ip_port);
+void remove_seedbank(int seedbank_id);
+void write_stats(std::ostream& out);
 
 } // namespace torrentdb
 } // namespace terasaur
@@ -0,0 +1,57 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TORRENTDB_BACKEND_HPP_INCLUDED
+#define TORRENTDB_BACKEND_HPP_INCLUDED
+
+#include <iostream>
+#include "terasaur/torrentdb.hpp"
+#include "terasaur/string_map.hpp"
+
+namespace terasaur {
+namespace torrentdb {
+
+/**
+ * Storage behind the torrentdb functions.  One backend is created by
+ * init_conn(), picked by the "backend" param, and is shared by all threads,
+ * so implementations must be thread safe.  Failures are reported through the
+ * return value as documented for the matching torrentdb function; backends
+ * do not throw.
+ */
+class backend {
+public:
+    virtual ~backend() {}
+    virtual bool init_conn() = 0;
+    virtual bool scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated) = 0;
+    virtual bool load_seedbanks() = 0;
+    virtual boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash) = 0;
+    virtual std::vector<string_int_tuple> get_seedbanks(sha1_hash const& info_hash) = 0;
+    virtual void find_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& found, std::vector<int>& missing) = 0;
+    virtual bool look_up_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& sb_list) = 0;
+    virtual bool update_stats_batch(std::vector<stats_update_t> const& batch) = 0;
+    virtual void set_seedbank(int seedbank_id, string_int_tuple const& ip_port) = 0;
+    virtual void remove_seedbank(int seedbank_id) = 0;
+    virtual void write_stats(std::ostream& out) = 0;
+};
+
+// public declarations
+backend* create_mongo_backend(string_map const& params);
+backend* create_local_backend(string_map const& params);
+
+} // namespace torrentdb
+} // namespace terasaur
+
+#endif
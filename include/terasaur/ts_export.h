@@ -23,12 +23,43 @@
 
 #include "trackerlogic.h" /* for ot_hash, ot_peerlist */
 
+/**
+ * Anything that may need the torrent database is resolved before a bucket
+ * lock is taken or published after it is released.  These structs carry the
+ * results across the critical section.
+ */
+#define TS_MAX_SEEDBANKS 16
+
+/* Seedbank peers for one torrent, resolved before locking its bucket */
+typedef struct {
+  uint32_t version;
+  size_t   count;
+  ot_peer  peers[TS_MAX_SEEDBANKS];
+} ts_seedbank_list;
+
+/* Torrent counts copied under the bucket lock, published after unlocking */
+typedef struct {
+  ot_hash  hash;
+  size_t   seed_count;
+  size_t   peer_count;
+  int      increment_completed;
+  int      changed;
+} ts_torrent_stats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 int ts_torrentdb_hashisvalid(ot_hash* hash);
-void ts_torrentdb_add_seedbanks(ot_hash* hash, ot_peerlist *peer_list);
-void ts_update_torrent_stats(ot_torrent const* torrent, int increment_completed);
+int ts_torrentdb_authorize(ot_hash* hash, ts_seedbank_list* seedbanks);
+void ts_torrentdb_add_seedbanks(ts_seedbank_list const* seedbanks, ot_peerlist *peer_list);
+int ts_torrent_stats_due(ot_peerlist const* peer_list);
+void ts_snapshot_torrent_stats(ot_torrent* torrent, int increment_completed, ts_torrent_stats* stats);
+void ts_update_torrent_stats(ts_torrent_stats const* stats);
+size_t ts_stats_torrentdb(char* reply, size_t reply_size);
+void ts_epoch_enter(void);
+void ts_epoch_leave(void);
+void ts_epoch_retire(void* ptr);
+void ts_epoch_reclaim(void);
 void ts_log_debug(const char* msg);
 void ts_log_error(const char* msg);
 #ifdef __cplusplus
@@ -31,6 +31,8 @@ CONFIG_SEARCH_DEFAULT = [
     '/etc/tstracker/' + CONFIG_FILENAME
     ]
 
+CONTROL_SECTION = 'control'
+
 """
 Default configuration values
 """
@@ -55,6 +57,9 @@ DEFAULT_VALUES = {
         'exchange': 'terasaur',
         'control_queue': 'tracker.control',
         'terasaur_queue': 'terasaur.web'
+        },
+    CONTROL_SECTION: {
+        'socket_path': ''
         }
     }
 
@@ -20,9 +20,15 @@ import traceback
 import datetime
 from terasaur.messaging.rabbitmq_message_handler import ControlMessageHandler
 from tstracker.torrent import Torrent, TorrentManager
-from tstracker.seedbank import SeedbankManager
+from tstracker.seedbank import Seedbank, SeedbankManager
 
 class TrackerControlMessageHandler(ControlMessageHandler):
+    # TrackerControl for the tracker's control socket, None if not configured
+    _tracker_control = None
+
+    def set_tracker_control(self, tracker_control):
+        self._tracker_control = tracker_control
+
     def _handle_action(self, action, data):
         try:
             if action == 'add_torrent':
@@ -48,6 +54,7 @@ class TrackerControlMessageHandler(ControlMessageHandler):
             self._log.info('Received add_torrent control message (%s)' % info_hash)
         TorrentManager.add(info_hash)
         self._log.info('Added torrent to tracker (%s)' % info_hash)
+        self._notify_torrent(info_hash)
 
     def _handle_remove_torrent(self, data):
         info_hash = data['info_hash']
@@ -55,6 +62,7 @@ class TrackerControlMessageHandler(ControlMessageHandler):
             self._log.info('Received remove_torrent control message (%s)' % info_hash)
         TorrentManager.remove(info_hash)
         self._log.info('Removed torrent from tracker (%s)' % info_hash)
+        self._notify(lambda tc: tc.torrent_remove(info_hash))
 
     def _handle_add_seedbank(self, data):
         info_hash = data['info_hash']
@@ -63,6 +71,11 @@ class TrackerControlMessageHandler(ControlMessageHandler):
             self._log.info('Received add_seedbank control message (%s, %s)' % (info_hash, ip_port))
         SeedbankManager.add(info_hash, ip_port)
         self._log.info('Added seed bank (%s) to torrent (%s)' % (ip_port, info_hash))
+        (ip, port) = ip_port.split(':')
+        sb = Seedbank.find(ip=ip, port=port)
+        if sb:
+            self._notify(lambda tc: tc.seedbank_set(sb))
+        self._notify_torrent(info_hash)
 
     def _handle_remove_seedbank(self, data):
         info_hash = data['info_hash']
@@ -71,6 +84,7 @@ class TrackerControlMessageHandler(ControlMessageHandler):
             self._log.info('Received remove_seedbank control message (%s, %s)' % (info_hash, ip_port))
         SeedbankManager.remove(info_hash, ip_port)
         self._log.info('Removed seed bank (%s) from torrent (%s)' % (ip_port, info_hash))
+        self._notify_torrent(info_hash)
 
     def _handle_update_torrent(self, data):
         info_hash = data['info_hash']
@@ -82,5 +96,26 @@ class TrackerControlMessageHandler(ControlMessageHandler):
             raise Exception('Invalid info hash trying to update torrent (%s)' % (info_hash))
 
         if data.has_key('published'):
-            t.published = datetime.datetime.strptime(date['published'], '%Y-%m-%dT%H:%M:%S.%fZ')
+            t.published = datetime.datetime.strptime(data['published'], '%Y-%m-%dT%H:%M:%S.%fZ')
         t.save()
+        self._notify(lambda tc: tc.torrent_set(t))
+
+    def _notify_torrent(self, info_hash):
+        """
+        Send the torrent record as now stored in the database to the tracker.
+        """
+        t = Torrent.find(info_hash=info_hash)
+        if t:
+            self._notify(lambda tc: tc.torrent_set(t))
+
+    def _notify(self, send):
+        """
+        The database has been updated already, so a tracker that misses the
+        message still catches up on its next index refresh.
+        """
+        if not self._tracker_control:
+            return
+        try:
+            send(self._tracker_control)
+        except Exception, e:
+            self._log.warning('Unable to notify tracker over control socket (%s)' % str(e))
@@ -24,6 +24,8 @@ from terasaur.messaging.rabbitmq_consumer import RabbitMQConsumer
 from terasaur.messaging.rabbitmq_publisher import SelfManagingRabbitMQPublisher
 from terasaur.messaging.rabbitmq_connector import CONTENT_TYPE_BINARY
 from tstracker.messaging.server_control_handler import TrackerControlMessageHandler
+from tstracker.config.config_defaults import CONTROL_SECTION
+from tstracker.tracker_control import TrackerControl
 
 class TerasaurTrackerMQException(Exception): pass
 
@@ -81,6 +83,9 @@ class TerasaurTrackerMQ(LogInitMixin):
         """
         queue_name = config.get(MQ_SECTION, 'control_queue')
         handler = TrackerControlMessageHandler(server=self, verbose=self._verbose)
+        socket_path = config.get(CONTROL_SECTION, 'socket_path')
+        if socket_path:
+            handler.set_tracker_control(TrackerControl(socket_path))
         self._mq_in = RabbitMQConsumer(config=config,
                                        handler=handler,
                                        queue_name=queue_name,
@@ -0,0 +1,69 @@
+#
+# Copyright 2012 ibiblio
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0.txt
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""
+Sends torrent and seedbank changes to the tracker over its control socket, so
+they take effect without waiting for the tracker to poll the database.  See
+include/terasaur/control_socket.hpp for the message format.
+"""
+
+import binascii
+import calendar
+import socket
+import struct
+
+CONTROL_VERSION = 1
+TORRENT_SET = 1
+TORRENT_REMOVE = 2
+SEEDBANK_SET = 3
+SEEDBANK_REMOVE = 4
+
+MAX_SEEDBANKS = 255
+
+class TrackerControlException(Exception): pass
+
+class TrackerControl(object):
+    def __init__(self, socket_path):
+        self._socket_path = socket_path
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+
+    def torrent_set(self, torrent):
+        seedbank_ids = torrent.seedbanks or []
+        if len(seedbank_ids) > MAX_SEEDBANKS:
+            raise TrackerControlException('Too many seedbanks for torrent (%s)' % torrent.info_hash)
+        published = calendar.timegm(torrent.published.utctimetuple()) if torrent.published else 0
+        msg = struct.pack('!BB20sqB', CONTROL_VERSION, TORRENT_SET,
+                          binascii.unhexlify(torrent.info_hash), published, len(seedbank_ids))
+        msg += ''.join([struct.pack('!i', sb_id) for sb_id in seedbank_ids])
+        self._send(msg)
+
+    def torrent_remove(self, info_hash):
+        self._send(struct.pack('!BB20s', CONTROL_VERSION, TORRENT_REMOVE, binascii.unhexlify(info_hash)))
+
+    def seedbank_set(self, seedbank):
+        self._send(struct.pack('!BBiH16s', CONTROL_VERSION, SEEDBANK_SET, seedbank.id,
+                               seedbank.ip_port, self._pack_address(seedbank.ip_address)))
+
+    def seedbank_remove(self, seedbank_id):
+        self._send(struct.pack('!BBi', CONTROL_VERSION, SEEDBANK_REMOVE, seedbank_id))
+
+    def _pack_address(self, ip_address):
+        if ':' in ip_address:
+            return socket.inet_pton(socket.AF_INET6, ip_address)
+        return '\0' * 10 + '\xff\xff' + socket.inet_aton(ip_address)
+
+    def _send(self, msg):
+        self._sock.sendto(msg, self._socket_path)
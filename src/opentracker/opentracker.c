@@ -48,6 +48,11 @@ int          g_self_pipe[2];
 char * g_serverdir;
 char * g_serveruser;
 unsigned int g_udp_workers;
+/* terasaur -- begin mod */
+int64_t      g_udp_socket = -1;
+unsigned int g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+size_t       g_torrent_lock_peers = OT_TORRENT_LOCK_PEERS_DEFAULT;
+/* terasaur -- end mod */
 
 static void panic( const char *routine ) {
   fprintf( stderr, "%s: %s\n", routine, strerror(errno) );
@@ -448,6 +453,15 @@ int opentracker_main() {
   /* Init all sub systems. This call may fail with an exit() */
   trackerlogic_init( );
 
+  /* terasaur -- begin mod */
+  /* UDP workers announce into the torrent buckets, so they start only once
+     trackerlogic_init has allocated them.  Without shards bound,
+     udp_init_shards starts nothing. */
+  udp_init_shards( );
+  if( g_udp_workers )
+    udp_init( g_udp_socket, g_udp_workers );
+  /* terasaur -- end mod */
+
   if( statefile )
     load_state( statefile );
 
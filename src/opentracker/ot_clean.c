@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 
 /* Libowfat */
 #include "io.h"
@@ -22,6 +23,9 @@
 #include "terasaur/ts_export.h"
 /* terasaur -- end mod */
 
+/* terasaur -- begin mod */
+#ifndef WANT_PEER_HASH
+/* terasaur -- end mod */
 /* Returns amount of removed peers */
 static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t timedout, int *removed_seeders ) {
   ot_peer *last_peer = peers + peer_count, *insert_point;
@@ -46,11 +50,50 @@ static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t ti
 
   return peers - insert_point;
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
+
+/* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+/* Same for a peer set.  The walk starts behind a free slot: removals only
+   shift peers back within their run, and no run crosses a free slot, so
+   every peer is aged exactly once.
+   Returns amount of removed peers */
+static size_t clean_peer_set( ot_vector *vector, time_t timedout, int *removed_seeders ) {
+  ot_peer *slots = vector->data;
+  size_t   mask = vector->space - 1, start = 0, n = 1, removed_peers = 0;
+
+  if( !vector->size ) return 0;
+  while( OT_PEER_SLOT_USED( slots + start ) )
+    ++start;
+
+  while( n <= mask ) {
+    ot_peer *peer = slots + ( ( start + n ) & mask );
+    time_t   timediff;
+
+    if( !OT_PEER_SLOT_USED( peer ) ) {
+      ++n;
+    } else if( ( timediff = timedout + OT_PEERTIME( peer ) ) < OT_PEER_TIMEOUT ) {
+      OT_PEERTIME( peer ) = timediff;
+      ++n;
+    } else {
+      /* The next peer may now be in this slot, look again */
+      if( OT_PEERFLAG( peer ) & PEER_FLAG_SEEDING )
+        (*removed_seeders)++;
+      vector_remove_peer_at( vector, peer );
+      ++removed_peers;
+    }
+  }
+  return removed_peers;
+}
+#endif
+/* terasaur -- end mod */
 
 /* Clean a single torrent
    return 1 if torrent timed out
 */
-int clean_single_torrent( ot_torrent *torrent ) {
+int clean_single_torrent( ot_torrent *torrent, ts_torrent_stats *stats ) {
 #ifdef _DEBUG
       ts_log_debug("ot_clean::clean_single_torrent: start");
 #endif
@@ -83,6 +126,20 @@ int clean_single_torrent( ot_torrent *torrent ) {
     bucket_list = (ot_vector *)bucket_list->data;
   }
 
+  /* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+  /* Peer sets never get buckets, so this runs once */
+  while( num_buckets-- ) {
+    size_t removed_peers = clean_peer_set( bucket_list, timedout, &removed_seeders );
+    peer_list->peer_count -= removed_peers;
+    vector_fixup_peers( bucket_list );
+    ++bucket_list;
+
+    if( removed_peers )
+      update_stats = 1;
+  }
+#else
+  /* terasaur -- end mod */
   while( num_buckets-- ) {
     size_t removed_peers = clean_single_bucket( bucket_list->data, bucket_list->size, timedout, &removed_seeders );
     peer_list->peer_count -= removed_peers;
@@ -97,6 +154,9 @@ int clean_single_torrent( ot_torrent *torrent ) {
     }
     /* terasaur -- end mod */
   }
+  /* terasaur -- begin mod */
+#endif
+  /* terasaur -- end mod */
 
   peer_list->seed_count -= removed_seeders;
 
@@ -113,14 +173,14 @@ int clean_single_torrent( ot_torrent *torrent ) {
   }
 
   /* terasaur -- begin mod */
-  if (update_stats == 1) {
-#ifdef _DEBUG
-      ts_log_debug("ot_clean::clean_single_torrent: calling ts_update_torrent_stats");
-#endif
-      ts_update_torrent_stats(torrent, 0);
+  /* Caller holds the bucket lock, so only take a snapshot here.  Counts an
+     announce held back for the stats writer's minimum interval are due here
+     too, even if no peers timed out */
+  if (stats && (update_stats == 1 || ts_torrent_stats_due(peer_list))) {
 #ifdef _DEBUG
-      ts_log_debug("ot_clean::clean_single_torrent: after ts_update_torrent_stats");
+      ts_log_debug("ot_clean::clean_single_torrent: calling ts_snapshot_torrent_stats");
 #endif
+      ts_snapshot_torrent_stats(torrent, 0, stats);
   }
   /* terasaur -- end mod */
 
@@ -136,6 +196,15 @@ static void * clean_worker( void * args ) {
 #ifdef _DEBUG
   ts_log_debug("ot_clean::clean_worker: start");
 #endif
+  /* terasaur -- begin mod */
+  /* Stats snapshots for one bucket, published after the bucket is unlocked */
+  ts_torrent_stats *stats_list = NULL;
+  size_t            stats_space = 0;
+  /* Torrents with their own lock in one bucket, cleaned after it is unlocked */
+  ot_torrent       *own_list = NULL;
+  size_t            own_space = 0;
+  mutex_bucket_caller( OT_LOCK_CLEAN );
+  /* terasaur -- end mod */
   (void) args;
   while( 1 ) {
     int bucket = OT_BUCKET_COUNT;
@@ -143,10 +212,51 @@ static void * clean_worker( void * args ) {
       ot_vector *torrents_list = mutex_bucket_lock( bucket );
       size_t     toffs;
       int        delta_torrentcount = 0;
+      /* terasaur -- begin mod */
+      size_t     stats_count = 0, soffs, own_count = 0, ooffs;
 
-      for( toffs=0; toffs<torrents_list->size; ++toffs ) {
+      if( torrents_list->size > stats_space ) {
+        ts_torrent_stats *new_list = realloc( stats_list, torrents_list->size * sizeof( ts_torrent_stats ) );
+        if( new_list ) {
+          stats_list = new_list;
+          stats_space = torrents_list->size;
+        }
+      }
+      /* terasaur -- end mod */
+
+      /* terasaur -- begin mod */
+      for( toffs=0; toffs<OT_TORRENT_SLOTS( torrents_list ); ++toffs ) {
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + toffs;
-        if( clean_single_torrent( torrent ) ) {
+        ts_torrent_stats *stats = stats_count < stats_space ? stats_list + stats_count : NULL;
+        ot_peerlist      *peer_list = torrent->peer_list;
+        if( !peer_list )
+          continue;
+        if( stats )
+          stats->changed = 0;
+
+        /* Keep the torrent's own lock until it is down to half the peers
+           that earned it, so it does not flip back and forth */
+        if( peer_list->lock && ( peer_list->peer_count >= g_torrent_lock_peers / 2 || !mutex_torrent_demote( peer_list ) ) ) {
+          if( own_count == own_space ) {
+            ot_torrent *new_list = realloc( own_list, ( own_space + 16 ) * sizeof( ot_torrent ) );
+            if( new_list ) {
+              own_list = new_list;
+              own_space += 16;
+            }
+          }
+          if( own_count < own_space ) {
+            mutex_torrent_hold( peer_list );
+            own_list[own_count++] = *torrent;
+          } else {
+            /* Out of memory, clean it the slow way with the bucket locked */
+            mutex_torrent_lock( peer_list );
+            clean_single_torrent( torrent, NULL );
+            mutex_torrent_unlock( peer_list );
+          }
+          continue;
+        }
+        /* terasaur -- end mod */
+        if( clean_single_torrent( torrent, stats ) ) {
             /* terasaur -- begin mod */
             /*
             torrent->peer_list->peer_count = 0;
@@ -168,13 +278,45 @@ static void * clean_worker( void * args ) {
           --delta_torrentcount;
           --toffs;
         }
+        /* terasaur -- begin mod */
+        else if( stats && stats->changed )
+          ++stats_count;
+        /* terasaur -- end mod */
 #ifdef _DEBUG
         ts_log_debug("ot_clean::clean_worker: after if clean_single_torrent block");
 #endif
       }
       mutex_bucket_unlock( bucket, delta_torrentcount );
-      if( !g_opentracker_running )
+
+      /* terasaur -- begin mod */
+      for( soffs=0; soffs<stats_count; ++soffs )
+        ts_update_torrent_stats( stats_list + soffs );
+
+      /* Torrents with their own lock only removed peers and are not removed
+         themselves, that waits until they got their lock dropped */
+      for( ooffs=0; ooffs<own_count; ++ooffs ) {
+        ot_peerlist     *peer_list = own_list[ooffs].peer_list;
+        ts_torrent_stats stats;
+        stats.changed = 0;
+        mutex_torrent_lock( peer_list );
+        clean_single_torrent( own_list + ooffs, &stats );
+        mutex_torrent_unlock( peer_list );
+        mutex_torrent_release( peer_list );
+        if( stats.changed )
+          ts_update_torrent_stats( &stats );
+      }
+#ifdef WANT_LOCKLESS_SCRAPE
+      /* Free what this and earlier passes removed, once scrapes are done with it */
+      ts_epoch_reclaim( );
+#endif
+      /* terasaur -- end mod */
+      if( !g_opentracker_running ) {
+        /* terasaur -- begin mod */
+        free( stats_list );
+        free( own_list );
+        /* terasaur -- end mod */
         return NULL;
+      }
       usleep( OT_CLEAN_SLEEP );
     }
 #ifdef _DEBUG
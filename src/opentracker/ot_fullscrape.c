@@ -58,6 +58,9 @@ static void * fullscrape_worker( void * args ) {
   struct iovec *iovector;
 
   (void) args;
+  /* terasaur -- begin mod */
+  mutex_bucket_caller( OT_LOCK_FULLSCRAPE );
+  /* terasaur -- end mod */
 
   while( 1 ) {
     ot_tasktype tasktype = TASK_FULLSCRAPE;
@@ -151,15 +154,29 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
 
   /* For each bucket... */
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    /* Get exclusive access to that bucket */
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
+    /* terasaur -- begin mod */
+    /* Get shared access to that bucket, other scrapes may read it as well */
+    ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+    /* terasaur -- end mod */
     size_t tor_offset;
 
     /* For each torrent in this bucket.. */
-    for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
+    /* terasaur -- begin mod */
+    for( tor_offset=0; tor_offset<OT_TORRENT_SLOTS( torrents_list ); ++tor_offset ) {
+    /* terasaur -- end mod */
       /* Address torrents members */
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
       ot_hash     *hash      =&( ((ot_torrent*)(torrents_list->data))[tor_offset] ).hash;
+      /* terasaur -- begin mod */
+      size_t       seeds, leechers;
+      if( !peer_list )
+        continue;
+      /* Torrents with their own lock change their counters behind the
+         bucket's back, so seeds may briefly outnumber peers */
+      seeds    = peer_list->seed_count;
+      leechers = peer_list->peer_count;
+      leechers = leechers > seeds ? leechers - seeds : 0;
+      /* terasaur -- end mod */
 
       switch( mode & TASK_TASK_MASK ) {
       case TASK_FULLSCRAPE:
@@ -168,22 +185,22 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
         *r++='2'; *r++='0'; *r++=':';
         memcpy( r, hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
         /* push rest of the scrape string */
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count );
+        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", seeds, peer_list->down_count, leechers );
 
         break;
       case TASK_FULLSCRAPE_TPB_ASCII:
         to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        r += sprintf( r, ":%zd:%zd\n", seeds, leechers );
         break;
       case TASK_FULLSCRAPE_TPB_BINARY:
         memcpy( r, *hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
-        *(uint32_t*)(r+0) = htonl( (uint32_t)  peer_list->seed_count );
-        *(uint32_t*)(r+4) = htonl( (uint32_t)( peer_list->peer_count-peer_list->seed_count) );
+        *(uint32_t*)(r+0) = htonl( (uint32_t)  seeds );
+        *(uint32_t*)(r+4) = htonl( (uint32_t)  leechers );
         r+=8;
         break;
       case TASK_FULLSCRAPE_TPB_URLENCODED:
         r += fmt_urlencoded( r, (char *)*hash, 20 );
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        r += sprintf( r, ":%zd:%zd\n", seeds, leechers );
         break;
       case TASK_FULLSCRAPE_TRACKERSTATE:
         to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
@@ -206,13 +223,17 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
       /* Check if there still is enough buffer left */
       while( r >= re )
        if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
-         return mutex_bucket_unlock( bucket, 0 );
+         /* terasaur -- begin mod */
+         return mutex_bucket_unlock_shared( bucket );
+         /* terasaur -- end mod */
 
       IF_COMPRESSION( r = compress_buffer; )
     }
 
     /* All torrents done: release lock on current bucket */
-    mutex_bucket_unlock( bucket, 0 );
+    /* terasaur -- begin mod */
+    mutex_bucket_unlock_shared( bucket );
+    /* terasaur -- end mod */
 
     /* Parent thread died? */
     if( !g_opentracker_running )
@@ -232,7 +253,10 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
 
     while( r >= re )
       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_FINISH ) ) )
-        return mutex_bucket_unlock( bucket, 0 );
+        /* terasaur -- begin mod */
+        /* The bucket loop is done, no bucket lock is held here */
+        return;
+        /* terasaur -- end mod */
     deflateEnd(&strm);
   }
 #endif
@@ -178,6 +178,10 @@ static const ot_keywords keywords_mode[] =
     { "top100", TASK_STATS_TOP100 }, { "top10", TASK_STATS_TOP10 }, { "renew", TASK_STATS_RENEW }, { "syncs", TASK_STATS_SYNCS }, { "version", TASK_STATS_VERSION },
     { "everything", TASK_STATS_EVERYTHING }, { "statedump", TASK_FULLSCRAPE_TRACKERSTATE }, { "fulllog", TASK_STATS_FULLLOG },
     { "woodpeckers", TASK_STATS_WOODPECKERS},
+    /* terasaur -- begin mod */
+    { "torrentdb", TASK_STATS_TORRENTDB }, { "locks", TASK_STATS_LOCKS },
+    { "slab", TASK_STATS_SLAB },
+    /* terasaur -- end mod */
 #ifdef WANT_LOG_NUMWANT
     { "numwants", TASK_STATS_NUMWANTS},
 #endif
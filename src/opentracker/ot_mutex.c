@@ -4,9 +4,21 @@
    $id$ */
 
 /* System */
+/* terasaur -- begin mod */
+/* for PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP */
+#define _GNU_SOURCE
+/* terasaur -- end mod */
 #include <pthread.h>
+/* terasaur -- begin mod */
+#include <sched.h>
+#include <semaphore.h>
+/* terasaur -- end mod */
 #include <stdio.h>
 #include <stdlib.h>
+/* terasaur -- begin mod */
+#include <string.h>
+#include <time.h>
+/* terasaur -- end mod */
 #include <sys/mman.h>
 #include <sys/uio.h>
 
@@ -19,71 +31,138 @@
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_stats.h"
+/* terasaur -- begin mod */
+#include "ot_iovec.h"
+/* terasaur -- end mod */
 
 /* #define MTX_DBG( STRING ) fprintf( stderr, STRING ) */
 #define MTX_DBG( STRING )
 
-/* Our global all torrents list */
-static ot_vector all_torrents[OT_BUCKET_COUNT];
+/* terasaur -- begin mod */
+/* Our global all torrents list, allocated in mutex_init */
+static ot_vector *all_torrents;
+/* Changed with atomic adds, so it needs no lock of its own */
 static size_t    g_torrent_count;
 
-/* Bucket Magic */
-static int bucket_locklist[ OT_MAX_THREADS ];
-static int bucket_locklist_count = 0;
-static pthread_mutex_t bucket_mutex;
-static pthread_cond_t bucket_being_unlocked;
-
-/* Self pipe from opentracker.c */
-extern int g_self_pipe[2];
-
-static int bucket_check( int bucket ) {
-  /* C should come with auto-i ;) */
-  int i;
+/* Bucket Magic: one reader/writer lock per bucket.  Announces and the clean
+   worker take it exclusively, scrapes and stats walks only read and share it.
+   Each lock sits on its own cache line, so workers on neighbouring buckets do
+   not bounce each other's lines.  Where available, waiting writers keep new
+   readers out, so a stream of scrapes cannot starve announces. */
+#define OT_CACHELINE_SIZE 64
+typedef struct {
+  pthread_rwlock_t lock;
+#ifdef WANT_LOCKLESS_SCRAPE
+  /* Odd while a writer holds the bucket, see mutex_bucket_read_begin */
+  volatile unsigned int seq;
+#endif
+  /* Times a locker found the bucket taken, for the lock stats */
+  unsigned int contended;
+} __attribute__((aligned(OT_CACHELINE_SIZE))) ot_bucket_lock;
+
+static ot_bucket_lock *bucket_locks;
+
+/* Lock stats: wait and hold times per caller, in histograms of powers of two
+   microseconds.  Bin 0 counts times under 1us, bin n times under 2^n us, the
+   last bin everything longer.  Each thread keeps its own histograms, so
+   recording is a few unshared adds; mutex_stats_locks sums them up.  Times
+   are only taken from the clock when needed: a lock that was free right away
+   is recorded as no wait without looking. */
+#define OT_LOCK_HIST_BINS 24
+#define OT_LOCK_TOP_BUCKETS 10
+
+typedef struct ot_lock_stats {
+  unsigned long long    wait[OT_LOCK_CALLER_COUNT][OT_LOCK_HIST_BINS];
+  unsigned long long    hold[OT_LOCK_CALLER_COUNT][OT_LOCK_HIST_BINS];
+  unsigned long long    wait_us[OT_LOCK_CALLER_COUNT];
+  unsigned long long    hold_us[OT_LOCK_CALLER_COUNT];
+  struct ot_lock_stats *next;
+} ot_lock_stats;
+
+static ot_lock_stats * volatile lock_stats_list;
+static __thread ot_lock_stats  *thread_lock_stats;
+static __thread ot_lock_caller  thread_lock_caller;
+static __thread ot_lock_caller  thread_lock_holder;
+static __thread uint64_t        thread_lock_acquired;
+
+static const char *lock_caller_names[OT_LOCK_CALLER_COUNT] =
+  { "other", "announce", "scrape", "clean", "fullscrape", "stats" };
+
+static uint64_t lock_clock( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-  /* No more space to acquire lock to bucket -- should not happen */
-  if( bucket_locklist_count == OT_MAX_THREADS ) {
-    fprintf( stderr, "More lock requests than mutexes. Consult source code.\n" );
-    return -1;
+static int lock_hist_bin( uint64_t us ) {
+  int bin = 0;
+  while( us && ( bin < OT_LOCK_HIST_BINS - 1 ) ) {
+    us >>= 1;
+    ++bin;
   }
-
-  /* See, if bucket is already locked */
-  for( i=0; i<bucket_locklist_count; ++i )
-    if( bucket_locklist[ i ] == bucket ) {
-      stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
-      return -1;
-    }
-
-  return 0;
+  return bin;
 }
 
-static void bucket_push( int bucket ) {
-  bucket_locklist[ bucket_locklist_count++ ] = bucket;
+/* Blocks are never freed, threads taking bucket locks live as long as the tracker */
+static ot_lock_stats *lock_stats_get( void ) {
+  ot_lock_stats *stats = thread_lock_stats;
+  if( !stats && ( stats = calloc( 1, sizeof( ot_lock_stats ) ) ) ) {
+    do
+      stats->next = lock_stats_list;
+    while( !__sync_bool_compare_and_swap( &lock_stats_list, stats->next, stats ) );
+    thread_lock_stats = stats;
+  }
+  return stats;
 }
 
-static void bucket_remove( int bucket ) {
-  int i = 0;
+/* wait_start is 0 if the lock was taken without waiting */
+static void lock_acquired( uint64_t wait_start ) {
+  ot_lock_stats *stats = lock_stats_get( );
+  uint64_t now = lock_clock( ), wait_us = wait_start ? ( now - wait_start ) / 1000 : 0;
 
-  while( ( i < bucket_locklist_count ) && ( bucket_locklist[ i ] != bucket ) )
-    ++i;
-
-  if( i == bucket_locklist_count ) {
-    fprintf( stderr, "Request to unlock bucket that was never locked. Consult source code.\n" );
-    return;
+  thread_lock_holder   = thread_lock_caller;
+  thread_lock_acquired = now;
+  if( stats ) {
+    stats->wait[thread_lock_holder][lock_hist_bin( wait_us )]++;
+    stats->wait_us[thread_lock_holder] += wait_us;
   }
+}
 
-  for( ; i < bucket_locklist_count - 1; ++i )
-    bucket_locklist[ i ] = bucket_locklist[ i + 1 ];
+static void lock_released( void ) {
+  ot_lock_stats *stats = thread_lock_stats;
+  uint64_t hold_us = ( lock_clock( ) - thread_lock_acquired ) / 1000;
 
-  --bucket_locklist_count;
+  if( stats ) {
+    stats->hold[thread_lock_holder][lock_hist_bin( hold_us )]++;
+    stats->hold_us[thread_lock_holder] += hold_us;
+  }
 }
 
+/* Set what the calling thread takes bucket locks for from now on */
+void mutex_bucket_caller( ot_lock_caller caller ) {
+  thread_lock_caller = caller;
+}
+/* terasaur -- end mod */
+
+/* Self pipe from opentracker.c */
+extern int g_self_pipe[2];
+
 /* Can block */
 ot_vector *mutex_bucket_lock( int bucket ) {
-  pthread_mutex_lock( &bucket_mutex );
-  while( bucket_check( bucket ) )
-    pthread_cond_wait( &bucket_being_unlocked, &bucket_mutex );
-  bucket_push( bucket );
-  pthread_mutex_unlock( &bucket_mutex );
+  /* terasaur -- begin mod */
+  pthread_rwlock_t *lock = &bucket_locks[ bucket ].lock;
+  uint64_t wait_start = 0;
+  if( pthread_rwlock_trywrlock( lock ) ) {
+    stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
+    __sync_fetch_and_add( &bucket_locks[ bucket ].contended, 1 );
+    wait_start = lock_clock( );
+    pthread_rwlock_wrlock( lock );
+  }
+  lock_acquired( wait_start );
+#ifdef WANT_LOCKLESS_SCRAPE
+  __sync_add_and_fetch( &bucket_locks[ bucket ].seq, 1 );
+#endif
+  /* terasaur -- end mod */
   return all_torrents + bucket;
 }
 
@@ -92,245 +171,511 @@ ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
 }
 
 void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
-  pthread_mutex_lock( &bucket_mutex );
-  bucket_remove( bucket );
-  g_torrent_count += delta_torrentcount;
-  pthread_cond_broadcast( &bucket_being_unlocked );
-  pthread_mutex_unlock( &bucket_mutex );
+  /* terasaur -- begin mod */
+  if( delta_torrentcount )
+    __sync_fetch_and_add( &g_torrent_count, (size_t)(ssize_t)delta_torrentcount );
+#ifdef WANT_LOCKLESS_SCRAPE
+  __sync_add_and_fetch( &bucket_locks[ bucket ].seq, 1 );
+#endif
+  lock_released( );
+  pthread_rwlock_unlock( &bucket_locks[ bucket ].lock );
+  /* terasaur -- end mod */
 }
 
 void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
   mutex_bucket_unlock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT, delta_torrentcount );
 }
 
+/* terasaur -- begin mod */
+/* Shared access for code that only reads the bucket, e.g. scrapes.  Nothing in
+   the bucket may be changed while holding it, not even expired peers. */
+ot_vector *mutex_bucket_lock_shared( int bucket ) {
+  pthread_rwlock_t *lock = &bucket_locks[ bucket ].lock;
+  uint64_t wait_start = 0;
+  if( pthread_rwlock_tryrdlock( lock ) ) {
+    stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
+    __sync_fetch_and_add( &bucket_locks[ bucket ].contended, 1 );
+    wait_start = lock_clock( );
+    pthread_rwlock_rdlock( lock );
+  }
+  lock_acquired( wait_start );
+  return all_torrents + bucket;
+}
+
+ot_vector *mutex_bucket_lock_shared_by_hash( ot_hash hash ) {
+  return mutex_bucket_lock_shared( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
+}
+
+void mutex_bucket_unlock_shared( int bucket ) {
+  lock_released( );
+  pthread_rwlock_unlock( &bucket_locks[ bucket ].lock );
+}
+
+void mutex_bucket_unlock_shared_by_hash( ot_hash hash ) {
+  mutex_bucket_unlock_shared( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
+}
+
+#ifdef WANT_LOCKLESS_SCRAPE
+/* Lockless reads: every exclusive holder bumps the bucket's sequence number
+   on lock and on unlock.  A reader notes the number, reads, and starts over
+   if mutex_bucket_read_retry says a writer was in between.  Readers must be
+   inside ts_epoch_enter/leave, so that anything a writer retires while they
+   look at it is not freed under them. */
+ot_vector *mutex_bucket_read_begin( ot_hash hash, unsigned int *seq ) {
+  int bucket = uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT;
+  *seq = bucket_locks[ bucket ].seq;
+  __sync_synchronize( );
+  return all_torrents + bucket;
+}
+
+int mutex_bucket_read_retry( ot_hash hash, unsigned int seq ) {
+  int bucket = uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT;
+  __sync_synchronize( );
+  return ( seq & 1 ) || ( bucket_locks[ bucket ].seq != seq );
+}
+#endif
+
+/* Torrent locks: a torrent with g_torrent_lock_peers peers or more gets a
+   mutex of its own.  Announces still find it under the bucket lock, but take
+   a reference, hand the bucket back and only then work on the peer list under
+   the torrent's mutex.  So one busy torrent no longer holds up every other
+   torrent in its bucket.
+
+   The peer list and the lock stay put as long as there are references:
+   removing a torrent or dropping its lock needs the bucket exclusively and no
+   references.  Whoever holds the torrent's mutex must not wait for a bucket
+   lock, the order is always bucket first. */
+struct ot_torrent_lock {
+  pthread_mutex_t       mutex;
+  volatile unsigned int refs;
+} __attribute__((aligned(OT_CACHELINE_SIZE)));
+
+static unsigned int       torrent_locks;
+static unsigned long long torrent_lock_promotions;
+static unsigned long long torrent_lock_demotions;
+static unsigned long long torrent_lock_contended;
+
+/* Caller holds the torrent's bucket exclusively.
+   return 0 if the torrent has to stay with the bucket lock */
+int mutex_torrent_promote( ot_peerlist *peer_list ) {
+  struct ot_torrent_lock *lock;
+  if( posix_memalign( (void**)&lock, OT_CACHELINE_SIZE, sizeof( struct ot_torrent_lock ) ) )
+    return 0;
+  pthread_mutex_init( &lock->mutex, NULL );
+  lock->refs = 0;
+  peer_list->lock = lock;
+  __sync_fetch_and_add( &torrent_locks, 1 );
+  __sync_fetch_and_add( &torrent_lock_promotions, 1 );
+  return 1;
+}
+
+/* Caller holds the torrent's bucket exclusively.
+   return 0 if someone still holds a reference and the lock has to stay */
+int mutex_torrent_demote( ot_peerlist *peer_list ) {
+  struct ot_torrent_lock *lock = peer_list->lock;
+  if( !lock )
+    return 1;
+  if( lock->refs )
+    return 0;
+  peer_list->lock = NULL;
+  pthread_mutex_destroy( &lock->mutex );
+  free( lock );
+  __sync_fetch_and_sub( &torrent_locks, 1 );
+  __sync_fetch_and_add( &torrent_lock_demotions, 1 );
+  return 1;
+}
+
+/* Caller holds the torrent's bucket, in any mode */
+void mutex_torrent_hold( ot_peerlist *peer_list ) {
+  __sync_fetch_and_add( &peer_list->lock->refs, 1 );
+}
+
+/* Caller holds a reference or the torrent's bucket.  Can block */
+void mutex_torrent_lock( ot_peerlist *peer_list ) {
+  pthread_mutex_t *mutex = &peer_list->lock->mutex;
+  if( pthread_mutex_trylock( mutex ) ) {
+    __sync_fetch_and_add( &torrent_lock_contended, 1 );
+    pthread_mutex_lock( mutex );
+  }
+}
+
+void mutex_torrent_unlock( ot_peerlist *peer_list ) {
+  pthread_mutex_unlock( &peer_list->lock->mutex );
+}
+
+void mutex_torrent_release( ot_peerlist *peer_list ) {
+  __sync_fetch_and_sub( &peer_list->lock->refs, 1 );
+}
+/* terasaur -- end mod */
+
 size_t mutex_get_torrent_count( ) {
-  size_t torrent_count;
-  pthread_mutex_lock( &bucket_mutex );
-  torrent_count = g_torrent_count;
-  pthread_mutex_unlock( &bucket_mutex );
-  return torrent_count;
+  /* terasaur -- begin mod */
+  return __sync_fetch_and_add( &g_torrent_count, 0 );
+  /* terasaur -- end mod */
+}
+
+/* terasaur -- begin mod */
+static char *lock_stats_hist( char *r, const char *caller, const char *what, unsigned long long *hist ) {
+  int bin = 0;
+  while( ( bin < OT_LOCK_HIST_BINS ) && !hist[bin] )
+    ++bin;
+  if( bin == OT_LOCK_HIST_BINS )
+    return r;
+
+  r += sprintf( r, "%s %s:", caller, what );
+  for( ; bin<OT_LOCK_HIST_BINS; ++bin )
+    if( hist[bin] ) {
+      if( bin == OT_LOCK_HIST_BINS - 1 )
+        r += sprintf( r, " >=%dus:%llu", 1 << ( bin - 1 ), hist[bin] );
+      else
+        r += sprintf( r, " <%dus:%llu", 1 << bin, hist[bin] );
+    }
+  *r++ = '\n';
+  return r;
+}
+
+/* Needs about 12kB of room in the worst case */
+size_t mutex_stats_locks( char *reply ) {
+  static ot_lock_stats total;
+  static pthread_mutex_t total_mutex = PTHREAD_MUTEX_INITIALIZER;
+  struct { int bucket; unsigned int contended; } top[OT_LOCK_TOP_BUCKETS];
+  ot_lock_stats *stats;
+  char *r = reply;
+  int caller, bin, bucket, i;
+
+  /* Sum the threads' histograms, their owners keep writing meanwhile */
+  pthread_mutex_lock( &total_mutex );
+  memset( &total, 0, sizeof( total ) );
+  for( stats = lock_stats_list; stats; stats = stats->next )
+    for( caller=0; caller<OT_LOCK_CALLER_COUNT; ++caller ) {
+      for( bin=0; bin<OT_LOCK_HIST_BINS; ++bin ) {
+        total.wait[caller][bin] += stats->wait[caller][bin];
+        total.hold[caller][bin] += stats->hold[caller][bin];
+      }
+      total.wait_us[caller] += stats->wait_us[caller];
+      total.hold_us[caller] += stats->hold_us[caller];
+    }
+
+  r += sprintf( r, "caller locks wait_total_us hold_total_us\n" );
+  for( caller=0; caller<OT_LOCK_CALLER_COUNT; ++caller ) {
+    unsigned long long locks = 0;
+    for( bin=0; bin<OT_LOCK_HIST_BINS; ++bin )
+      locks += total.wait[caller][bin];
+    r += sprintf( r, "%s %llu %llu %llu\n", lock_caller_names[caller], locks, total.wait_us[caller], total.hold_us[caller] );
+  }
+  for( caller=0; caller<OT_LOCK_CALLER_COUNT; ++caller ) {
+    r = lock_stats_hist( r, lock_caller_names[caller], "wait", total.wait[caller] );
+    r = lock_stats_hist( r, lock_caller_names[caller], "hold", total.hold[caller] );
+  }
+  pthread_mutex_unlock( &total_mutex );
+
+  /* Insertion into a short sorted list, most contended first */
+  memset( top, 0, sizeof( top ) );
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    unsigned int contended = bucket_locks[ bucket ].contended;
+    if( contended <= top[OT_LOCK_TOP_BUCKETS-1].contended )
+      continue;
+    for( i=OT_LOCK_TOP_BUCKETS-1; ( i > 0 ) && ( contended > top[i-1].contended ); --i )
+      top[i] = top[i-1];
+    top[i].bucket = bucket;
+    top[i].contended = contended;
+  }
+
+  r += sprintf( r, "bucket contended torrents\n" );
+  for( i=0; ( i < OT_LOCK_TOP_BUCKETS ) && top[i].contended; ++i )
+    r += sprintf( r, "%d %u %zu\n", top[i].bucket, top[i].contended, all_torrents[ top[i].bucket ].size );
+
+  r += sprintf( r, "torrent_locks promotions demotions contended\n%u %llu %llu %llu\n",
+                __sync_fetch_and_add( &torrent_locks, 0 ), __sync_fetch_and_add( &torrent_lock_promotions, 0 ),
+                __sync_fetch_and_add( &torrent_lock_demotions, 0 ), __sync_fetch_and_add( &torrent_lock_contended, 0 ) );
+
+  return r - reply;
 }
+/* terasaur -- end mod */
 
 /* TaskQueue Magic */
 
+/* terasaur -- begin mod */
+/* Tasks live in a fixed table of slots, so queueing never allocates.  Each
+   task class (TASK_CLASS_MASK) has its own ring of queued slot numbers that
+   its worker pops from, finished slots go through a single completion ring
+   that the main loop drains, and free slots are kept in a ring as well.  All
+   rings are bounded multi producer, multi consumer queues using atomic
+   builtins; every operation but canceltask is O(1).
+
+   A slot changes state with compare and swap only:
+     FREE -> QUEUED      pushtask, main loop
+     QUEUED -> RUNNING   poptask, worker
+     RUNNING -> DONE     pushresult, worker
+     DONE -> FREE        popresult, main loop
+   canceltask may move QUEUED, RUNNING or DONE to CANCELED, whoever next
+   sees the slot then returns it to the free ring. */
+#define OT_TASK_SLOT_BITS 10
+#define OT_TASK_SLOTS (1<<OT_TASK_SLOT_BITS)
+#define OT_TASK_SLOT_MASK (OT_TASK_SLOTS-1)
+#define OT_TASK_CLASSES ((TASK_CLASS_MASK>>8)+1)
+
+enum { TASK_SLOT_FREE, TASK_SLOT_QUEUED, TASK_SLOT_RUNNING, TASK_SLOT_DONE, TASK_SLOT_CANCELED };
+
 struct ot_task {
   ot_taskid       taskid;
   ot_tasktype     tasktype;
   int64           sock;
   int             iovec_entries;
   struct iovec   *iovec;
-  struct ot_task *next;
+  volatile int    state;
 };
 
+typedef struct {
+  volatile unsigned int seq;
+  unsigned int          slot;
+} ot_ring_cell;
+
+/* Producers and consumers each get their own cache line */
+typedef struct {
+  volatile unsigned int head __attribute__((aligned(OT_CACHELINE_SIZE)));
+  volatile unsigned int tail __attribute__((aligned(OT_CACHELINE_SIZE)));
+  ot_ring_cell          cells[OT_TASK_SLOTS];
+} ot_ring;
+
+static struct ot_task tasks[OT_TASK_SLOTS];
 static ot_taskid next_free_taskid = 1;
-static struct ot_task *tasklist;
-static pthread_mutex_t tasklist_mutex;
-static pthread_cond_t tasklist_being_filled;
+static ot_ring free_ring, done_ring;
+static ot_ring task_rings[OT_TASK_CLASSES];
+static sem_t tasks_queued[OT_TASK_CLASSES];
+
+static void ring_init( ot_ring *ring ) {
+  unsigned int i;
+  ring->head = ring->tail = 0;
+  for( i=0; i<OT_TASK_SLOTS; ++i )
+    ring->cells[i].seq = i;
+}
 
-int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
-  struct ot_task ** tmptask, * task;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushtask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushtask locked.\n" );
-
-  task = malloc(sizeof( struct ot_task));
-  if( !task ) {
-    MTX_DBG( "pushtask fail unlocks.\n" );
-    pthread_mutex_unlock( &tasklist_mutex );
-    MTX_DBG( "pushtask fail unlocked.\n" );
-    return -1;
+/* Returns -1 if the ring is full */
+static int ring_push( ot_ring *ring, unsigned int slot ) {
+  unsigned int pos = ring->head;
+  ot_ring_cell *cell;
+
+  while( 1 ) {
+    int dif;
+    cell = ring->cells + ( pos & OT_TASK_SLOT_MASK );
+    dif = (int)( cell->seq - pos );
+    if( !dif ) {
+      if( __sync_bool_compare_and_swap( &ring->head, pos, pos + 1 ) )
+        break;
+    } else if( dif < 0 )
+      return -1;
+    pos = ring->head;
   }
 
-  /* Skip to end of list */
-  tmptask = &tasklist;
-  while( *tmptask )
-    tmptask = &(*tmptask)->next;
-  *tmptask = task;
-
-  task->taskid        = 0;
-  task->tasktype      = tasktype;
-  task->sock          = sock;
-  task->iovec_entries = 0;
-  task->iovec         = NULL;
-  task->next          = 0;
-
-  /* Inform waiting workers and release lock */
-  MTX_DBG( "pushtask broadcasts.\n" );
-  pthread_cond_broadcast( &tasklist_being_filled );
-  MTX_DBG( "pushtask broadcasted, mutex unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushtask end mutex unlocked.\n" );
+  cell->slot = slot;
+  __sync_synchronize( );
+  cell->seq = pos + 1;
   return 0;
 }
 
-void mutex_workqueue_canceltask( int64 sock ) {
-  struct ot_task ** task;
+/* Returns -1 if the ring is empty */
+static int ring_pop( ot_ring *ring, unsigned int *slot ) {
+  unsigned int pos = ring->tail;
+  ot_ring_cell *cell;
+
+  while( 1 ) {
+    int dif;
+    cell = ring->cells + ( pos & OT_TASK_SLOT_MASK );
+    dif = (int)( cell->seq - ( pos + 1 ) );
+    if( !dif ) {
+      if( __sync_bool_compare_and_swap( &ring->tail, pos, pos + 1 ) )
+        break;
+    } else if( dif < 0 )
+      return -1;
+    pos = ring->tail;
+  }
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "canceltask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "canceltask locked.\n" );
+  __sync_synchronize( );
+  *slot = cell->slot;
+  __sync_synchronize( );
+  cell->seq = pos + OT_TASK_SLOTS;
+  return 0;
+}
 
-  task = &tasklist;
-  while( *task && ( (*task)->sock != sock ) )
-    *task = (*task)->next;
+static void task_release( unsigned int slot ) {
+  tasks[slot].state = TASK_SLOT_FREE;
+  /* Cannot fail, the ring has room for every slot */
+  ring_push( &free_ring, slot );
+}
 
-  if( *task && ( (*task)->sock == sock ) ) {
-    struct iovec *iovec = (*task)->iovec;
-    struct ot_task *ptask = *task;
-    int i;
+int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
+  int tclass = ( tasktype & TASK_CLASS_MASK ) >> 8;
+  struct ot_task *task;
+  unsigned int slot;
 
-    /* Free task's iovec */
-    for( i=0; i<(*task)->iovec_entries; ++i )
-      munmap( iovec[i].iov_base, iovec[i].iov_len );
+  /* All slots busy */
+  if( ring_pop( &free_ring, &slot ) )
+    return -1;
 
-    *task = (*task)->next;
-    free( ptask );
-  }
+  task = tasks + slot;
+  task->taskid        = ( __sync_add_and_fetch( &next_free_taskid, 1 ) << OT_TASK_SLOT_BITS ) | slot;
+  task->tasktype      = tasktype;
+  task->sock          = sock;
+  task->iovec_entries = 0;
+  task->iovec         = NULL;
+  task->state         = TASK_SLOT_QUEUED;
 
-  /* Release lock */
-  MTX_DBG( "canceltask unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "canceltask unlocked.\n" );
+  /* The class ring holds every slot, so this cannot fail either */
+  ring_push( task_rings + tclass, slot );
+  sem_post( tasks_queued + tclass );
+  return 0;
 }
 
-ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
-  struct ot_task * task;
-  ot_taskid taskid = 0;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "poptask mutex locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "poptask mutex locked.\n" );
-
-  while( !taskid ) {
-    /* Skip to the first unassigned task this worker wants to do */
-    task = tasklist;
-    while( task && ( ( ( TASK_CLASS_MASK & task->tasktype ) != *tasktype ) || task->taskid ) )
-      task = task->next;
-
-    /* If we found an outstanding task, assign a taskid to it
-       and leave the loop */
-    if( task ) {
-      task->taskid = taskid = ++next_free_taskid;
-      *tasktype = task->tasktype;
-    } else {
-      /* Wait until the next task is being fed */
-      MTX_DBG( "poptask cond waits.\n" );
-      pthread_cond_wait( &tasklist_being_filled, &tasklist_mutex );
-      MTX_DBG( "poptask cond waited.\n" );
+/* Only called from the main loop when a connection dies while waiting, so
+   the scan over all slots does not matter */
+void mutex_workqueue_canceltask( int64 sock ) {
+  unsigned int slot;
+
+  for( slot=0; slot<OT_TASK_SLOTS; ++slot ) {
+    struct ot_task *task = tasks + slot;
+    int state = task->state;
+
+    while( state == TASK_SLOT_QUEUED || state == TASK_SLOT_RUNNING || state == TASK_SLOT_DONE ) {
+      if( task->sock != sock )
+        break;
+      if( __sync_bool_compare_and_swap( &task->state, state, TASK_SLOT_CANCELED ) ) {
+        /* Nobody else touches a finished task's results any more */
+        if( state == TASK_SLOT_DONE )
+          iovec_free( &task->iovec_entries, &task->iovec );
+        break;
+      }
+      state = task->state;
     }
   }
-
-  /* Release lock */
-  MTX_DBG( "poptask end mutex unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "poptask end mutex unlocked.\n" );
-
-  return taskid;
 }
 
-void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
-  struct ot_task ** task;
+ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
+  int tclass = ( *tasktype & TASK_CLASS_MASK ) >> 8;
+  unsigned int slot;
+
+  while( 1 ) {
+    /* Wait until the next task is being fed */
+    while( sem_wait( tasks_queued + tclass ) )
+      ;
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushsuccess locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushsuccess locked.\n" );
+    /* A second producer may still be filling in an earlier cell */
+    while( ring_pop( task_rings + tclass, &slot ) )
+      sched_yield( );
 
-  task = &tasklist;
-  while( *task && ( (*task)->taskid != taskid ) )
-    *task = (*task)->next;
+    if( __sync_bool_compare_and_swap( &tasks[slot].state, TASK_SLOT_QUEUED, TASK_SLOT_RUNNING ) )
+      break;
 
-  if( *task && ( (*task)->taskid == taskid ) ) {
-    struct ot_task *ptask = *task;
-    *task = (*task)->next;
-    free( ptask );
+    /* Cancelled before we got to it */
+    task_release( slot );
   }
 
-  /* Release lock */
-  MTX_DBG( "pushsuccess unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushsuccess unlocked.\n" );
+  *tasktype = tasks[slot].tasktype;
+  return tasks[slot].taskid;
+}
+
+void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
+  unsigned int slot = taskid & OT_TASK_SLOT_MASK;
+  if( tasks[slot].taskid == taskid )
+    task_release( slot );
 }
 
 int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
-  struct ot_task * task;
+  unsigned int slot = taskid & OT_TASK_SLOT_MASK;
+  struct ot_task *task = tasks + slot;
   const char byte = 'o';
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushresult locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushresult locked.\n" );
+  if( task->taskid != taskid )
+    return -1;
 
-  task = tasklist;
-  while( task && ( task->taskid != taskid ) )
-    task = task->next;
+  task->iovec_entries = iovec_entries;
+  task->iovec         = iovec;
 
-  if( task ) {
-    task->iovec_entries = iovec_entries;
-    task->iovec         = iovec;
-    task->tasktype      = TASK_DONE;
+  /* Indicate whether the worker has to throw away results */
+  if( !__sync_bool_compare_and_swap( &task->state, TASK_SLOT_RUNNING, TASK_SLOT_DONE ) ) {
+    task_release( slot );
+    return -1;
   }
 
-  /* Release lock */
-  MTX_DBG( "pushresult unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "pushresult unlocked.\n" );
-
+  ring_push( &done_ring, slot );
   io_trywrite( g_self_pipe[1], &byte, 1 );
-
-  /* Indicate whether the worker has to throw away results */
-  return task ? 0 : -1;
+  return 0;
 }
 
 int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
-  struct ot_task ** task;
-  int64 sock = -1;
-
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "popresult locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "popresult locked.\n" );
+  unsigned int slot;
 
-  task = &tasklist;
-  while( *task && ( (*task)->tasktype != TASK_DONE ) )
-    task = &(*task)->next;
+  while( !ring_pop( &done_ring, &slot ) ) {
+    struct ot_task *task = tasks + slot;
+    int64 sock = task->sock;
 
-  if( *task && ( (*task)->tasktype == TASK_DONE ) ) {
-    struct ot_task *ptask = *task;
-
-    *iovec_entries = (*task)->iovec_entries;
-    *iovec         = (*task)->iovec;
-    sock           = (*task)->sock;
+    /* canceltask already freed the results.  Only the main loop moves a
+       task on from DONE, so no compare and swap needed here */
+    if( task->state != TASK_SLOT_DONE ) {
+      task_release( slot );
+      continue;
+    }
 
-    *task = (*task)->next;
-    free( ptask );
+    *iovec_entries = task->iovec_entries;
+    *iovec         = task->iovec;
+    task_release( slot );
+    return sock;
   }
-
-  /* Release lock */
-  MTX_DBG( "popresult unlocks.\n" );
-  pthread_mutex_unlock( &tasklist_mutex );
-  MTX_DBG( "popresult unlocked.\n" );
-  return sock;
+  return -1;
 }
+/* terasaur -- end mod */
 
 void mutex_init( ) {
-  pthread_mutex_init(&tasklist_mutex, NULL);
-  pthread_cond_init (&tasklist_being_filled, NULL);
-  pthread_mutex_init(&bucket_mutex, NULL);
-  pthread_cond_init (&bucket_being_unlocked, NULL);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+  /* terasaur -- begin mod */
+  {
+    pthread_rwlockattr_t attr;
+    void *locks = NULL;
+    int i;
+
+    ring_init( &free_ring );
+    ring_init( &done_ring );
+    for( i=0; i<OT_TASK_CLASSES; ++i ) {
+      ring_init( task_rings + i );
+      sem_init( tasks_queued + i, 0, 0 );
+    }
+    for( i=0; i<OT_TASK_SLOTS; ++i )
+      ring_push( &free_ring, i );
+
+    all_torrents = calloc( OT_BUCKET_COUNT, sizeof( ot_vector ) );
+    if( !all_torrents || posix_memalign( &locks, OT_CACHELINE_SIZE, OT_BUCKET_COUNT * sizeof( ot_bucket_lock ) ) )
+      exerr( "Could not allocate torrent buckets." );
+    bucket_locks = locks;
+
+    pthread_rwlockattr_init( &attr );
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+    for( i=0; i<OT_BUCKET_COUNT; ++i ) {
+      pthread_rwlock_init( &bucket_locks[ i ].lock, &attr );
+      bucket_locks[ i ].contended = 0;
+#ifdef WANT_LOCKLESS_SCRAPE
+      bucket_locks[ i ].seq = 0;
+#endif
+    }
+    pthread_rwlockattr_destroy( &attr );
+  }
+  /* terasaur -- end mod */
 }
 
 void mutex_deinit( ) {
-  pthread_mutex_destroy(&bucket_mutex);
-  pthread_cond_destroy(&bucket_being_unlocked);
-  pthread_mutex_destroy(&tasklist_mutex);
-  pthread_cond_destroy(&tasklist_being_filled);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+  /* terasaur -- begin mod */
+  {
+    int i;
+    for( i=0; i<OT_BUCKET_COUNT; ++i )
+      pthread_rwlock_destroy( &bucket_locks[ i ].lock );
+    for( i=0; i<OT_TASK_CLASSES; ++i )
+      sem_destroy( tasks_queued + i );
+  }
+  free( bucket_locks );
+  free( all_torrents );
+  bucket_locks = NULL;
+  all_torrents = NULL;
+  /* terasaur -- end mod */
 }
 
 const char *g_version_mutex_c = "$Source: /home/cvsroot/opentracker/ot_mutex.c,v $: $Revision: 1.23 $\n";
@@ -30,6 +30,10 @@
 #include "ot_iovec.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+/* terasaur -- begin mod */
+#include "terasaur/ts_export.h"
+#include "terasaur/slab.h"
+/* terasaur -- end mod */
 
 #ifndef NO_FULLSCRAPE_LOGGING
 #define LOG_TO_STDERR( ... ) fprintf( stderr, __VA_ARGS__ )
@@ -222,12 +226,23 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
   size_t i;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( i=0; i<torrents_list->size; ++i ) {
+    /* terasaur -- begin mod */
+    ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+    for( i=0; i<OT_TORRENT_SLOTS( torrents_list ); ++i ) {
+    /* terasaur -- end mod */
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[i] ).peer_list;
       ot_vector   *bucket_list = &peer_list->peers;
       int          num_buckets = 1;
 
+      /* terasaur -- begin mod */
+      if( !peer_list )
+        continue;
+      /* Announces change the peers of torrents with their own lock without
+         the bucket lock */
+      if( peer_list->lock )
+        mutex_torrent_lock( peer_list );
+      /* terasaur -- end mod */
+
       if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
         num_buckets = bucket_list->size;
         bucket_list = (ot_vector *)bucket_list->data;
@@ -235,14 +250,31 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
 
       while( num_buckets-- ) {
         ot_peer *peers = (ot_peer*)bucket_list->data;
-        size_t   numpeers = bucket_list->size;
+        /* terasaur -- begin mod */
+        size_t   numpeers = OT_PEER_SLOTS( bucket_list );
         while( numpeers-- )
-          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
+          if( !OT_PEER_SLOT_USED( peers ) )
+            ++peers;
+          else
+        /* terasaur -- end mod */
+          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) ) {
+            /* terasaur -- begin mod */
+            if( peer_list->lock )
+              mutex_torrent_unlock( peer_list );
+            /* terasaur -- end mod */
             goto bailout_unlock;
+          }
         ++bucket_list;
       }
+
+      /* terasaur -- begin mod */
+      if( peer_list->lock )
+        mutex_torrent_unlock( peer_list );
+      /* terasaur -- end mod */
     }
-    mutex_bucket_unlock( bucket, 0 );
+    /* terasaur -- begin mod */
+    mutex_bucket_unlock_shared( bucket );
+    /* terasaur -- end mod */
     if( !g_opentracker_running )
       goto bailout_error;
   }
@@ -253,7 +285,9 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
   goto success;
 
 bailout_unlock:
-  mutex_bucket_unlock( bucket, 0 );
+  /* terasaur -- begin mod */
+  mutex_bucket_unlock_shared( bucket );
+  /* terasaur -- end mod */
 bailout_error:
   r = reply;
 success:
@@ -309,9 +343,13 @@ size_t stats_top_txt( char * reply, int amount ) {
   byte_zero( top100c, sizeof( top100c ) );
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    for( j=0; j<torrents_list->size; ++j ) {
+    /* terasaur -- begin mod */
+    ot_vector *torrents_list = mutex_bucket_lock_shared( bucket );
+    for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j ) {
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[j] ).peer_list;
+      if( !peer_list )
+        continue;
+      /* terasaur -- end mod */
       int idx = amount - 1; while( (idx >= 0) && ( peer_list->peer_count > top100c[idx].val ) ) --idx;
       if ( idx++ != amount - 1 ) {
         memmove( top100c + idx + 1, top100c + idx, ( amount - 1 - idx ) * sizeof( ot_record ) );
@@ -325,7 +363,9 @@ size_t stats_top_txt( char * reply, int amount ) {
         top100s[idx].torrent = (ot_torrent*)(torrents_list->data) + j;
       }
     }
-    mutex_bucket_unlock( bucket, 0 );
+    /* terasaur -- begin mod */
+    mutex_bucket_unlock_shared( bucket );
+    /* terasaur -- end mod */
     if( !g_opentracker_running )
       return 0;
   }
@@ -629,6 +669,14 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
 #ifdef WANT_SPOT_WOODPECKER
     case TASK_STATS_WOODPECKERS: r += stats_return_woodpeckers( r, 128 );   break;
 #endif
+    /* terasaur -- begin mod */
+    case TASK_STATS_TORRENTDB:   r += ts_stats_torrentdb( r, OT_STATS_TMPSIZE ); break;
+    case TASK_STATS_LOCKS:
+                                 r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 4 * OT_STATS_TMPSIZE );
+                                 if( !r ) return;
+                                 r += mutex_stats_locks( r );               break;
+    case TASK_STATS_SLAB:        r += ts_slab_stats( r, OT_STATS_TMPSIZE ); break;
+    /* terasaur -- end mod */
 #ifdef WANT_FULLLOG_NETWORKS
     case TASK_STATS_FULLLOG:      stats_return_fulllog( iovec_entries, iovector, r );
                                                                             return;
@@ -722,7 +770,10 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       ot_overall_sync_count+=event_data;
         break;
     case EVENT_BUCKET_LOCKED:
-      ot_overall_stall_count++;
+      /* terasaur -- begin mod */
+      /* Issued without any global lock held now */
+      __sync_fetch_and_add( &ot_overall_stall_count, 1 );
+      /* terasaur -- end mod */
       break;
 #ifdef WANT_SPOT_WOODPECKER
     case EVENT_WOODPECKER:
@@ -751,6 +802,9 @@ static void * stats_worker( void * args ) {
   struct iovec *iovector;
 
   (void) args;
+  /* terasaur -- begin mod */
+  mutex_bucket_caller( OT_LOCK_STATS );
+  /* terasaur -- end mod */
 
   while( 1 ) {
     ot_tasktype tasktype = TASK_STATS;
@@ -9,10 +9,20 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+/* terasaur -- begin mod */
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+/* terasaur -- end mod */
 
 /* Libowfat */
 #include "socket.h"
 #include "io.h"
+/* terasaur -- begin mod */
+#include "ndelay.h"
+/* terasaur -- end mod */
 
 /* Opentracker */
 #include "trackerlogic.h"
@@ -200,4 +210,105 @@ void udp_init( int64 sock, unsigned int worker_count ) {
     pthread_create( &thread_id, NULL, udp_worker, (void *)sock );
 }
 
+/* terasaur -- begin mod */
+/* Shard mode: every worker gets its own socket in one SO_REUSEPORT group
+   and a contiguous range of buckets.  A classic BPF program on the group
+   picks the socket for each packet from the info_hash prefix at offset 16 of
+   announces and scrapes, the same bits mutex_bucket_lock_by_hash uses.  So a
+   worker's announces only ever go to its own buckets and never wait for
+   another worker.
+
+   Everything else the program hands back to the kernel, which then hashes
+   over the sockets as usual: connects carry no info_hash and need no bucket.
+   A scrape is steered by its first info_hash only, the worker serves any
+   others from foreign buckets through the normal locks.  Bucket locks stay
+   in place, the clean worker, stats and TCP announces still need them; an
+   uncontended lock is a single atomic operation. */
+#ifdef __linux__
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#endif
+
+static int64       *g_udp_shard_sockets;
+static unsigned int g_udp_shard_count;
+
+static void udp_close_shards( ) {
+  while( g_udp_shard_count )
+    close( g_udp_shard_sockets[--g_udp_shard_count] );
+  free( g_udp_shard_sockets );
+  g_udp_shard_sockets = NULL;
+}
+
+/* Bind shard_count sockets to ip and port and steer packets to them.
+   return 0 if that failed, the error is printed */
+int udp_bind_shards( ot_ip6 ip, uint16_t port, unsigned int shard_count ) {
+#ifdef __linux__
+  /* Offsets are into the UDP payload, out of range results mean "let the
+     kernel choose" */
+  struct sock_filter steer[] = {
+    BPF_STMT( BPF_LD  | BPF_W   | BPF_ABS, 8 ),                      /* action */
+    BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K,   1, 2, 0 ),                /* announce */
+    BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K,   2, 1, 0 ),                /* scrape */
+    BPF_STMT( BPF_RET | BPF_K,             0xffffffff ),
+    BPF_STMT( BPF_LD  | BPF_W   | BPF_ABS, 16 ),                     /* info_hash prefix */
+    BPF_STMT( BPF_ALU | BPF_RSH | BPF_K,   OT_BUCKET_COUNT_SHIFT ),  /* bucket */
+    BPF_STMT( BPF_ALU | BPF_DIV | BPF_K,   ( OT_BUCKET_COUNT + shard_count - 1 ) / shard_count ),
+    BPF_STMT( BPF_RET | BPF_A,             0 )
+  };
+  struct sock_fprog prog = { sizeof( steer ) / sizeof( steer[0] ), steer };
+  const int one = 1;
+
+  if( !shard_count || !( g_udp_shard_sockets = malloc( shard_count * sizeof( int64 ) ) ) )
+    return 0;
+
+  /* Sockets join the group in bind order, which is the index the program
+     returns */
+  while( g_udp_shard_count < shard_count ) {
+    int64 sock = socket_udp6( );
+    if( sock == -1 ) {
+      perror( "socket_udp6" );
+      udp_close_shards( );
+      return 0;
+    }
+    g_udp_shard_sockets[g_udp_shard_count++] = sock;
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof( one ) ) == -1 ) {
+      perror( "setsockopt SO_REUSEPORT" );
+      udp_close_shards( );
+      return 0;
+    }
+    if( socket_bind6_reuse( sock, ip, port, 0 ) == -1 ) {
+      perror( "socket_bind6_reuse" );
+      udp_close_shards( );
+      return 0;
+    }
+    ndelay_off( sock );
+  }
+
+  /* Without the program the kernel still spreads packets over the sockets,
+     only the buckets get shared again */
+  if( setsockopt( g_udp_shard_sockets[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof( prog ) ) == -1 )
+    perror( "setsockopt SO_ATTACH_REUSEPORT_CBPF, UDP shards are not steered" );
+  return 1;
+#else
+  (void)ip; (void)port; (void)shard_count;
+  fputs( "UDP shards need SO_REUSEPORT steering, which is Linux only\n", stderr );
+  return 0;
+#endif
+}
+
+/* One worker per socket bound by udp_bind_shards */
+void udp_init_shards( ) {
+  pthread_t thread_id;
+  unsigned int shard;
+  if( !g_rijndael_round_key[0] )
+    udp_generate_rijndael_round_key();
+  for( shard=0; shard<g_udp_shard_count; ++shard )
+    pthread_create( &thread_id, NULL, udp_worker, (void *)g_udp_shard_sockets[shard] );
+}
+/* terasaur -- end mod */
+
 const char *g_version_udp_c = "$Source: /home/cvsroot/opentracker/ot_udp.c,v $: $Revision: 1.30 $\n";
@@ -17,9 +17,47 @@
 #include "uint32.h"
 #include "uint16.h"
 
+/* terasaur -- begin mod */
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#elif defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+/* terasaur -- end mod */
+
+/* terasaur -- begin mod */
+#include "terasaur/slab.h"
+
+#ifdef WANT_LOCKLESS_SCRAPE
+#include "terasaur/ts_export.h"
+
+/* Lockless scrapes may still be searching the old torrent array, so it is
+   never resized in place.  The copy replaces it and the old array is freed
+   once no reader can see it any more. */
+static void *vector_realloc( void *data, size_t old_size, size_t new_size ) {
+  void *new_data = malloc( new_size );
+  if( new_data && data ) {
+    memcpy( new_data, data, old_size < new_size ? old_size : new_size );
+    ts_epoch_retire( data );
+  }
+  return new_data;
+}
+#define vector_free( data ) ts_epoch_retire( data )
+#else
+#define vector_realloc( data, old_size, new_size ) realloc( data, new_size )
+#define vector_free( data ) free( data )
+#endif
+/* terasaur -- end mod */
+
+/* terasaur -- begin mod */
+#ifndef WANT_PEER_HASH
+/* terasaur -- end mod */
 static int vector_compare_peer(const void *peer1, const void *peer2 ) {
   return memcmp( peer1, peer2, OT_PEER_COMPARE_SIZE );
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
 
 /* This function gives us a binary search that returns a pointer, even if
    no exact match is found. In that case it sets exactmatch 0 and gives
@@ -47,12 +85,18 @@ void *binary_search( const void * const key, const void * base, const size_t mem
   return (void*)base;
 }
 
+/* terasaur -- begin mod */
+#ifndef WANT_PEER_HASH
+/* terasaur -- end mod */
 static uint8_t vector_hash_peer( ot_peer *peer, int bucket_count ) {
   unsigned int hash = 5381, i = OT_PEER_COMPARE_SIZE;
   uint8_t *p = (uint8_t*)peer;
   while( i-- ) hash += (hash<<5) + *(p++);
   return hash % bucket_count;
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
 
 /* This is the generic insert operation for our vector type.
    It tries to locate the object at "key" with size "member_size" by comparing its first "compare_size" bytes with
@@ -68,7 +112,9 @@ void *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, s
 
   if( vector->size + 1 > vector->space ) {
     size_t   new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
-    uint8_t *new_data = realloc( vector->data, new_space * member_size );
+    /* terasaur -- begin mod */
+    uint8_t *new_data = vector_realloc( vector->data, vector->space * member_size, new_space * member_size );
+    /* terasaur -- end mod */
     if( !new_data ) return NULL;
     /* Adjust pointer if it moved by realloc */
     match = new_data + (match - (uint8_t*)vector->data);
@@ -82,19 +128,178 @@ void *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, s
   return match;
 }
 
+/* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+/* Peer sets: open addressing over a power of two slots, at most 3/4 full.
+   Runs are kept in Robin Hood order and removal shifts followers back, like
+   the torrent tables.  Keys are compared as one 64 bit number.  A set only
+   shrinks in vector_fixup_peers, so callers may remove with
+   vector_remove_peer_at while they walk it. */
+#define OT_PEER_HOME( key, mask ) ( (size_t)( ( (key) * 0x9E3779B97F4A7C15ULL ) >> 32 ) & (mask) )
+
+static ot_peer *peer_set_probe( ot_peer *slots, size_t space, uint64_t key, size_t *insert_at ) {
+  size_t mask = space - 1, i, dist;
+
+  if( !space ) return NULL;
+  i = OT_PEER_HOME( key, mask );
+  for( dist=0; dist<space; ++dist, i = ( i + 1 ) & mask ) {
+    uint64_t slot_key = vector_peer_key( slots + i );
+    if( !slot_key || ( ( ( i - OT_PEER_HOME( slot_key, mask ) ) & mask ) < dist ) )
+      break;
+    if( slot_key == key )
+      return slots + i;
+  }
+  if( insert_at )
+    *insert_at = i;
+  return NULL;
+}
+
+static ot_peer *peer_set_insert( ot_peer *slots, size_t space, size_t at, ot_peer *peer ) {
+  size_t mask = space - 1, end = at;
+
+  while( vector_peer_key( slots + end ) )
+    end = ( end + 1 ) & mask;
+  while( end != at ) {
+    size_t prev = ( end - 1 ) & mask;
+    slots[end] = slots[prev];
+    end = prev;
+  }
+  slots[at] = *peer;
+  return slots + at;
+}
+
+static int peer_set_resize( ot_vector *vector, size_t new_space ) {
+  ot_peer *slots = vector->data, *new_slots = ts_slab_alloc_peers( new_space );
+  size_t   i, at = 0;
+
+  if( !new_slots ) return 0;
+  memset( new_slots, 0, new_space * sizeof( ot_peer ) );
+  for( i=0; i<vector->space; ++i ) {
+    uint64_t key = vector_peer_key( slots + i );
+    if( key ) {
+      peer_set_probe( new_slots, new_space, key, &at );
+      peer_set_insert( new_slots, new_space, at, slots + i );
+    }
+  }
+
+  ts_slab_free_peers( slots, vector->space );
+  vector->data  = new_slots;
+  vector->space = new_space;
+  return 1;
+}
+
+/* Unlike the sorted version this already copies peer to the new slot, the
+   probes of later lookups depend on it.  Peer 0.0.0.0:0 is refused */
+ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
+  uint64_t key = vector_peer_key( peer );
+  ot_peer *match = peer_set_probe( vector->data, vector->space, key, NULL );
+  size_t   at = 0;
+
+  *exactmatch = match != NULL;
+  if( match || !key ) return match;
+
+  if( ( vector->size + 1 ) * 4 > vector->space * 3 )
+    if( !peer_set_resize( vector, vector->space ? 2 * vector->space : OT_PEER_HASH_MIN_SLOTS ) )
+      return NULL;
+
+  peer_set_probe( vector->data, vector->space, key, &at );
+  vector->size++;
+  return peer_set_insert( vector->data, vector->space, at, peer );
+}
+
+void vector_remove_peer_at( ot_vector *vector, ot_peer *match ) {
+  ot_peer *slots = vector->data;
+  size_t   mask = vector->space - 1, i = match - slots;
+
+  for( ; ; ) {
+    size_t   next = ( i + 1 ) & mask;
+    uint64_t key = vector_peer_key( slots + next );
+    if( !key || ( OT_PEER_HOME( key, mask ) == next ) )
+      break;
+    slots[i] = slots[next];
+    i = next;
+  }
+  memset( slots + i, 0, sizeof( ot_peer ) );
+  vector->size--;
+}
+
+int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
+  ot_peer *match;
+  int      removed;
+
+  if( !vector->size ) return 0;
+  match = peer_set_probe( vector->data, vector->space, vector_peer_key( peer ), NULL );
+  if( !match ) return 0;
+
+  removed = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
+  vector_remove_peer_at( vector, match );
+  vector_fixup_peers( vector );
+  return removed;
+}
+#else
+#ifndef WANT_V6
+/* Small vectors are scanned for a peer rather than searched, comparing two
+   peers per instruction with SSE2, four with AVX2.  Builds pick the widest
+   the compiler was allowed to use, e.g. with -mavx2 */
+#define OT_PEER_SCAN_MAX 32
+
+static ot_peer *vector_scan_peer( ot_peer *peers, size_t count, ot_peer *peer ) {
+  uint64_t key = vector_peer_key( peer );
+  size_t   i = 0;
+
+#if defined( __AVX2__ )
+  {
+    __m256i keys = _mm256_set1_epi64x( key ), mask = _mm256_set1_epi64x( OT_PEER_KEY_MASK );
+    for( ; i + 4 <= count; i += 4 ) {
+      __m256i lookat = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*)( peers + i ) ), mask );
+      int     hits   = _mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpeq_epi64( lookat, keys ) ) );
+      if( hits ) return peers + i + __builtin_ctz( hits );
+    }
+  }
+#endif
+#if defined( __SSE2__ )
+  {
+    /* No 64 bit compare before SSE4.1, both 32 bit halves need to match */
+    __m128i keys = _mm_set1_epi64x( key ), mask = _mm_set1_epi64x( OT_PEER_KEY_MASK );
+    for( ; i + 2 <= count; i += 2 ) {
+      __m128i lookat = _mm_and_si128( _mm_loadu_si128( (const __m128i*)( peers + i ) ), mask );
+      int     hits   = _mm_movemask_epi8( _mm_cmpeq_epi32( lookat, keys ) );
+      if( ( hits & 0x00ff ) == 0x00ff ) return peers + i;
+      if( ( hits & 0xff00 ) == 0xff00 ) return peers + i + 1;
+    }
+  }
+#endif
+  for( ; i < count; ++i )
+    if( vector_peer_key( peers + i ) == key )
+      return peers + i;
+  return NULL;
+}
+#endif
+/* terasaur -- end mod */
 ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
   ot_peer *match;
 
   /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
   if( vector->space < vector->size )
     vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
+  /* terasaur -- begin mod */
+#ifndef WANT_V6
+  /* Most announces come from peers already in the vector */
+  if( vector->size <= OT_PEER_SCAN_MAX && ( match = vector_scan_peer( vector->data, vector->size, peer ) ) ) {
+    *exactmatch = 1;
+    return match;
+  }
+#endif
+  /* terasaur -- end mod */
   match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, exactmatch );
 
   if( *exactmatch ) return match;
 
   if( vector->size + 1 > vector->space ) {
     size_t   new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
-    ot_peer *new_data = realloc( vector->data, new_space * sizeof(ot_peer) );
+    /* terasaur -- begin mod */
+    ot_peer *new_data = ts_slab_realloc_peers( vector->data, vector->space, new_space );
+    /* terasaur -- end mod */
     if( !new_data ) return NULL;
     /* Adjust pointer if it moved by realloc */
     match = new_data + (match - (ot_peer*)vector->data);
@@ -124,8 +329,17 @@ int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
     vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
 
   end = ((ot_peer*)vector->data) + vector->size;
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, &exactmatch );
-  if( !exactmatch ) return 0;
+  /* terasaur -- begin mod */
+#ifndef WANT_V6
+  if( vector->size <= OT_PEER_SCAN_MAX ) {
+    if( !( match = vector_scan_peer( vector->data, vector->size, peer ) ) ) return 0;
+  } else
+#endif
+  {
+    match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, &exactmatch );
+    if( !exactmatch ) return 0;
+  }
+  /* terasaur -- end mod */
 
   exactmatch = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
   memmove( match, match + 1, sizeof(ot_peer) * ( end - match - 1 ) );
@@ -134,6 +348,191 @@ int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
   vector_fixup_peers( vector );
   return exactmatch;
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
+
+/* terasaur -- begin mod */
+#ifdef WANT_TORRENT_HASH
+/* Robin Hood hashing with linear probing.  The bucket already used the top
+   bits of the info_hash, the next 32 bits pick the home slot.  Each run of
+   used slots is ordered by home slot, so a lookup can stop at the first
+   entry that is closer to its home than the probe is to ours.  Entries are
+   removed by shifting their followers back, no tombstones.  A slot is free
+   if it has no peer_list.
+
+   Slots move on insert and remove, so pointers into the table are only good
+   until the next change.  Walking the table while removing works like for
+   the sorted array: after a remove, look at the same slot again. */
+#define OT_TORRENT_HOME( hash, mask ) ( uint32_read_big( ((char*)(hash)) + 4 ) & (mask) )
+
+/* Lookup, bounded by the slot count so that lockless readers looking at a
+   table being changed cannot loop.  Returns NULL if hash is not there and
+   the slot it would go to in *insert_at */
+static ot_torrent *torrent_hash_probe( ot_torrent *slots, size_t space, ot_hash hash, size_t *insert_at ) {
+  size_t mask = space - 1, i, dist;
+
+  if( !space ) return NULL;
+  i = OT_TORRENT_HOME( hash, mask );
+  for( dist=0; dist<space; ++dist, i = ( i + 1 ) & mask ) {
+    ot_torrent *slot = slots + i;
+    if( !slot->peer_list || ( ( ( i - OT_TORRENT_HOME( slot->hash, mask ) ) & mask ) < dist ) )
+      break;
+    if( !memcmp( slot->hash, hash, OT_HASH_COMPARE_SIZE ) )
+      return slot;
+  }
+  if( insert_at )
+    *insert_at = i;
+  return NULL;
+}
+
+/* Shift the run starting at slot at up to the next free slot one further
+   out, and put hash at the front of it.  The table must have a free slot */
+static ot_torrent *torrent_hash_insert( ot_torrent *slots, size_t space, size_t at, ot_hash hash ) {
+  size_t mask = space - 1, end = at;
+
+  while( slots[end].peer_list )
+    end = ( end + 1 ) & mask;
+  while( end != at ) {
+    size_t prev = ( end - 1 ) & mask;
+    slots[end] = slots[prev];
+    end = prev;
+  }
+  memcpy( slots[at].hash, hash, sizeof( ot_hash ) );
+  slots[at].peer_list = NULL;
+  return slots + at;
+}
+
+static int torrent_hash_resize( ot_vector *vector, size_t new_space ) {
+  ot_torrent *slots = vector->data, *new_slots = calloc( new_space, sizeof( ot_torrent ) );
+  size_t      i, at;
+
+  if( !new_slots ) return 0;
+  for( i=0; i<vector->space; ++i )
+    if( slots[i].peer_list ) {
+      torrent_hash_probe( new_slots, new_space, slots[i].hash, &at );
+      torrent_hash_insert( new_slots, new_space, at, slots[i].hash )->peer_list = slots[i].peer_list;
+    }
+
+  if( slots ) vector_free( slots );
+  vector->data  = new_slots;
+  vector->space = new_space;
+  return 1;
+}
+
+ot_torrent *vector_find_torrent( const void *data, size_t slots, ot_hash hash ) {
+  return torrent_hash_probe( (ot_torrent*)data, slots, hash, NULL );
+}
+
+/* Like vector_find_or_insert, the caller fills in a new torrent's peer_list.
+   The table is only ever resized here, never when removing, so the clean
+   worker can remove while it walks a bucket.  Tables shrink again once they
+   are less than 1/8 full */
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, ot_hash hash, int *exactmatch ) {
+  ot_torrent *match = torrent_hash_probe( vector->data, vector->space, hash, NULL );
+  size_t      space = OT_TORRENT_HASH_MIN_SLOTS, at;
+
+  *exactmatch = match != NULL;
+  if( match ) return match;
+
+  while( ( vector->size + 1 ) * 8 > space * 7 )
+    space *= 2;
+  if( ( space > vector->space ) || ( space * 8 <= vector->space ) )
+    /* A failed shrink leaves the table as it was, which is fine */
+    if( !torrent_hash_resize( vector, space ) && ( space > vector->space ) )
+      return NULL;
+
+  torrent_hash_probe( vector->data, vector->space, hash, &at );
+  vector->size++;
+  return torrent_hash_insert( vector->data, vector->space, at, hash );
+}
+
+void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
+  ot_torrent *slots = vector->data;
+  size_t      mask = vector->space - 1, i = match - slots;
+
+  if( !vector->size ) return;
+
+  /* If this is being called after a unsuccessful malloc() for peer_list
+     in add_peer_to_torrent, match->peer_list actually might be NULL */
+  if( match->peer_list ) free_peerlist( match->peer_list );
+
+  /* Pull back followers that are not in their home slot */
+  for( ; ; ) {
+    size_t next = ( i + 1 ) & mask;
+    if( !slots[next].peer_list || ( OT_TORRENT_HOME( slots[next].hash, mask ) == next ) )
+      break;
+    slots[i] = slots[next];
+    i = next;
+  }
+  memset( slots + i, 0, sizeof( ot_torrent ) );
+  --vector->size;
+}
+#else
+/* The first 8 bytes of a hash as a big endian number, which orders like memcmp */
+static inline uint64_t vector_hash_prefix( const uint8_t *hash ) {
+  uint64_t prefix;
+  memcpy( &prefix, hash, sizeof( prefix ) );
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  prefix = __builtin_bswap64( prefix );
+#endif
+  return prefix;
+}
+
+/* binary_search for torrents.  Probes compare the hash prefixes as numbers
+   and only memcmp the remaining bytes when those are equal */
+static ot_torrent *vector_search_torrent( const ot_torrent *base, size_t interval, const uint8_t *hash, int *exactmatch ) {
+  uint64_t prefix = vector_hash_prefix( hash );
+
+  while( interval ) {
+    const ot_torrent *lookat = base + interval / 2;
+    uint64_t lookat_prefix = vector_hash_prefix( lookat->hash );
+    int cmp = ( lookat_prefix > prefix ) - ( lookat_prefix < prefix );
+    if( !cmp )
+      cmp = memcmp( lookat->hash + sizeof( prefix ), hash + sizeof( prefix ), OT_HASH_COMPARE_SIZE - sizeof( prefix ) );
+    if( !cmp ) {
+      base = lookat;
+      break;
+    }
+    if( cmp < 0 ) {
+      base = lookat + 1;
+      interval--;
+    }
+    interval /= 2;
+  }
+
+  *exactmatch = interval;
+  return (ot_torrent*)base;
+}
+
+ot_torrent *vector_find_torrent( const void *data, size_t slots, ot_hash hash ) {
+  int exactmatch;
+  ot_torrent *match = vector_search_torrent( data, slots, hash, &exactmatch );
+  return exactmatch ? match : NULL;
+}
+
+/* vector_find_or_insert for torrents, see there */
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, ot_hash hash, int *exactmatch ) {
+  ot_torrent *match = vector_search_torrent( vector->data, vector->size, hash, exactmatch );
+
+  if( *exactmatch ) return match;
+
+  if( vector->size + 1 > vector->space ) {
+    size_t      new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
+    ot_torrent *new_data = vector_realloc( vector->data, vector->space * sizeof( ot_torrent ), new_space * sizeof( ot_torrent ) );
+    if( !new_data ) return NULL;
+    /* Adjust pointer if it moved by realloc */
+    match = new_data + ( match - (ot_torrent*)vector->data );
+
+    vector->data = new_data;
+    vector->space = new_space;
+  }
+  memmove( match + 1, match, sizeof( ot_torrent ) * ( ((ot_torrent*)vector->data) + vector->size - match ) );
+
+  vector->size++;
+  return match;
+}
+/* terasaur -- end mod */
 
 void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
   ot_torrent *end = ((ot_torrent*)vector->data) + vector->size;
@@ -146,18 +545,56 @@ void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
 
   memmove( match, match + 1, sizeof(ot_torrent) * ( end - match - 1 ) );
   if( ( --vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) && ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_torrent ) );
+    /* terasaur -- begin mod */
+    void *new_data = vector_realloc( vector->data, vector->space * sizeof( ot_torrent ), vector->space / OT_VECTOR_SHRINK_RATIO * sizeof( ot_torrent ) );
+    /* Keep the larger array if the copy fails */
+    if( new_data ) {
+      vector->space /= OT_VECTOR_SHRINK_RATIO;
+      vector->data = new_data;
+    }
+    /* terasaur -- end mod */
   }
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
 
 void vector_clean_list( ot_vector * vector, int num_buckets ) {
   while( num_buckets-- )
-    free( vector[num_buckets].data );
+    /* terasaur -- begin mod */
+    ts_slab_free_peers( vector[num_buckets].data, vector[num_buckets].space );
+    /* terasaur -- end mod */
   free( vector );
   return;
 }
 
+/* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+/* One set holds any number of peers, there are no buckets to split into */
+void vector_redistribute_buckets( ot_peerlist * peer_list ) {
+  (void)peer_list;
+}
+
+/* Shrink sets that fell below 1/16 full to between 1/8 and 1/4.  A failed
+   shrink keeps the larger set */
+void vector_fixup_peers( ot_vector * vector ) {
+  size_t new_space = vector->space;
+
+  if( !vector->size ) {
+    ts_slab_free_peers( vector->data, vector->space );
+    vector->data = NULL;
+    vector->space = 0;
+    return;
+  }
+
+  if( vector->size * 16 >= vector->space )
+    return;
+  while( ( new_space > OT_PEER_HASH_MIN_SLOTS ) && ( vector->size * 8 < new_space ) )
+    new_space /= 2;
+  peer_set_resize( vector, new_space );
+}
+#else
+/* terasaur -- end mod */
 void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   int tmp, bucket, bucket_size_new, num_buckets_new, num_buckets_old = 1;
   ot_vector * bucket_list_new, * bucket_list_old = &peer_list->peers;
@@ -198,7 +635,9 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   /* preallocate vectors to hold all peers */
   for( bucket=0; bucket<num_buckets_new; ++bucket ) {
     bucket_list_new[bucket].space = bucket_size_new;
-    bucket_list_new[bucket].data  = malloc( bucket_size_new * sizeof(ot_peer) );
+    /* terasaur -- begin mod */
+    bucket_list_new[bucket].data  = ts_slab_alloc_peers( bucket_size_new );
+    /* terasaur -- end mod */
     if( !bucket_list_new[bucket].data )
       return vector_clean_list( bucket_list_new, num_buckets_new );
   }
@@ -212,7 +651,9 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
       if( num_buckets_new > 1 )
         bucket_dest += vector_hash_peer(peers_old, num_buckets_new);
       if( bucket_dest->size + 1 > bucket_dest->space ) {
-        void * tmp = realloc( bucket_dest->data, sizeof(ot_peer) * OT_VECTOR_GROW_RATIO * bucket_dest->space );
+        /* terasaur -- begin mod */
+        void * tmp = ts_slab_realloc_peers( bucket_dest->data, bucket_dest->space, OT_VECTOR_GROW_RATIO * bucket_dest->space );
+        /* terasaur -- end mod */
         if( !tmp ) return vector_clean_list( bucket_list_new, num_buckets_new );
         bucket_dest->data   = tmp;
         bucket_dest->space *= OT_VECTOR_GROW_RATIO;
@@ -230,7 +671,9 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
   if( OT_PEERLIST_HASBUCKETS( peer_list) )
     vector_clean_list( (ot_vector*)peer_list->peers.data, peer_list->peers.size );
   else
-    free( peer_list->peers.data );
+    /* terasaur -- begin mod */
+    ts_slab_free_peers( peer_list->peers.data, peer_list->peers.space );
+    /* terasaur -- end mod */
 
   if( num_buckets_new > 1 ) {
     peer_list->peers.data  = bucket_list_new;
@@ -246,9 +689,14 @@ void vector_redistribute_buckets( ot_peerlist * peer_list ) {
 
 void vector_fixup_peers( ot_vector * vector ) {
   int need_fix = 0;
+  /* terasaur -- begin mod */
+  size_t old_space = vector->space;
+  /* terasaur -- end mod */
 
   if( !vector->size ) {
-    free( vector->data );
+    /* terasaur -- begin mod */
+    ts_slab_free_peers( vector->data, vector->space );
+    /* terasaur -- end mod */
     vector->data = NULL;
     vector->space = 0;
     return;
@@ -260,7 +708,12 @@ void vector_fixup_peers( ot_vector * vector ) {
     need_fix++;
   }
   if( need_fix )
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_peer ) );
+    /* terasaur -- begin mod */
+    vector->data = ts_slab_realloc_peers( vector->data, old_space, vector->space );
+    /* terasaur -- end mod */
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
 
 const char *g_version_vector_c = "$Source: /home/cvsroot/opentracker/ot_vector.c,v $: $Revision: 1.19 $\n";
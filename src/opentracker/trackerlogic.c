@@ -29,22 +29,38 @@
 #include "ot_livesync.h"
 /* terasaur -- begin mod */
 #include "terasaur/ts_export.h"
+#include "terasaur/slab.h"
 /* terasaur -- end mod */
 
 /* Forward declaration */
 size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
 
 void free_peerlist( ot_peerlist *peer_list ) {
+  /* terasaur -- begin mod */
+  mutex_torrent_demote( peer_list );
+  /* terasaur -- end mod */
   if( peer_list->peers.data ) {
+    /* terasaur -- begin mod */
     if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
       ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
 
-      while( peer_list->peers.size-- )
-        free( bucket_list++->data );
-    }
-    free( peer_list->peers.data );
+      while( peer_list->peers.size-- ) {
+        ts_slab_free_peers( bucket_list->data, bucket_list->space );
+        ++bucket_list;
+      }
+      free( peer_list->peers.data );
+    } else
+      ts_slab_free_peers( peer_list->peers.data, peer_list->peers.space );
+    /* terasaur -- end mod */
   }
-  free( peer_list );
+  /* terasaur -- begin mod */
+#ifdef WANT_LOCKLESS_SCRAPE
+  /* Lockless scrapes read the counters, but never the peers */
+  ts_epoch_retire( peer_list );
+#else
+  ts_slab_free_peerlist( peer_list );
+#endif
+  /* terasaur -- end mod */
 }
 
 void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count ) {
@@ -54,21 +70,28 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
 
   int         exactmatch;
   ot_torrent *torrent;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( hash );
+  ot_vector  *torrents_list;
 
   /* terasaur -- begin mod */
+  /* May hit the torrent database, so check before taking the bucket lock */
   if( !ts_torrentdb_hashisvalid( hash ) )
-    return mutex_bucket_unlock_by_hash( hash, 0 );
+    return;
   /* terasaur -- end mod */
 
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrents_list = mutex_bucket_lock_by_hash( hash );
+
+  /* terasaur -- begin mod */
+  torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
+  /* terasaur -- end mod */
   if( !torrent || exactmatch )
     return mutex_bucket_unlock_by_hash( hash, 0 );
 
   /* Create a new torrent entry, then */
   memcpy( torrent->hash, hash, sizeof(ot_hash) );
 
-  if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+  /* terasaur -- begin mod */
+  if( !( torrent->peer_list = ts_slab_alloc_peerlist( ) ) ) {
+  /* terasaur -- end mod */
     vector_remove_torrent( torrents_list, torrent );
     return mutex_bucket_unlock_by_hash( hash, 0 );
   }
@@ -80,6 +103,18 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
   return mutex_bucket_unlock_by_hash( hash, 1 );
 }
 
+/* terasaur -- begin mod */
+/* Announces end up holding either the bucket or, for torrents with their own
+   lock, the torrent's mutex and a reference */
+static void announce_unlock( ot_hash hash, ot_peerlist *own_lock, int delta_torrentcount ) {
+  if( own_lock ) {
+    mutex_torrent_unlock( own_lock );
+    mutex_torrent_release( own_lock );
+  } else
+    mutex_bucket_unlock_by_hash( hash, delta_torrentcount );
+}
+/* terasaur -- end mod */
+
 size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstruct *ws, size_t amount ) {
 #ifdef _DEBUG
   ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: start");
@@ -88,17 +123,20 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   int         exactmatch, delta_torrentcount = 0;
   ot_torrent *torrent;
   ot_peer    *peer_dest;
-  ot_vector  *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  ot_vector  *torrents_list;
+  /* terasaur -- begin mod */
+  ot_torrent  own_torrent;
+  ot_peerlist *own_lock = NULL;
+  /* terasaur -- end mod */
 
   /* terasaur -- begin mod */
+  /* Stage 1: everything that may need the torrent database happens before
+     the bucket lock, so a slow query never stalls the other torrents in
+     the bucket */
   int increment_completed = 0;
-  if( !ts_torrentdb_hashisvalid( ws->hash ) ) {
-#ifdef _DEBUG
-    ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: invalid hash, unlocking mutex");
-#endif
-
-  /* terasaur -- end mod */
-    mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+  ts_seedbank_list seedbanks;
+  ts_torrent_stats stats;
+  if( !ts_torrentdb_authorize( ws->hash, &seedbanks ) ) {
 #ifdef _DEBUG
     ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: invalid hash, returning");
 #endif
@@ -111,7 +149,14 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     return 0;
   }
 
-  torrent = vector_find_or_insert( torrents_list, (void*)ws->hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  /* Stage 2: in memory work under the bucket lock */
+  mutex_bucket_caller( OT_LOCK_ANNOUNCE );
+  /* terasaur -- end mod */
+  torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+
+  /* terasaur -- begin mod */
+  torrent = vector_find_or_insert_torrent( torrents_list, *ws->hash, &exactmatch );
+  /* terasaur -- end mod */
   if( !torrent ) {
 #ifdef _DEBUG
     ts_log_error("trackerlogic::add_peer_to_torrent_and_return_peers: torrent vector insert failed, unlocking mutex, returning");
@@ -124,7 +169,9 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     /* Create a new torrent entry, then */
     memcpy( torrent->hash, *ws->hash, sizeof(ot_hash) );
 
-    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+    /* terasaur -- begin mod */
+    if( !( torrent->peer_list = ts_slab_alloc_peerlist( ) ) ) {
+    /* terasaur -- end mod */
       vector_remove_torrent( torrents_list, torrent );
 #ifdef _DEBUG
     ts_log_error("trackerlogic::add_peer_to_torrent_and_return_peers: peer list malloc failed, unlocking mutex, returning");
@@ -135,13 +182,33 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 
     byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
     delta_torrentcount = 1;
-  } else
-    clean_single_torrent( torrent );
+  }
+  /* terasaur -- begin mod */
+  else {
+    ot_peerlist *peer_list = torrent->peer_list;
+    if( !peer_list->lock && g_torrent_lock_peers && ( peer_list->peer_count >= g_torrent_lock_peers ) )
+      mutex_torrent_promote( peer_list );
+
+    /* A torrent with its own lock only needs the bucket to be found.  The
+       entry may move once the bucket is unlocked, so work on a copy */
+    if( peer_list->lock ) {
+      own_torrent = *torrent;
+      torrent = &own_torrent;
+      own_lock = peer_list;
+      mutex_torrent_hold( own_lock );
+      mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+      mutex_torrent_lock( own_lock );
+    }
+
+    /* terasaur: counts are snapshotted again below, nothing to keep here */
+    clean_single_torrent( torrent, NULL );
+  }
+  /* terasaur -- end mod */
 
   torrent->peer_list->base = g_now_minutes;
 
   /* terasaur -- begin mod */
-  ts_torrentdb_add_seedbanks(ws->hash, torrent->peer_list);
+  ts_torrentdb_add_seedbanks( &seedbanks, torrent->peer_list );
   /* terasaur -- end mod */
 
   /* Check for peer in torrent */
@@ -150,7 +217,9 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #ifdef _DEBUG
     ts_log_error("trackerlogic::add_peer_to_torrent_and_return_peers: peer vector insert failed, unlocking mutex, returning");
 #endif
-    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+    /* terasaur -- begin mod */
+    announce_unlock( *ws->hash, own_lock, delta_torrentcount );
+    /* terasaur -- end mod */
     return 0;
   }
 
@@ -214,17 +283,17 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   }
 
   /* terasaur -- begin mod */
-  ts_update_torrent_stats(torrent, increment_completed);
-#ifdef _DEBUG
-  ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: after ts_update_torrent_stats");
-#endif
+  ts_snapshot_torrent_stats( torrent, increment_completed, &stats );
   /* terasaur -- end mod */
 
   memcpy( peer_dest, &ws->peer, sizeof(ot_peer) );
 
 #ifdef WANT_SYNC
   if( proto == FLAG_MCA ) {
-    mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+    /* terasaur -- begin mod */
+    announce_unlock( *ws->hash, own_lock, delta_torrentcount );
+    ts_update_torrent_stats( &stats );
+    /* terasaur -- end mod */
     return 0;
   }
 #endif
@@ -234,7 +303,18 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #ifdef _DEBUG
   ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: calling mutex_bucket_unlock_by_hash");
 #endif
-  mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
+  /* terasaur -- begin mod */
+  announce_unlock( *ws->hash, own_lock, delta_torrentcount );
+  /* terasaur -- end mod */
+
+  /* terasaur -- begin mod */
+  /* Stage 3: publish the stats outside the lock */
+  ts_update_torrent_stats( &stats );
+#ifdef _DEBUG
+  ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: after ts_update_torrent_stats");
+#endif
+  /* terasaur -- end mod */
+
 #ifdef _DEBUG
   ts_log_debug("trackerlogic::add_peer_to_torrent_and_return_peers: returning");
 #endif
@@ -259,12 +339,19 @@ static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
 
   for( bucket = 0; bucket<num_buckets; ++bucket ) {
     ot_peer * peers = (ot_peer*)bucket_list[bucket].data;
-    size_t    peer_count = bucket_list[bucket].size;
+    /* terasaur -- begin mod */
+    size_t    peer_count = OT_PEER_SLOTS( &bucket_list[bucket] );
+    /* terasaur -- end mod */
 #ifdef _DEBUG
     ts_log_debug("trackerlogic::return_peers_all: about to while(peer_count--)");
     printf("trackerlogic::return_peers_all: peer_count: %i\n", peer_count);
 #endif
     while( peer_count-- ) {
+      /* terasaur -- begin mod */
+      if( !OT_PEER_SLOT_USED( peers ) )
+        ++peers;
+      else
+      /* terasaur -- end mod */
       if( OT_PEERFLAG(peers) & PEER_FLAG_SEEDING ) {
         r_end-=OT_PEER_COMPARE_SIZE;
         memcpy(r_end,peers++,OT_PEER_COMPARE_SIZE);
@@ -281,6 +368,75 @@ static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
   return result;
 }
 
+/* terasaur -- begin mod */
+#ifdef WANT_PEER_HASH
+/* Tell whether peer already went into the reply of return_peers_selection */
+static int peer_selected( ot_peer *peer, char *begin, char *end, char *r_end, char *r_last ) {
+  for( ; begin < end; begin += OT_PEER_COMPARE_SIZE )
+    if( !memcmp( begin, peer, OT_PEER_COMPARE_SIZE ) ) return 1;
+  for( ; r_end < r_last; r_end += OT_PEER_COMPARE_SIZE )
+    if( !memcmp( r_end, peer, OT_PEER_COMPARE_SIZE ) ) return 1;
+  return 0;
+}
+
+/* Peer sets have free slots between the peers.  Step through one lap of the
+   slots as the sorted version steps through the peers, and take the next peer
+   at or after each step.  Steps may jump over peers, so a lap can run out
+   before enough peers were picked.  The rest is then taken walking back from
+   the first pick, skipping peers already in the reply */
+static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, char *reply ) {
+  ot_peer    * slots = (ot_peer*)peer_list->peers.data;
+  size_t       space = peer_list->peers.space, mask = space - 1;
+  size_t       start, cursor, target, first;
+  unsigned int shifted_pc = space;
+  unsigned int shifted_step = 0;
+  unsigned int shift = 0;
+  size_t       result = OT_PEER_COMPARE_SIZE * amount;
+  char       * r_begin = reply;
+  char       * r_end = reply + result;
+  char       * r_last = r_end;
+
+#define MAXPRECBIT (1<<(8*sizeof(int)-3))
+  while( !(shifted_pc & MAXPRECBIT ) ) { shifted_pc <<= 1; shift++; }
+  shifted_step = shifted_pc/amount;
+#undef MAXPRECBIT
+
+  start = cursor = target = random() % space;
+  first = start + space + 1;
+
+  while( amount-- ) {
+    ot_peer * peer;
+    unsigned int diff = ( ( ( amount + 1 ) * shifted_step ) >> shift ) -
+                        ( (   amount       * shifted_step ) >> shift );
+    target += 1 + random() % diff;
+    if( cursor < target )
+      cursor = target;
+    while( cursor <= start + space && !OT_PEER_SLOT_USED( slots + ( cursor & mask ) ) )
+      ++cursor;
+
+    if( cursor <= start + space ) {
+      if( cursor < first )
+        first = cursor;
+      peer = slots + ( cursor++ & mask );
+    } else {
+      /* There are more peers than picks, so this ends within a lap */
+      do {
+        peer = slots + ( --first & mask );
+      } while( !OT_PEER_SLOT_USED( peer ) || peer_selected( peer, r_begin, reply, r_end, r_last ) );
+    }
+
+    if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) {
+      r_end-=OT_PEER_COMPARE_SIZE;
+      memcpy(r_end,peer,OT_PEER_COMPARE_SIZE);
+    } else {
+      memcpy(reply,peer,OT_PEER_COMPARE_SIZE);
+      reply+=OT_PEER_COMPARE_SIZE;
+    }
+  }
+  return result;
+}
+#else
+/* terasaur -- end mod */
 static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, char *reply ) {
 #ifdef _DEBUG
   ts_log_debug("trackerlogic::return_peers_selection: start");
@@ -346,6 +502,9 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
 #endif
   return result;
 }
+/* terasaur -- begin mod */
+#endif
+/* terasaur -- end mod */
 
 /* Compiles a list of random peers for a torrent
    * reply must have enough space to hold 92+6*amount bytes
@@ -389,56 +548,126 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
   return r - reply;
 }
 
+/* terasaur -- begin mod */
+/* Scrapes only hold their bucket shared, so unlike announces they do not run
+   clean_single_torrent.  Report what it would leave behind instead and let the
+   clean worker do the actual expiry.
+   return 0 if the torrent timed out */
+static int scrape_counts( ot_torrent *torrent, size_t *seeds, size_t *downloaded, size_t *leechers ) {
+  ot_peerlist *peer_list = torrent->peer_list;
+  time_t timedout = (time_t)( g_now_minutes - peer_list->base );
+
+  if( timedout > OT_TORRENT_TIMEOUT )
+    return 0;
+
+  *downloaded = peer_list->down_count;
+  if( timedout > OT_PEER_TIMEOUT ) {
+    /* All peers are gone, the torrent only stays for its downloads */
+    *seeds = *leechers = 0;
+    return peer_list->peer_count || peer_list->down_count;
+  }
+
+  /* Torrents with their own lock change their counters behind the bucket's
+     back, so seeds may briefly outnumber peers */
+  *seeds    = peer_list->seed_count;
+  *leechers = peer_list->peer_count;
+  *leechers = *leechers > *seeds ? *leechers - *seeds : 0;
+  return 1;
+}
+
+#ifdef WANT_LOCKLESS_SCRAPE
+/* Give up on lockless reads after this many writers got in the way */
+#define OT_LOCKLESS_SCRAPE_TRIES 4
+
+/* Like scrape_torrent, but without any lock.  Each try is checked against
+   the bucket's sequence number, first before following torrent->peer_list,
+   then again once the counters are copied.
+   return -1 if no try went through undisturbed */
+static int scrape_torrent_lockless( ot_hash hash, size_t *seeds, size_t *downloaded, size_t *leechers ) {
+  int tries, found = -1;
+
+  ts_epoch_enter( );
+  for( tries=0; ( found < 0 ) && ( tries < OT_LOCKLESS_SCRAPE_TRIES ); ++tries ) {
+    unsigned int  seq;
+    ot_vector    *torrents_list = mutex_bucket_read_begin( hash, &seq );
+    void         *data = torrents_list->data;
+    size_t        slots = OT_TORRENT_SLOTS( torrents_list );
+    ot_torrent   *torrent;
+    ot_peerlist  *peer_list;
+
+    if( mutex_bucket_read_retry( hash, seq ) )
+      continue;
+    torrent = vector_find_torrent( data, slots, hash );
+    peer_list = torrent ? torrent->peer_list : NULL;
+    if( mutex_bucket_read_retry( hash, seq ) )
+      continue;
+
+    found = peer_list && scrape_counts( torrent, seeds, downloaded, leechers );
+    if( mutex_bucket_read_retry( hash, seq ) )
+      found = -1;
+  }
+  ts_epoch_leave( );
+  return found;
+}
+#endif
+
+/* return 0 if there is no such torrent */
+static int scrape_torrent( ot_hash hash, size_t *seeds, size_t *downloaded, size_t *leechers ) {
+  int          found;
+  ot_vector   *torrents_list;
+  ot_torrent  *torrent;
+
+#ifdef WANT_LOCKLESS_SCRAPE
+  if( ( found = scrape_torrent_lockless( hash, seeds, downloaded, leechers ) ) >= 0 )
+    return found;
+#endif
+
+  mutex_bucket_caller( OT_LOCK_SCRAPE );
+  torrents_list = mutex_bucket_lock_shared_by_hash( hash );
+  torrent = vector_find_torrent( torrents_list->data, OT_TORRENT_SLOTS( torrents_list ), hash );
+  found = torrent && scrape_counts( torrent, seeds, downloaded, leechers );
+  mutex_bucket_unlock_shared_by_hash( hash );
+  return found;
+}
+/* terasaur -- end mod */
+
 /* Fetches scrape info for a specific torrent */
 size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
-  int          exactmatch, delta_torrentcount = 0;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  /* terasaur -- begin mod */
+  size_t       seeds, downloaded, leechers;
 
-  if( !exactmatch ) {
+  if( !scrape_torrent( hash, &seeds, &downloaded, &leechers ) ) {
     memset( reply, 0, 12);
   } else {
     uint32_t *r = (uint32_t*) reply;
-
-    if( clean_single_torrent( torrent ) ) {
-      vector_remove_torrent( torrents_list, torrent );
-      memset( reply, 0, 12);
-      delta_torrentcount = -1;
-    } else {
-      r[0] = htonl( torrent->peer_list->seed_count );
-      r[1] = htonl( torrent->peer_list->down_count );
-      r[2] = htonl( torrent->peer_list->peer_count-torrent->peer_list->seed_count );
-    }
+    r[0] = htonl( seeds );
+    r[1] = htonl( downloaded );
+    r[2] = htonl( leechers );
   }
-  mutex_bucket_unlock_by_hash( hash, delta_torrentcount );
+  /* terasaur -- end mod */
   return 12;
 }
 
 /* Fetches scrape info for a specific torrent */
 size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply ) {
   char *r = reply;
-  int   exactmatch, i;
+  /* terasaur -- begin mod */
+  int   i;
+  /* terasaur -- end mod */
 
   r += sprintf( r, "d5:filesd" );
 
   for( i=0; i<amount; ++i ) {
-    int          delta_torrentcount = 0;
+    /* terasaur -- begin mod */
+    size_t       seeds, downloaded, leechers;
     ot_hash     *hash = hash_list + i;
-    ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *hash );
-    ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
 
-    if( exactmatch ) {
-      if( clean_single_torrent( torrent ) ) {
-        vector_remove_torrent( torrents_list, torrent );
-        delta_torrentcount = -1;
-      } else {
-        *r++='2';*r++='0';*r++=':';
-        memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee",
-          torrent->peer_list->seed_count, torrent->peer_list->down_count, torrent->peer_list->peer_count-torrent->peer_list->seed_count );
-      }
+    if( scrape_torrent( *hash, &seeds, &downloaded, &leechers ) ) {
+      *r++='2';*r++='0';*r++=':';
+      memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
+      r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", seeds, downloaded, leechers );
     }
-    mutex_bucket_unlock_by_hash( *hash, delta_torrentcount );
+    /* terasaur -- end mod */
   }
 
   *r++ = 'e'; *r++ = 'e';
@@ -447,10 +676,16 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
 
 static ot_peerlist dummy_list;
 size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
-  int          exactmatch;
-  ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
-  ot_torrent  *torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_vector   *torrents_list;
+  ot_torrent  *torrent;
   ot_peerlist *peer_list = &dummy_list;
+  /* terasaur -- begin mod */
+  ot_peerlist *own_lock = NULL;
+
+  mutex_bucket_caller( OT_LOCK_ANNOUNCE );
+  /* terasaur -- end mod */
+  torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
+  torrent = vector_find_torrent( torrents_list->data, OT_TORRENT_SLOTS( torrents_list ), *ws->hash );
 
 #ifdef WANT_SYNC_LIVE
   if( proto != FLAG_MCA ) {
@@ -459,8 +694,16 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   }
 #endif
 
-  if( exactmatch ) {
+  if( torrent ) {
     peer_list = torrent->peer_list;
+    /* terasaur -- begin mod */
+    if( peer_list->lock ) {
+      own_lock = peer_list;
+      mutex_torrent_hold( own_lock );
+      mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+      mutex_torrent_lock( own_lock );
+    }
+    /* terasaur -- end mod */
     switch( vector_remove_peer( &peer_list->peers, &ws->peer ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
       case 1:  peer_list->peer_count--; /* Fall throughs intended */
@@ -481,7 +724,9 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
     ws->reply_size = 20;
   }
 
-  mutex_bucket_unlock_by_hash( *ws->hash, 0 );
+  /* terasaur -- begin mod */
+  announce_unlock( *ws->hash, own_lock, 0 );
+  /* terasaur -- end mod */
   return ws->reply_size;
 }
 
@@ -490,14 +735,21 @@ void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data
   size_t j;
 
   for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
-    ot_vector  *torrents_list = mutex_bucket_lock( bucket );
+    /* terasaur -- begin mod */
+    /* for_each only reads, see its callers in ot_stats.c */
+    ot_vector  *torrents_list = mutex_bucket_lock_shared( bucket );
+    /* terasaur -- end mod */
     ot_torrent *torrents = (ot_torrent*)(torrents_list->data);
 
-    for( j=0; j<torrents_list->size; ++j )
-      if( for_each( torrents + j, data ) )
+    /* terasaur -- begin mod */
+    for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j )
+      if( torrents[j].peer_list && for_each( torrents + j, data ) )
         break;
+    /* terasaur -- end mod */
 
-    mutex_bucket_unlock( bucket, 0 );
+    /* terasaur -- begin mod */
+    mutex_bucket_unlock_shared( bucket );
+    /* terasaur -- end mod */
     if( !g_opentracker_running ) return;
   }
 }
@@ -535,8 +787,12 @@ void trackerlogic_deinit( void ) {
   for(bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
     ot_vector *torrents_list = mutex_bucket_lock( bucket );
     if( torrents_list->size ) {
-      for( j=0; j<torrents_list->size; ++j ) {
+      /* terasaur -- begin mod */
+      for( j=0; j<OT_TORRENT_SLOTS( torrents_list ); ++j ) {
         ot_torrent *torrent = ((ot_torrent*)(torrents_list->data)) + j;
+        if( !torrent->peer_list )
+          continue;
+        /* terasaur -- end mod */
         free_peerlist( torrent->peer_list );
         delta_torrentcount -= 1;
       }
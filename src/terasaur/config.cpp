@@ -41,10 +41,21 @@ void parse_file(string config_file) {
     _config_options["main.bind_udp_address"] = pt.get<string>("main.bind_udp_address", "0.0.0.0");
     _config_options["main.bind_udp_port"] = pt.get<string>("main.bind_udp_port", "6969");
     _config_options["main.udp_workers"] = pt.get<string>("main.udp_workers", "4");
+    _config_options["main.udp_shards"] = pt.get<string>("main.udp_shards", "0");
+    _config_options["main.bucket_count_bits"] = pt.get<string>("main.bucket_count_bits", "10");
+    _config_options["main.torrent_lock_peers"] = pt.get<string>("main.torrent_lock_peers", "8192");
     _config_options["main.access_stats"] = pt.get<string>("main.access_stats", "127.0.0.1");
     _config_options["main.stats_url_path"] = pt.get<string>("main.stats_url_path", "stats");
     _config_options["main.redirect_url"] = pt.get<string>("main.redirect_url", "");
 
+    // Torrent database params
+    _config_options["torrent_db.backend"] = pt.get<string>("torrent_db.backend", "mongodb");
+    _config_options["torrent_db.local_path"] = pt.get<string>("torrent_db.local_path", "");
+    _config_options["torrent_db.local_latency_us"] = pt.get<string>("torrent_db.local_latency_us", "0");
+    _config_options["torrent_db.breaker_failures"] = pt.get<string>("torrent_db.breaker_failures", "5");
+    _config_options["torrent_db.breaker_retry_interval"] = pt.get<string>("torrent_db.breaker_retry_interval", "10");
+    _config_options["torrent_db.breaker_slow_call_ms"] = pt.get<string>("torrent_db.breaker_slow_call_ms", "2000");
+
     // MongoDB params
     _config_options["torrent_db.db_host"] = pt.get<string>("torrent_db.db_host", "localhost");
     _config_options["torrent_db.db_port"] = pt.get<string>("torrent_db.db_port", "27017");
@@ -53,6 +64,29 @@ void parse_file(string config_file) {
     _config_options["torrent_db.db_name"] = pt.get<string>("torrent_db.db_name", "tstracker");
     _config_options["torrent_db.torrent_collection_name"] = pt.get<string>("torrent_db.torrent_collection_name", "torrent");
     _config_options["torrent_db.seedbank_collection_name"] = pt.get<string>("torrent_db.seedbank_collection_name", "seedbank");
+
+    // Torrent ACL cache params
+    _config_options["torrent_cache.max_entries"] = pt.get<string>("torrent_cache.max_entries", "1000000");
+    _config_options["torrent_cache.positive_ttl"] = pt.get<string>("torrent_cache.positive_ttl", "300");
+    _config_options["torrent_cache.negative_ttl"] = pt.get<string>("torrent_cache.negative_ttl", "60");
+
+    // Torrent index params
+    _config_options["torrent_index.preload"] = pt.get<string>("torrent_index.preload", "1");
+    _config_options["torrent_index.refresh_interval"] = pt.get<string>("torrent_index.refresh_interval", "30");
+    _config_options["torrent_index.full_reload_interval"] = pt.get<string>("torrent_index.full_reload_interval", "3600");
+
+    // Torrent filter params
+    _config_options["torrent_filter.bits_per_entry"] = pt.get<string>("torrent_filter.bits_per_entry", "10");
+
+    // Control socket params
+    _config_options["control.socket_path"] = pt.get<string>("control.socket_path", "");
+
+    // Stats writer params
+    _config_options["stats_writer.batch_size"] = pt.get<string>("stats_writer.batch_size", "500");
+    _config_options["stats_writer.flush_interval_ms"] = pt.get<string>("stats_writer.flush_interval_ms", "1000");
+    _config_options["stats_writer.min_interval"] = pt.get<string>("stats_writer.min_interval", "30");
+    _config_options["stats_writer.journal_path"] = pt.get<string>("stats_writer.journal_path", "/var/tmp/tstracker-stats.journal");
+    _config_options["stats_writer.journal_max_entries"] = pt.get<string>("stats_writer.journal_max_entries", "1000000");
 }
 
 string get_value(string const& key) {
@@ -0,0 +1,367 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/control_socket.hpp"
+#include "terasaur/torrent.hpp"
+#include "terasaur/torrentdb.hpp"
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/thread_util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <poll.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+
+using std::endl;
+
+namespace terasaur {
+namespace control_socket {
+
+// Large enough for a TORRENT_SET with 255 seedbanks
+#define CONTROL_SOCKET_MAX_MESSAGE 2048
+#define CONTROL_SOCKET_POLL_MS 1000
+
+static int _fd = -1;
+static boost::scoped_ptr<boost::thread> _receiver;
+static volatile bool _running = false;
+
+// counters, only written by the receiver thread
+static unsigned long long _messages = 0;
+static unsigned long long _torrent_sets = 0;
+static unsigned long long _torrent_removes = 0;
+static unsigned long long _seedbank_sets = 0;
+static unsigned long long _seedbank_removes = 0;
+static unsigned long long _malformed = 0;
+
+/**
+ * Bounds checked reads from a received datagram.
+ */
+class message_reader {
+public:
+    message_reader(unsigned char const* data, std::size_t size) : _data(data), _size(size), _offset(0) {}
+
+    bool read(void* dest, std::size_t len) {
+        if (_size - _offset < len) {
+            return false;
+        }
+        memcpy(dest, _data + _offset, len);
+        _offset += len;
+        return true;
+    }
+    bool read_u8(uint8_t& value) {
+        return read(&value, sizeof(value));
+    }
+    bool read_u16(uint16_t& value) {
+        if (!read(&value, sizeof(value))) {
+            return false;
+        }
+        value = ntohs(value);
+        return true;
+    }
+    bool read_i32(int32_t& value) {
+        uint32_t raw;
+        if (!read(&raw, sizeof(raw))) {
+            return false;
+        }
+        value = (int32_t)ntohl(raw);
+        return true;
+    }
+    bool read_i64(int64_t& value) {
+        uint64_t raw;
+        if (!read(&raw, sizeof(raw))) {
+            return false;
+        }
+        value = (int64_t)be64toh(raw);
+        return true;
+    }
+    bool at_end() const {
+        return _offset == _size;
+    }
+
+private:
+    unsigned char const* _data;
+    std::size_t _size;
+    std::size_t _offset;
+};
+
+static bool _read_hash(message_reader& reader, sha1_hash& info_hash) {
+    char raw[sha1_hash::size];
+    if (!reader.read(raw, sizeof(raw))) {
+        return false;
+    }
+    info_hash.assign(raw);
+    return true;
+}
+
+/**
+ * The index entry is replaced and the cached result dropped, so the next
+ * announce is authorized from the new record without a database query.
+ */
+static bool _torrent_set(message_reader& reader) {
+    terasaur::torrent torrent;
+    int64_t published;
+    uint8_t count;
+    if (!_read_hash(reader, torrent.info_hash) || !reader.read_i64(published) || !reader.read_u8(count)) {
+        return false;
+    }
+    torrent.published = (time_t)published;
+    for (uint8_t i = 0; i < count; ++i) {
+        int32_t seedbank_id;
+        if (!reader.read_i32(seedbank_id)) {
+            return false;
+        }
+        torrent.seedbank_ids.push_back(seedbank_id);
+    }
+    if (!reader.at_end()) {
+        return false;
+    }
+
+    torrent_filter::add(torrent.info_hash);
+    torrent_index::insert(torrent);
+    torrent_cache::invalidate(torrent.info_hash);
+    ++_torrent_sets;
+#ifdef _DEBUG
+    log_util::debug() << "control_socket: torrent set (" << torrent.info_hash << ")" << endl;
+#endif
+    return true;
+}
+
+static bool _torrent_remove(message_reader& reader) {
+    sha1_hash info_hash;
+    if (!_read_hash(reader, info_hash) || !reader.at_end()) {
+        return false;
+    }
+
+    torrent_index::remove(info_hash);
+    torrent_cache::put_not_found(info_hash);
+    ++_torrent_removes;
+#ifdef _DEBUG
+    log_util::debug() << "control_socket: torrent removed (" << info_hash << ")" << endl;
+#endif
+    return true;
+}
+
+/**
+ * Cached seedbank peer lists are not keyed by seedbank, so a seedbank change
+ * drops the whole torrent cache.  It refills from the torrent index.
+ */
+static bool _seedbank_set(message_reader& reader) {
+    int32_t seedbank_id;
+    uint16_t port;
+    unsigned char address[16];
+    if (!reader.read_i32(seedbank_id) || !reader.read_u16(port) || !reader.read(address, sizeof(address))
+            || !reader.at_end()) {
+        return false;
+    }
+
+    static unsigned char const v4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    char ip_address[INET6_ADDRSTRLEN];
+    char const* formatted;
+    if (memcmp(address, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0) {
+        formatted = inet_ntop(AF_INET, address + 12, ip_address, sizeof(ip_address));
+    } else {
+        formatted = inet_ntop(AF_INET6, address, ip_address, sizeof(ip_address));
+    }
+    if (!formatted) {
+        return false;
+    }
+
+    torrentdb::set_seedbank(seedbank_id, boost::tuples::make_tuple(string(ip_address), (uint16)port));
+    torrent_cache::clear();
+    ++_seedbank_sets;
+#ifdef _DEBUG
+    log_util::debug() << "control_socket: seedbank set (" << seedbank_id << ", " << ip_address << ":" << port << ")" << endl;
+#endif
+    return true;
+}
+
+static bool _seedbank_remove(message_reader& reader) {
+    int32_t seedbank_id;
+    if (!reader.read_i32(seedbank_id) || !reader.at_end()) {
+        return false;
+    }
+
+    torrentdb::remove_seedbank(seedbank_id);
+    torrent_cache::clear();
+    ++_seedbank_removes;
+    return true;
+}
+
+static bool _apply(unsigned char const* data, std::size_t size) {
+    message_reader reader(data, size);
+    uint8_t version, op;
+    if (!reader.read_u8(version) || !reader.read_u8(op) || version != TS_CONTROL_VERSION) {
+        return false;
+    }
+
+    switch (op) {
+        case TS_CONTROL_TORRENT_SET:
+            return _torrent_set(reader);
+        case TS_CONTROL_TORRENT_REMOVE:
+            return _torrent_remove(reader);
+        case TS_CONTROL_SEEDBANK_SET:
+            return _seedbank_set(reader);
+        case TS_CONTROL_SEEDBANK_REMOVE:
+            return _seedbank_remove(reader);
+    }
+    return false;
+}
+
+static void _receiver_loop() {
+#ifdef _DEBUG
+    log_util::debug() << "control_socket::_receiver_loop: start" << endl;
+#endif
+    unsigned char buffer[CONTROL_SOCKET_MAX_MESSAGE];
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+
+    while (_running) {
+        // Wake up now and then to notice stop()
+        if (poll(&pfd, 1, CONTROL_SOCKET_POLL_MS) <= 0) {
+            continue;
+        }
+
+        ssize_t size;
+        while ((size = recv(_fd, buffer, sizeof(buffer), MSG_DONTWAIT | MSG_TRUNC)) >= 0) {
+            ++_messages;
+            if ((std::size_t)size > sizeof(buffer) || !_apply(buffer, size)) {
+                ++_malformed;
+                log_util::error() << "control_socket: ignoring malformed message (" << size << " bytes)" << endl;
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_util::error() << "control_socket: receive failed (" << strerror(errno) << ")" << endl;
+        }
+    }
+
+#ifdef _DEBUG
+    log_util::debug() << "control_socket::_receiver_loop: returning" << endl;
+#endif
+}
+
+static void _close(std::string const& path) {
+    close(_fd);
+    _fd = -1;
+    unlink(path.c_str());
+}
+
+/**
+ * Bind the socket.  Must be called before opentracker drops privileges and
+ * chroots.  The socket file is created owner-only and only opened up to mode
+ * 0660 once it belongs to owner, the user the tracker will run as, so that
+ * user's group can write to it.  Fails if the file cannot be secured.
+ */
+bool open(std::string const& path, std::string const& owner) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        log_util::error() << "control_socket: path too long (" << path << ")" << endl;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    _fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (_fd < 0) {
+        log_util::error() << "control_socket: socket failed (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+
+    // Left behind by an earlier run
+    unlink(path.c_str());
+
+    // bind() creates the file with the umask applied, keep it private until
+    // the owner and mode below are in place
+    mode_t const old_umask = umask(0177);
+    int const bound = bind(_fd, (struct sockaddr*)&addr, sizeof(addr));
+    int const bind_errno = errno;
+    umask(old_umask);
+    if (bound != 0) {
+        log_util::error() << "control_socket: unable to bind " << path << " (" << strerror(bind_errno) << ")" << endl;
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    if (geteuid() == 0 && !owner.empty()) {
+        struct passwd* pws = getpwnam(owner.c_str());
+        if (!pws || chown(path.c_str(), pws->pw_uid, pws->pw_gid) != 0) {
+            log_util::error() << "control_socket: unable to hand " << path << " to " << owner << endl;
+            _close(path);
+            return false;
+        }
+    }
+    if (chmod(path.c_str(), 0660) != 0) {
+        log_util::error() << "control_socket: unable to chmod " << path << " (" << strerror(errno) << ")" << endl;
+        _close(path);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Start the receiver thread, if open() succeeded.
+ */
+void start() {
+    if (_fd < 0 || _receiver) {
+        return;
+    }
+    _running = true;
+    _receiver.reset(thread_util::create_thread(_receiver_loop));
+}
+
+void stop() {
+    if (!_receiver) {
+        return;
+    }
+    _running = false;
+    if (_receiver->timed_join(boost::posix_time::milliseconds(2 * CONTROL_SOCKET_POLL_MS))) {
+        _receiver.reset();
+    }
+}
+
+/**
+ * True once open() has succeeded, so torrents registered from now on are
+ * reported here as they are added.
+ */
+bool is_open() {
+    return _fd >= 0;
+}
+
+void write_stats(std::ostream& out) {
+    out << "control_socket.open: " << (_fd >= 0) << "\n";
+    out << "control_socket.messages: " << _messages << "\n";
+    out << "control_socket.torrent_sets: " << _torrent_sets << "\n";
+    out << "control_socket.torrent_removes: " << _torrent_removes << "\n";
+    out << "control_socket.seedbank_sets: " << _seedbank_sets << "\n";
+    out << "control_socket.seedbank_removes: " << _seedbank_removes << "\n";
+    out << "control_socket.malformed: " << _malformed << "\n";
+}
+
+} // namespace control_socket
+} // namespace terasaur
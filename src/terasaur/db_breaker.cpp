@@ -0,0 +1,126 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/db_breaker.hpp"
+#include "terasaur/log_util.hpp"
+#include <boost/thread/mutex.hpp>
+
+using std::endl;
+
+namespace terasaur {
+namespace db_breaker {
+
+static boost::mutex _mutex;
+static unsigned int _failure_threshold = 0;
+static time_t _retry_interval = 10;
+static long _slow_call_ms = 0;
+
+// state, protected by _mutex
+static bool _open = false;
+static time_t _retry_at = 0;
+static unsigned int _consecutive_failures = 0;
+
+// counters, protected by _mutex
+static unsigned long long _failures = 0;
+static unsigned long long _slow_calls = 0;
+static unsigned long long _trips = 0;
+static unsigned long long _probes = 0;
+static unsigned long long _rejected = 0;
+
+/**
+ * A failure_threshold of 0 disables the breaker.  A slow_call_ms of 0 means
+ * only errors count as failures.
+ */
+void init(unsigned int failure_threshold, time_t retry_interval, long slow_call_ms) {
+    boost::mutex::scoped_lock lock(_mutex);
+    _failure_threshold = failure_threshold;
+    _retry_interval = retry_interval > 0 ? retry_interval : 1;
+    _slow_call_ms = slow_call_ms;
+}
+
+/**
+ * Returns false if the call should fail at once rather than go to the
+ * database.
+ */
+bool allow() {
+    boost::mutex::scoped_lock lock(_mutex);
+    if (!_open) {
+        return true;
+    }
+
+    time_t const now = time(NULL);
+    if (now >= _retry_at) {
+        // Let this one through as a probe and hold off everyone else
+        _retry_at = now + _retry_interval;
+        ++_probes;
+        return true;
+    }
+    ++_rejected;
+    return false;
+}
+
+/**
+ * Report the outcome of a call that allow() let through.
+ */
+void record(bool success, long elapsed_ms) {
+    boost::mutex::scoped_lock lock(_mutex);
+    bool const slow = _slow_call_ms > 0 && elapsed_ms >= _slow_call_ms;
+    if (slow) {
+        ++_slow_calls;
+    }
+
+    if (success && !slow) {
+        if (_open) {
+            log_util::error() << "db_breaker: torrent database is back, closing breaker" << endl;
+        }
+        _open = false;
+        _consecutive_failures = 0;
+        return;
+    }
+
+    ++_failures;
+    ++_consecutive_failures;
+    if (_open) {
+        // Failed probe
+        _retry_at = time(NULL) + _retry_interval;
+    } else if (_failure_threshold > 0 && _consecutive_failures >= _failure_threshold) {
+        _open = true;
+        _retry_at = time(NULL) + _retry_interval;
+        ++_trips;
+        log_util::error() << "db_breaker: " << _consecutive_failures << " failed or slow torrent database calls, "
+                          << "opening breaker for " << _retry_interval << "s" << endl;
+    }
+}
+
+bool is_open() {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _open;
+}
+
+void write_stats(std::ostream& out) {
+    boost::mutex::scoped_lock lock(_mutex);
+    out << "db_breaker.state: " << (_open ? "open" : "closed") << "\n";
+    out << "db_breaker.consecutive_failures: " << _consecutive_failures << "\n";
+    out << "db_breaker.failures: " << _failures << "\n";
+    out << "db_breaker.slow_calls: " << _slow_calls << "\n";
+    out << "db_breaker.trips: " << _trips << "\n";
+    out << "db_breaker.probes: " << _probes << "\n";
+    out << "db_breaker.rejected: " << _rejected << "\n";
+}
+
+} // namespace db_breaker
+} // namespace terasaur
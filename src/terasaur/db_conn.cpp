@@ -0,0 +1,183 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/db_conn.hpp"
+#include "terasaur/log_util.hpp"
+#include <algorithm>
+#include <ctime>
+#include <list>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+using std::endl;
+using mongo::DBClientConnection;
+
+namespace terasaur {
+namespace db_conn {
+
+#define DB_CONN_SOCKET_TIMEOUT 5.0
+#define DB_CONN_MIN_BACKOFF 1
+#define DB_CONN_MAX_BACKOFF 30
+
+struct thread_conn_t {
+    unsigned int id;
+    boost::scoped_ptr<DBClientConnection> conn;
+    time_t next_attempt;
+    time_t backoff;
+    // Written by the owning thread only, read by the stats worker
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long connects;
+    unsigned long long total_latency_us;
+    unsigned long long max_latency_us;
+
+    thread_conn_t();
+    ~thread_conn_t();
+};
+
+static std::string _connection_string;
+static boost::mutex _registry_mutex;
+static std::list<thread_conn_t*> _registry;
+static unsigned int _next_id = 0;
+static boost::thread_specific_ptr<thread_conn_t> _thread_conns;
+
+thread_conn_t::thread_conn_t()
+    : next_attempt(0), backoff(0), calls(0), errors(0), connects(0), total_latency_us(0), max_latency_us(0) {
+    boost::mutex::scoped_lock lock(_registry_mutex);
+    id = _next_id++;
+    _registry.push_back(this);
+}
+
+thread_conn_t::~thread_conn_t() {
+    boost::mutex::scoped_lock lock(_registry_mutex);
+    _registry.remove(this);
+}
+
+static thread_conn_t* _thread_conn_get() {
+    thread_conn_t* thread_conn = _thread_conns.get();
+    if (!thread_conn) {
+        thread_conn = new thread_conn_t();
+        _thread_conns.reset(thread_conn);
+    }
+    return thread_conn;
+}
+
+/**
+ * Make sure the thread has a connection object.  A failed connection is
+ * replaced once its backoff has passed; until then it is handed out as is
+ * and callers see isFailed().
+ */
+static void _connect(thread_conn_t& thread_conn) {
+    if (thread_conn.conn && !thread_conn.conn->isFailed()) {
+        return;
+    }
+
+    time_t const now = time(NULL);
+    if (thread_conn.conn && now < thread_conn.next_attempt) {
+        return;
+    }
+
+    thread_conn.conn.reset(new DBClientConnection(false, 0, DB_CONN_SOCKET_TIMEOUT));
+    std::string errmsg;
+    if (thread_conn.conn->connect(_connection_string, errmsg)) {
+        thread_conn.backoff = 0;
+        __sync_fetch_and_add(&thread_conn.connects, 1);
+#ifdef _DEBUG
+        log_util::debug() << "db_conn::_connect: connection " << thread_conn.id << " connected" << endl;
+#endif
+    } else {
+        if (thread_conn.backoff == 0) {
+            thread_conn.backoff = DB_CONN_MIN_BACKOFF;
+        } else if (thread_conn.backoff < DB_CONN_MAX_BACKOFF) {
+            thread_conn.backoff = std::min<time_t>(thread_conn.backoff * 2, DB_CONN_MAX_BACKOFF);
+        }
+        thread_conn.next_attempt = now + thread_conn.backoff;
+        __sync_fetch_and_add(&thread_conn.errors, 1);
+        log_util::error() << "db_conn: connection " << thread_conn.id << " to " << _connection_string << " failed ("
+                          << errmsg << "), retrying in " << thread_conn.backoff << "s" << endl;
+    }
+}
+
+scoped_conn::scoped_conn() : _thread_conn(_thread_conn_get()), _error(false), _done(false) {
+    _connect(*_thread_conn);
+    _start = boost::posix_time::microsec_clock::universal_time();
+}
+
+scoped_conn::~scoped_conn() {
+    done();
+}
+
+mongo::DBClientBase* scoped_conn::get() const {
+    return _thread_conn->conn.get();
+}
+
+/**
+ * Count the current call as failed, e.g. after catching a mongodb exception
+ * or a getLastError result.
+ */
+void scoped_conn::error() {
+    _error = true;
+}
+
+void scoped_conn::done() {
+    if (_done) {
+        return;
+    }
+    _done = true;
+
+    unsigned long long const latency_us = (boost::posix_time::microsec_clock::universal_time() - _start).total_microseconds();
+    thread_conn_t& thread_conn = *_thread_conn;
+    __sync_fetch_and_add(&thread_conn.calls, 1);
+    __sync_fetch_and_add(&thread_conn.total_latency_us, latency_us);
+    if (latency_us > thread_conn.max_latency_us) {
+        thread_conn.max_latency_us = latency_us;
+    }
+
+    if (_error || thread_conn.conn->isFailed()) {
+        __sync_fetch_and_add(&thread_conn.errors, 1);
+    }
+}
+
+/**
+ * Set the host[:port] that new connections go to.  Must be called before
+ * the first scoped_conn is created.
+ */
+void init(std::string const& connection_string) {
+    _connection_string = connection_string;
+}
+
+void write_stats(std::ostream& out) {
+    boost::mutex::scoped_lock lock(_registry_mutex);
+    out << "db_conn.connections: " << _registry.size() << "\n";
+
+    std::list<thread_conn_t*>::const_iterator iter;
+    for (iter = _registry.begin(); iter != _registry.end(); ++iter) {
+        thread_conn_t& thread_conn = **iter;
+        unsigned long long const calls = __sync_fetch_and_add(&thread_conn.calls, 0);
+        unsigned long long const total_latency_us = __sync_fetch_and_add(&thread_conn.total_latency_us, 0);
+
+        out << "db_conn." << thread_conn.id << ".calls: " << calls << "\n";
+        out << "db_conn." << thread_conn.id << ".errors: " << __sync_fetch_and_add(&thread_conn.errors, 0) << "\n";
+        out << "db_conn." << thread_conn.id << ".connects: " << __sync_fetch_and_add(&thread_conn.connects, 0) << "\n";
+        out << "db_conn." << thread_conn.id << ".avg_latency_us: " << (calls ? total_latency_us / calls : 0) << "\n";
+        out << "db_conn." << thread_conn.id << ".max_latency_us: " << thread_conn.max_latency_us << "\n";
+    }
+}
+
+} // namespace db_conn
+} // namespace terasaur
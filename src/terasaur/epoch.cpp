@@ -0,0 +1,154 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/epoch.hpp"
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace terasaur {
+namespace epoch {
+
+/**
+ * One record per reader thread.  Records are never freed; a record left
+ * behind by a finished thread is picked up by the next new one.  Each sits
+ * on its own cache line, as its owner writes it on every enter() and leave().
+ */
+struct reader_t {
+    volatile unsigned long epoch;
+    volatile int active;
+    volatile int in_use;
+    reader_t* next;
+} __attribute__((aligned(64)));
+
+static reader_t* volatile _readers = NULL;
+static volatile unsigned long _epoch = 0;
+
+// retired pointers by epoch modulo 3, protected by _mutex
+static boost::mutex _mutex;
+static std::vector<void*> _limbo[3];
+
+// counters, protected by _mutex
+static unsigned long long _retired = 0;
+static unsigned long long _reclaimed = 0;
+
+static void _release_reader(reader_t* reader) {
+    reader->active = 0;
+    __sync_synchronize();
+    reader->in_use = 0;
+}
+
+static boost::thread_specific_ptr<reader_t> _reader(_release_reader);
+
+static reader_t* _get_reader() {
+    reader_t* reader = _reader.get();
+    if (reader) {
+        return reader;
+    }
+
+    for (reader = _readers; reader; reader = reader->next) {
+        if (!reader->in_use && __sync_bool_compare_and_swap(&reader->in_use, 0, 1)) {
+            _reader.reset(reader);
+            return reader;
+        }
+    }
+
+    void* mem;
+    if (posix_memalign(&mem, sizeof(reader_t), sizeof(reader_t))) {
+        throw std::bad_alloc();
+    }
+    reader = new (mem) reader_t();
+    reader->in_use = 1;
+    do {
+        reader->next = _readers;
+    } while (!__sync_bool_compare_and_swap(&_readers, reader->next, reader));
+    _reader.reset(reader);
+    return reader;
+}
+
+void enter() {
+    reader_t* reader = _get_reader();
+    reader->active = 1;
+    __sync_synchronize();
+    reader->epoch = _epoch;
+    __sync_synchronize();
+}
+
+void leave() {
+    reader_t* reader = _reader.get();
+    __sync_synchronize();
+    reader->active = 0;
+}
+
+void retire(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    boost::mutex::scoped_lock lock(_mutex);
+    _limbo[_epoch % 3].push_back(ptr);
+    ++_retired;
+}
+
+/**
+ * Called regularly by the clean worker.  Cheap when there is nothing to do.
+ */
+void reclaim() {
+    std::vector<void*> freeing;
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        unsigned long const current = _epoch;
+
+        __sync_synchronize();
+        for (reader_t* reader = _readers; reader; reader = reader->next) {
+            if (reader->active && reader->epoch != current) {
+                return;
+            }
+        }
+
+        // Retired two epochs before the new one, see the header
+        _epoch = current + 1;
+        __sync_synchronize();
+        freeing.swap(_limbo[(current + 2) % 3]);
+        _reclaimed += freeing.size();
+    }
+
+    std::vector<void*>::const_iterator iter;
+    for (iter = freeing.begin(); iter != freeing.end(); ++iter) {
+        free(*iter);
+    }
+}
+
+void write_stats(std::ostream& out) {
+    unsigned long long readers = 0;
+    for (reader_t* reader = _readers; reader; reader = reader->next) {
+        if (reader->in_use) {
+            ++readers;
+        }
+    }
+
+    boost::mutex::scoped_lock lock(_mutex);
+    out << "epoch.epoch: " << _epoch << "\n";
+    out << "epoch.readers: " << readers << "\n";
+    out << "epoch.retired: " << _retired << "\n";
+    out << "epoch.reclaimed: " << _reclaimed << "\n";
+    out << "epoch.pending: " << _limbo[0].size() + _limbo[1].size() + _limbo[2].size() << "\n";
+}
+
+} // namespace epoch
+} // namespace terasaur
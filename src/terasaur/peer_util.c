@@ -36,8 +36,11 @@ void print_peers_vector(ot_vector *vector) {
     ot_peer* tmp = (ot_peer*)vector->data;
     size_t i = 0;
 
-    while (i < vector->size) {
-        print_peer(tmp++);
+    while (i < OT_PEER_SLOTS(vector)) {
+        if (OT_PEER_SLOT_USED(tmp)) {
+            print_peer(tmp);
+        }
+        ++tmp;
         ++i;
     }
 }
@@ -0,0 +1,328 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/slab.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef WANT_SLAB
+
+/**
+ * One class for peer lists and one per power of two peer array size, from
+ * OT_VECTOR_MIN_MEMBERS up to TS_SLAB_MAX_PEERS peers.  Objects are carved
+ * from chunks that are never given back; freed objects are kept for reuse.
+ *
+ * Each thread keeps a short free list per class and only takes the class
+ * mutex to move a batch of objects to or from the class depot.  The clean
+ * worker frees what the announce workers allocated, so its free lists spill
+ * into the depots and the workers refill from there.
+ */
+#define SLAB_CLASS_PEERLIST 0
+#define SLAB_CLASS_COUNT 7
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_BATCH 32
+#define SLAB_CACHE_MAX (2 * SLAB_BATCH)
+
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object_t;
+
+typedef struct {
+    size_t size;
+    pthread_mutex_t mutex;
+    slab_object_t *depot;
+    size_t depot_count;
+    char *carve;
+    size_t carve_left;
+    unsigned long long chunks;
+} slab_class_t;
+
+/* Blocks are never freed, threads using the slabs live as long as the tracker */
+typedef struct slab_cache {
+    slab_object_t *free[SLAB_CLASS_COUNT];
+    size_t count[SLAB_CLASS_COUNT];
+    unsigned long long allocs[SLAB_CLASS_COUNT];
+    unsigned long long frees[SLAB_CLASS_COUNT];
+    unsigned long long refills[SLAB_CLASS_COUNT];
+    unsigned long long spills[SLAB_CLASS_COUNT];
+    struct slab_cache *next;
+} slab_cache_t;
+
+#define SLAB_CLASS_INITIALIZER(size) { (size), PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL, 0, 0 }
+
+static slab_class_t _classes[SLAB_CLASS_COUNT] = {
+    SLAB_CLASS_INITIALIZER((sizeof(ot_peerlist) + 15) & ~(size_t)15),
+    SLAB_CLASS_INITIALIZER(2 * sizeof(ot_peer)),
+    SLAB_CLASS_INITIALIZER(4 * sizeof(ot_peer)),
+    SLAB_CLASS_INITIALIZER(8 * sizeof(ot_peer)),
+    SLAB_CLASS_INITIALIZER(16 * sizeof(ot_peer)),
+    SLAB_CLASS_INITIALIZER(32 * sizeof(ot_peer)),
+    SLAB_CLASS_INITIALIZER(64 * sizeof(ot_peer))
+};
+
+static const char *_class_names[SLAB_CLASS_COUNT] =
+    { "peerlist", "peers2", "peers4", "peers8", "peers16", "peers32", "peers64" };
+
+static slab_cache_t * volatile _caches;
+static __thread slab_cache_t *_thread_cache;
+
+/* Peer arrays too large for a class, updated with atomic builtins */
+static unsigned long long _large_allocs = 0;
+
+static slab_cache_t *_get_cache(void) {
+    slab_cache_t *cache = _thread_cache;
+    if (!cache && (cache = calloc(1, sizeof(slab_cache_t)))) {
+        do {
+            cache->next = _caches;
+        } while (!__sync_bool_compare_and_swap(&_caches, cache->next, cache));
+        _thread_cache = cache;
+    }
+    return cache;
+}
+
+/* Peer arrays too large for the slabs map to SLAB_CLASS_COUNT */
+static int _peers_class(size_t count) {
+    int slab_class = 1;
+    size_t capacity = 2;
+    while (capacity < count && slab_class < SLAB_CLASS_COUNT) {
+        capacity *= 2;
+        ++slab_class;
+    }
+    return slab_class;
+}
+
+/* Move up to a batch of objects from the depot, or fresh ones, to the cache */
+static void _refill(slab_cache_t *cache, int slab_class) {
+    slab_class_t *c = &_classes[slab_class];
+    size_t moved = 0;
+
+    pthread_mutex_lock(&c->mutex);
+    while (c->depot && moved < SLAB_BATCH) {
+        slab_object_t *object = c->depot;
+        c->depot = object->next;
+        object->next = cache->free[slab_class];
+        cache->free[slab_class] = object;
+        ++moved;
+    }
+    c->depot_count -= moved;
+
+    while (moved < SLAB_BATCH) {
+        slab_object_t *object;
+        if (c->carve_left < c->size) {
+            char *chunk = malloc(SLAB_CHUNK_SIZE);
+            if (!chunk) {
+                break;
+            }
+            c->carve = chunk;
+            c->carve_left = SLAB_CHUNK_SIZE;
+            ++c->chunks;
+        }
+        object = (slab_object_t*)c->carve;
+        c->carve += c->size;
+        c->carve_left -= c->size;
+        object->next = cache->free[slab_class];
+        cache->free[slab_class] = object;
+        ++moved;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    cache->count[slab_class] += moved;
+    ++cache->refills[slab_class];
+}
+
+/* Hand a batch of objects from a full cache back to the depot */
+static void _spill(slab_cache_t *cache, int slab_class) {
+    slab_class_t *c = &_classes[slab_class];
+    slab_object_t *first = cache->free[slab_class], *last = first;
+    size_t moved = 1;
+
+    while (moved < SLAB_BATCH) {
+        last = last->next;
+        ++moved;
+    }
+    cache->free[slab_class] = last->next;
+    cache->count[slab_class] -= moved;
+    ++cache->spills[slab_class];
+
+    pthread_mutex_lock(&c->mutex);
+    last->next = c->depot;
+    c->depot = first;
+    c->depot_count += moved;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void *_alloc(int slab_class) {
+    slab_cache_t *cache = _get_cache();
+    slab_object_t *object;
+
+    if (!cache) {
+        return NULL;
+    }
+    if (!cache->free[slab_class]) {
+        _refill(cache, slab_class);
+    }
+    if (!(object = cache->free[slab_class])) {
+        return NULL;
+    }
+    cache->free[slab_class] = object->next;
+    --cache->count[slab_class];
+    ++cache->allocs[slab_class];
+    return object;
+}
+
+static void _free(void *ptr, int slab_class) {
+    slab_cache_t *cache = _get_cache();
+    slab_object_t *object = (slab_object_t*)ptr;
+
+    if (!cache) {
+        /* Cannot happen for a thread that allocated, leak the object */
+        return;
+    }
+    object->next = cache->free[slab_class];
+    cache->free[slab_class] = object;
+    ++cache->frees[slab_class];
+    if (++cache->count[slab_class] > SLAB_CACHE_MAX) {
+        _spill(cache, slab_class);
+    }
+}
+
+void *ts_slab_alloc_peers(size_t count) {
+    int const slab_class = _peers_class(count);
+    if (slab_class == SLAB_CLASS_COUNT) {
+        __sync_fetch_and_add(&_large_allocs, 1);
+        return malloc(count * sizeof(ot_peer));
+    }
+    return _alloc(slab_class);
+}
+
+/**
+ * Like realloc, arrays that stay within their class are not moved.
+ */
+void *ts_slab_realloc_peers(void *peers, size_t old_count, size_t new_count) {
+    int const old_class = _peers_class(old_count), new_class = _peers_class(new_count);
+    void *new_peers;
+
+    if (!peers) {
+        return ts_slab_alloc_peers(new_count);
+    }
+    if (old_class == new_class) {
+        if (new_class == SLAB_CLASS_COUNT) {
+            return realloc(peers, new_count * sizeof(ot_peer));
+        }
+        return peers;
+    }
+
+    if (!(new_peers = ts_slab_alloc_peers(new_count))) {
+        return NULL;
+    }
+    memcpy(new_peers, peers, (old_count < new_count ? old_count : new_count) * sizeof(ot_peer));
+    ts_slab_free_peers(peers, old_count);
+    return new_peers;
+}
+
+void ts_slab_free_peers(void *peers, size_t count) {
+    int const slab_class = _peers_class(count);
+    if (!peers) {
+        return;
+    }
+    if (slab_class == SLAB_CLASS_COUNT) {
+        free(peers);
+    } else {
+        _free(peers, slab_class);
+    }
+}
+
+#ifndef WANT_LOCKLESS_SCRAPE
+ot_peerlist *ts_slab_alloc_peerlist(void) {
+    return (ot_peerlist*)_alloc(SLAB_CLASS_PEERLIST);
+}
+
+void ts_slab_free_peerlist(ot_peerlist *peer_list) {
+    if (peer_list) {
+        _free(peer_list, SLAB_CLASS_PEERLIST);
+    }
+}
+#endif
+
+/**
+ * Write plain text allocator stats into reply.  Per thread counters are
+ * summed while their owners keep going, so the numbers are approximate.
+ * Output is truncated to reply_size bytes.
+ */
+size_t ts_slab_stats(char *reply, size_t reply_size) {
+    char *r = reply, *r_end = reply + reply_size;
+    unsigned int threads = 0;
+    slab_cache_t *cache;
+    int slab_class;
+
+    for (cache = _caches; cache; cache = cache->next) {
+        ++threads;
+    }
+    r += snprintf(r, r_end - r, "slab.threads: %u\n", threads);
+    if (r < r_end) {
+        r += snprintf(r, r_end - r, "slab.large_allocs: %llu\n", __sync_fetch_and_add(&_large_allocs, 0));
+    }
+
+    for (slab_class = 0; slab_class < SLAB_CLASS_COUNT && r < r_end; ++slab_class) {
+        slab_class_t *c = &_classes[slab_class];
+        unsigned long long allocs = 0, frees = 0, refills = 0, spills = 0, chunks;
+        size_t cached = 0, depot;
+
+        for (cache = _caches; cache; cache = cache->next) {
+            allocs += cache->allocs[slab_class];
+            frees += cache->frees[slab_class];
+            refills += cache->refills[slab_class];
+            spills += cache->spills[slab_class];
+            cached += cache->count[slab_class];
+        }
+        pthread_mutex_lock(&c->mutex);
+        chunks = c->chunks;
+        depot = c->depot_count;
+        pthread_mutex_unlock(&c->mutex);
+
+        r += snprintf(r, r_end - r,
+                      "slab.%s.object_size: %zu\n"
+                      "slab.%s.reserved_bytes: %llu\n"
+                      "slab.%s.in_use: %lld\n"
+                      "slab.%s.thread_cached: %zu\n"
+                      "slab.%s.depot: %zu\n"
+                      "slab.%s.allocs: %llu\n"
+                      "slab.%s.frees: %llu\n"
+                      "slab.%s.refills: %llu\n"
+                      "slab.%s.spills: %llu\n",
+                      _class_names[slab_class], c->size,
+                      _class_names[slab_class], chunks * SLAB_CHUNK_SIZE,
+                      _class_names[slab_class], (long long)(allocs - frees),
+                      _class_names[slab_class], cached,
+                      _class_names[slab_class], depot,
+                      _class_names[slab_class], allocs,
+                      _class_names[slab_class], frees,
+                      _class_names[slab_class], refills,
+                      _class_names[slab_class], spills);
+    }
+    return r < r_end ? (size_t)(r - reply) : reply_size;
+}
+
+#else
+
+size_t ts_slab_stats(char *reply, size_t reply_size) {
+    int const len = snprintf(reply, reply_size, "slab.enabled: 0\n");
+    return (size_t)len < reply_size ? (size_t)len : reply_size;
+}
+
+#endif
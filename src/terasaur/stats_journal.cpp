@@ -0,0 +1,258 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/stats_journal.hpp"
+#include "terasaur/log_util.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/thread/mutex.hpp>
+
+using std::endl;
+using terasaur::torrentdb::stats_update_t;
+
+namespace terasaur {
+namespace stats_journal {
+
+/**
+ * The file is a header followed by fixed size records in host byte order.
+ * Records before head have been replayed already.  The file is truncated
+ * back to the bare header once everything has been replayed.
+ */
+#define STATS_JOURNAL_MAGIC 0x314a5354 // "TSJ1"
+
+struct journal_header_t {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t head;
+};
+
+struct journal_record_t {
+    unsigned char info_hash[20];
+    uint32_t seeds;
+    uint32_t peers;
+    uint32_t completed;
+};
+
+static boost::mutex _mutex;
+static int _fd = -1;
+static std::size_t _max_entries = 0;
+static uint64_t _head = 0;
+static uint64_t _tail = 0;
+
+// counters, protected by _mutex
+static unsigned long long _appended = 0;
+static unsigned long long _replayed = 0;
+static unsigned long long _rejected = 0;
+static unsigned long long _io_errors = 0;
+
+static off_t _record_offset(uint64_t index) {
+    return sizeof(journal_header_t) + index * sizeof(journal_record_t);
+}
+
+/**
+ * Caller must hold _mutex.
+ */
+static bool _write_header() {
+    journal_header_t header;
+    header.magic = STATS_JOURNAL_MAGIC;
+    header.record_size = sizeof(journal_record_t);
+    header.head = _head;
+    if (pwrite(_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+        ++_io_errors;
+        log_util::error() << "stats_journal: header write failed (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Caller must hold _mutex.
+ */
+static bool _reset() {
+    _head = 0;
+    _tail = 0;
+    if (ftruncate(_fd, sizeof(journal_header_t)) != 0) {
+        ++_io_errors;
+        log_util::error() << "stats_journal: truncate failed (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+    return _write_header();
+}
+
+/**
+ * Open or create the journal.  Must be called before dropping privileges,
+ * since the tracker may chroot afterwards.  Returns false if the journal
+ * cannot be used, in which case append() always fails.
+ */
+bool open(std::string const& path, std::size_t max_entries) {
+    boost::mutex::scoped_lock lock(_mutex);
+    _max_entries = max_entries;
+
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (_fd < 0) {
+        log_util::error() << "stats_journal: unable to open " << path << " (" << strerror(errno) << ")" << endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        log_util::error() << "stats_journal: unable to stat " << path << " (" << strerror(errno) << ")" << endl;
+        ::close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    journal_header_t header;
+    if (st.st_size < (off_t)sizeof(header)
+            || pread(_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+            || header.magic != STATS_JOURNAL_MAGIC || header.record_size != sizeof(journal_record_t)) {
+        if (st.st_size > 0) {
+            log_util::error() << "stats_journal: discarding unreadable journal " << path << endl;
+        }
+        if (!_reset()) {
+            ::close(_fd);
+            _fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    // Ignore a partly written record at the end
+    _tail = (st.st_size - sizeof(header)) / sizeof(journal_record_t);
+    _head = header.head <= _tail ? header.head : _tail;
+    if (_tail > _head) {
+        log_util::error() << "stats_journal: " << _tail - _head << " stats updates left to replay in " << path << endl;
+    }
+    return true;
+}
+
+/**
+ * Append all of updates or none of them.  Returns false if the journal is
+ * not open, would grow past max_entries, or could not be written.
+ */
+bool append(std::vector<stats_update_t> const& updates) {
+    boost::mutex::scoped_lock lock(_mutex);
+    if (_fd < 0) {
+        return false;
+    }
+    if (_tail - _head + updates.size() > _max_entries) {
+        _rejected += updates.size();
+        return false;
+    }
+
+    std::vector<journal_record_t> records(updates.size());
+    for (std::size_t i = 0; i < updates.size(); ++i) {
+        memcpy(records[i].info_hash, &updates[i].info_hash[0], sizeof(records[i].info_hash));
+        records[i].seeds = updates[i].seeds;
+        records[i].peers = updates[i].peers;
+        records[i].completed = updates[i].completed;
+    }
+
+    ssize_t const size = records.size() * sizeof(journal_record_t);
+    if (size == 0) {
+        return true;
+    }
+    if (pwrite(_fd, &records[0], size, _record_offset(_tail)) != size || fdatasync(_fd) != 0) {
+        ++_io_errors;
+        log_util::error() << "stats_journal: write failed (" << strerror(errno) << ")" << endl;
+        // Drop whatever part of the write made it, so a restart does not see it
+        if (ftruncate(_fd, _record_offset(_tail)) != 0) {
+            log_util::error() << "stats_journal: truncate failed (" << strerror(errno) << ")" << endl;
+        }
+        return false;
+    }
+    _tail += records.size();
+    _appended += records.size();
+    return true;
+}
+
+/**
+ * Copy up to max_count of the oldest updates into updates without removing
+ * them.  Call consume() once they have been written to the database.
+ */
+std::size_t read(std::vector<stats_update_t>& updates, std::size_t max_count) {
+    boost::mutex::scoped_lock lock(_mutex);
+    updates.clear();
+    if (_fd < 0 || _head == _tail) {
+        return 0;
+    }
+
+    std::size_t count = _tail - _head;
+    if (count > max_count) {
+        count = max_count;
+    }
+    std::vector<journal_record_t> records(count);
+    ssize_t const size = count * sizeof(journal_record_t);
+    if (pread(_fd, &records[0], size, _record_offset(_head)) != size) {
+        ++_io_errors;
+        log_util::error() << "stats_journal: read failed (" << strerror(errno) << ")" << endl;
+        return 0;
+    }
+
+    updates.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        updates[i].info_hash.assign((char const*)records[i].info_hash);
+        updates[i].seeds = records[i].seeds;
+        updates[i].peers = records[i].peers;
+        updates[i].completed = records[i].completed;
+    }
+    return count;
+}
+
+/**
+ * Mark the count oldest updates as replayed.
+ */
+void consume(std::size_t count) {
+    boost::mutex::scoped_lock lock(_mutex);
+    if (_fd < 0) {
+        return;
+    }
+    _head += count;
+    if (_head > _tail) {
+        _head = _tail;
+    }
+    _replayed += count;
+
+    if (_head == _tail) {
+        _reset();
+    } else {
+        // Not synced, so a power loss may get some batches replayed twice
+        _write_header();
+    }
+}
+
+std::size_t depth() {
+    boost::mutex::scoped_lock lock(_mutex);
+    return _tail - _head;
+}
+
+void write_stats(std::ostream& out) {
+    boost::mutex::scoped_lock lock(_mutex);
+    out << "stats_journal.open: " << (_fd >= 0) << "\n";
+    out << "stats_journal.depth: " << _tail - _head << "\n";
+    out << "stats_journal.capacity: " << _max_entries << "\n";
+    out << "stats_journal.appended: " << _appended << "\n";
+    out << "stats_journal.replayed: " << _replayed << "\n";
+    out << "stats_journal.rejected: " << _rejected << "\n";
+    out << "stats_journal.io_errors: " << _io_errors << "\n";
+}
+
+} // namespace stats_journal
+} // namespace terasaur
@@ -0,0 +1,261 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/stats_writer.hpp"
+#include "terasaur/stats_journal.hpp"
+#include "terasaur/hash_util.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/thread_util.hpp"
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+using std::endl;
+using terasaur::torrentdb::stats_update_t;
+
+namespace terasaur {
+namespace stats_writer {
+
+typedef boost::unordered_map<sha1_hash, stats_update_t, sha1_hash_hasher> pending_map_t;
+
+static boost::mutex _mutex;
+static boost::condition_variable _flush_needed;
+static pending_map_t _pending;
+static boost::scoped_ptr<boost::thread> _writer;
+static bool _running = false;
+static std::size_t _batch_size = 500;
+static boost::posix_time::time_duration _flush_interval = boost::posix_time::seconds(1);
+static time_t _min_interval = 0;
+
+// counters, protected by _mutex
+static unsigned long long _published = 0;
+static unsigned long long _coalesced = 0;
+static unsigned long long _written = 0;
+static unsigned long long _batches = 0;
+static unsigned long long _failed_batches = 0;
+static unsigned long long _journaled = 0;
+
+// updated with atomic builtins, from under the opentracker bucket locks
+static unsigned long long _suppressed = 0;
+
+/**
+ * Fold an update into the pending map.  Seed and peer counts are absolute, so
+ * the newest value wins.  Completed counts are deltas and are summed.
+ *
+ * Caller must hold _mutex.
+ */
+static bool _merge(stats_update_t const& params, bool newer) {
+    pending_map_t::iterator iter = _pending.find(params.info_hash);
+    if (iter == _pending.end()) {
+        _pending[params.info_hash] = params;
+        return false;
+    }
+
+    if (newer) {
+        iter->second.seeds = params.seeds;
+        iter->second.peers = params.peers;
+    }
+    iter->second.completed += params.completed;
+    return true;
+}
+
+/**
+ * Write out the given updates in batches.  Updates from failed batches are
+ * appended to failed so the caller can retry them.
+ */
+static void _flush(pending_map_t const& flushing, std::vector<stats_update_t>& failed) {
+    std::vector<stats_update_t> batch;
+    batch.reserve(_batch_size);
+    unsigned long long written = 0, batches = 0, failed_batches = 0;
+
+    pending_map_t::const_iterator iter = flushing.begin();
+    while (iter != flushing.end()) {
+        batch.push_back(iter->second);
+        ++iter;
+
+        if (batch.size() >= _batch_size || iter == flushing.end()) {
+            ++batches;
+            if (torrentdb::update_stats_batch(batch)) {
+                written += batch.size();
+            } else {
+                ++failed_batches;
+                failed.insert(failed.end(), batch.begin(), batch.end());
+            }
+            batch.clear();
+        }
+    }
+
+    boost::mutex::scoped_lock lock(_mutex);
+    _written += written;
+    _batches += batches;
+    _failed_batches += failed_batches;
+}
+
+/**
+ * Write out journaled updates, oldest first.  Returns true once the journal
+ * is empty, false if the database turned them down.
+ */
+static bool _replay_journal() {
+    std::vector<stats_update_t> batch;
+    while (stats_journal::read(batch, _batch_size) > 0) {
+        if (!torrentdb::update_stats_batch(batch)) {
+            return false;
+        }
+        stats_journal::consume(batch.size());
+    }
+    return stats_journal::depth() == 0;
+}
+
+static void _writer_loop() {
+#ifdef _DEBUG
+    log_util::debug() << "stats_writer::_writer_loop: start" << endl;
+#endif
+    boost::mutex::scoped_lock lock(_mutex);
+    bool backoff = false;
+
+    // Keep going after stop() until everything pending has been written once
+    while (_running || !_pending.empty()) {
+        // Wait out a full interval after a failed flush rather than retrying at once
+        if (_running && (backoff || _pending.size() < _batch_size)) {
+            _flush_needed.timed_wait(lock, _flush_interval);
+        }
+        if (_pending.empty() && stats_journal::depth() == 0) {
+            continue;
+        }
+
+        pending_map_t flushing;
+        flushing.swap(_pending);
+        bool const running = _running;
+        lock.unlock();
+
+        // Journaled updates are older than anything pending, so they go
+        // first.  Until the journal is empty new updates queue up behind it.
+        // The replay is left for the next start when shutting down.
+        bool const replayed = running ? _replay_journal() : stats_journal::depth() == 0;
+        std::vector<stats_update_t> failed;
+        if (replayed) {
+            _flush(flushing, failed);
+        } else {
+            pending_map_t::const_iterator iter;
+            for (iter = flushing.begin(); iter != flushing.end(); ++iter) {
+                failed.push_back(iter->second);
+            }
+        }
+
+        backoff = !replayed || !failed.empty();
+        std::size_t journaled = 0;
+        if (!failed.empty() && stats_journal::append(failed)) {
+            journaled = failed.size();
+            failed.clear();
+        }
+
+        lock.lock();
+        _journaled += journaled;
+        if (_running) {
+            // Put failed updates back behind anything newer that arrived meanwhile
+            std::vector<stats_update_t>::const_iterator iter;
+            for (iter = failed.begin(); iter != failed.end(); ++iter) {
+                _merge(*iter, false);
+            }
+        } else if (!failed.empty()) {
+            log_util::error() << "stats_writer: dropping " << failed.size() << " stats updates at shutdown" << endl;
+        }
+    }
+
+#ifdef _DEBUG
+    log_util::debug() << "stats_writer::_writer_loop: returning" << endl;
+#endif
+}
+
+/**
+ * Start the writer thread.  Pending updates are flushed once batch_size
+ * torrents are waiting or flush_interval_ms has passed, whichever is first.
+ * Changed counts for a torrent are published at most once per min_interval
+ * seconds, see ts_snapshot_torrent_stats.
+ */
+void start(std::size_t batch_size, long flush_interval_ms, time_t min_interval) {
+    boost::mutex::scoped_lock lock(_mutex);
+    if (_writer) {
+        return;
+    }
+    _batch_size = batch_size > 0 ? batch_size : 1;
+    _flush_interval = boost::posix_time::milliseconds(flush_interval_ms);
+    _min_interval = min_interval;
+    _running = true;
+    _writer.reset(thread_util::create_thread(_writer_loop));
+}
+
+/**
+ * Flush whatever is pending and stop the writer thread.  Gives up waiting
+ * after a few seconds if the database does not respond.
+ */
+void stop() {
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        if (!_writer) {
+            return;
+        }
+        _running = false;
+        _flush_needed.notify_one();
+    }
+    if (_writer->timed_join(boost::posix_time::seconds(5))) {
+        _writer.reset();
+    } else {
+        log_util::error() << "stats_writer: timed out waiting for final flush" << endl;
+    }
+}
+
+void enqueue(stats_update_t const& params) {
+    boost::mutex::scoped_lock lock(_mutex);
+    ++_published;
+    if (_merge(params, true)) {
+        ++_coalesced;
+    }
+    if (_pending.size() >= _batch_size) {
+        _flush_needed.notify_one();
+    }
+}
+
+time_t min_interval() {
+    return _min_interval;
+}
+
+/**
+ * Count a torrent stats snapshot that was not published because nothing
+ * changed or the torrent was published too recently.
+ */
+void count_suppressed() {
+    __sync_fetch_and_add(&_suppressed, 1);
+}
+
+void write_stats(std::ostream& out) {
+    boost::mutex::scoped_lock lock(_mutex);
+    out << "stats_writer.pending: " << _pending.size() << "\n";
+    out << "stats_writer.published: " << _published << "\n";
+    out << "stats_writer.suppressed: " << __sync_fetch_and_add(&_suppressed, 0) << "\n";
+    out << "stats_writer.coalesced: " << _coalesced << "\n";
+    out << "stats_writer.written: " << _written << "\n";
+    out << "stats_writer.batches: " << _batches << "\n";
+    out << "stats_writer.failed_batches: " << _failed_batches << "\n";
+    out << "stats_writer.journaled: " << _journaled << "\n";
+}
+
+} // namespace stats_writer
+} // namespace terasaur
@@ -17,14 +17,13 @@
 
 #include "terasaur/torrent.hpp"
 #include "terasaur/log_util.hpp"
-#include "terasaur/date.hpp"
 #include "libtorrent/escape_string.hpp" // from_hex
 
 namespace terasaur {
 
 torrent::torrent()
     : info_hash(0),
-      published() {}
+      published(0) {}
 
 /**
  * Initialize from mongodb query results
@@ -41,18 +40,17 @@ torrent::torrent(mongo::BSONObj const& torrent_record) {
         log_util::error() << "torrent::torrent(BSONObj): error converting hex to sha1_hash" << std::endl;
     }
 
-    // Convert mongodb to boost ptime
+    // Convert mongodb millis to epoch seconds
     mongo::Date_t mongo_pub = torrent_record["published"].Date();
     uint64_t millis = mongo_pub.millis;
-    published = boost::posix_time::from_time_t(millis / 1000);
-}
+    published = millis / 1000;
 
-/**
- * Returns true if published datetime is before the current time.
- */
-bool torrent::is_published() {
-    boost::posix_time::time_duration const diff = date::get_now_utc() - published;
-    return !diff.is_negative();
+    if (torrent_record["seedbanks"].ok() && !torrent_record["seedbanks"].isNull()) {
+        std::vector<mongo::BSONElement> seedbanks = torrent_record["seedbanks"].Array();
+        for (std::vector<mongo::BSONElement>::iterator iter = seedbanks.begin(); iter != seedbanks.end(); ++iter) {
+            seedbank_ids.push_back(iter->Int());
+        }
+    }
 }
 
 } // namespace terasaur
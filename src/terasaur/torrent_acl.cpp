@@ -15,10 +15,20 @@
  * limitations under the License.
  */
 
+extern "C" {
+#include <libowfat/ip6.h> // for scan_ip6
+}
+
 #include "terasaur/torrent_acl.hpp"
-#include "terasaur/date.hpp"
 #include "terasaur/log_util.hpp"
 #include "terasaur/torrentdb.hpp"
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/control_socket.hpp"
+#include "terasaur/db_breaker.hpp"
+#include <arpa/inet.h> /* for htons */
+#include <cstring>
 //#include <boost/thread/mutex.hpp>
 
 using mongo::BSONObj;
@@ -27,11 +37,89 @@ using std::endl;
 namespace terasaur {
 namespace torrent_acl {
 
+static bool _tuple_to_ot_peer(const string_int_tuple& ip_port, ot_peer* peer) {
+    bool success = false;
+    memset(peer, 0, sizeof(ot_peer));
+    ot_ip6 tmp_addr;
+    memset(tmp_addr, 0, sizeof(ot_ip6));
+
+    string ip_addr = boost::tuples::get<0>(ip_port);
+    uint16 tmp_port = htons(boost::tuples::get<1>(ip_port));
+
+    if (scan_ip6(ip_addr.c_str(), tmp_addr)) {
+        OT_SETIP(peer, tmp_addr);
+        OT_SETPORT(peer, &tmp_port);
+        OT_PEERFLAG(peer) = 0;
+        OT_PEERFLAG(peer) |= PEER_FLAG_SEEDING;
+        //OT_PEERFLAG(peer) |= PEER_FLAG_COMPLETED;
+        OT_PEERTIME(peer) = 0;
+        success = true;
+    } else {
+        log_util::error() << "torrent_acl::_tuple_to_ot_peer: invalid seedbank address (" << ip_addr << ")" << endl;
+        success = false;
+    }
+    return success;
+}
+
+/**
+ * Convert seedbank addresses to peers once, so announces only copy them.
+ */
+static torrent_cache::seedbank_list_ptr _to_seedbank_list(std::vector<string_int_tuple> const& sb_list) {
+    torrent_cache::seedbank_list_t* seedbanks = new torrent_cache::seedbank_list_t();
+    seedbanks->reserve(sb_list.size());
+
+    ot_peer tmp_peer;
+    std::vector<string_int_tuple>::const_iterator iter;
+    for (iter = sb_list.begin(); iter != sb_list.end(); ++iter) {
+        if (_tuple_to_ot_peer(*iter, &tmp_peer)) {
+            seedbanks->push_back(tmp_peer);
+        }
+    }
+    return torrent_cache::seedbank_list_ptr(seedbanks);
+}
+
 bool hashisvalid(sha1_hash const& info_hash) {
 #ifdef _DEBUG
     log_util::debug() << "torrent_acl::hashisvalid (" << info_hash << ")" << endl;
 #endif
 
+    // Unregistered info hashes stop here without any lookup.  The control
+    // socket adds new torrents to the filter as they are registered; without
+    // it a miss may be a torrent added since the last index refresh, so it
+    // goes on to the cache and the breaker guarded database lookup, and a
+    // negative answer is cached like any other.
+    bool const filter_hit = torrent_filter::may_contain(info_hash);
+    if (!filter_hit && control_socket::is_open()) {
+#ifdef _DEBUG
+        log_util::debug() << "torrent_acl::hashisvalid: rejected by torrent filter" << endl;
+#endif
+        return false;
+    }
+
+    torrent_cache::cache_entry_t entry;
+    if (torrent_cache::get(info_hash, entry)) {
+#ifdef _DEBUG
+        log_util::debug() << "torrent_acl::hashisvalid: cache hit (found: " << entry.found << ")" << endl;
+#endif
+        if (!entry.found && filter_hit) {
+            torrent_filter::record_false_positive();
+        }
+        return entry.found && _is_published(entry.published);
+    }
+
+    torrent_index::index_entry_t index_entry;
+    if (torrent_index::lookup(info_hash, index_entry)) {
+#ifdef _DEBUG
+        log_util::debug() << "torrent_acl::hashisvalid: found in torrent index" << endl;
+#endif
+        if (torrent_cache::enabled()) {
+            torrent_cache::put_found(info_hash, index_entry.published,
+                                     _to_seedbank_list(torrentdb::get_seedbanks_for_ids(index_entry.seedbank_ids)));
+        }
+        return _is_published(index_entry.published);
+    }
+
+    // Not in the index (not loaded yet, or added since the last refresh)
     BSONObj torrent_record;
     bool is_valid = false;
     try {
@@ -43,22 +131,39 @@ bool hashisvalid(sha1_hash const& info_hash) {
         log_util::debug() << "torrent_acl::hashisvalid: checking info hash match" << endl;
 #endif
 
-        if (info_hash == torrent->info_hash) {
+        if (!torrent) {
+            // Lookup failed rather than came back empty, so don't remember
+            // anything and go by whatever we knew last
+            if (!db_breaker::is_open()) {
+                log_util::error() << "(hashisvalid): torrent lookup failed (" << info_hash << ")" << endl;
+            }
+            if (torrent_cache::get_stale(info_hash, entry)) {
+                is_valid = entry.found && _is_published(entry.published);
+            }
+        } else if (info_hash == torrent->info_hash) {
 #ifdef _DEBUG
             log_util::debug() << "torrent_acl::hashisvalid: checking published date" << endl;
 #endif
-            is_valid = torrent->is_published();
+            torrent_index::insert(*torrent);
+            if (torrent_cache::enabled()) {
+                torrent_cache::put_found(info_hash, torrent->published,
+                                         _to_seedbank_list(torrentdb::get_seedbanks_for_ids(torrent->seedbank_ids)));
+            }
+            is_valid = _is_published(torrent->published);
 #ifdef _DEBUG
             if (!is_valid) {
                 log_util::debug() << "Access denied for torrent -- published date is in the future" << endl;
             }
 #endif
-        }
+        } else {
 #ifdef _DEBUG
-        else {
             log_util::debug() << "torrent_acl::hashisvalid: info_hash != torrent->info_hash" << endl;
-        }
 #endif
+            if (filter_hit) {
+                torrent_filter::record_false_positive();
+            }
+            torrent_cache::put_not_found(info_hash);
+        }
 
     } catch (mongo::DBException &e) {
         log_util::error() << "(hashisvalid): mongodb exception: " << e.what() << endl;
@@ -69,5 +174,26 @@ bool hashisvalid(sha1_hash const& info_hash) {
     return is_valid;
 }
 
+/**
+ * Seedbank peers for a torrent, from the torrent index or straight from the
+ * database.  Used when the torrent cache is disabled.
+ */
+torrent_cache::seedbank_list_ptr look_up_seedbanks(sha1_hash const& info_hash) {
+    torrent_index::index_entry_t index_entry;
+    if (torrent_index::lookup(info_hash, index_entry)) {
+        return _to_seedbank_list(torrentdb::get_seedbanks_for_ids(index_entry.seedbank_ids));
+    }
+    return _to_seedbank_list(torrentdb::get_seedbanks(info_hash));
+}
+
+/**
+ * Returns true if the published time is not in the future.  Uses the
+ * tracker's once per loop clock, so an embargoed torrent costs one integer
+ * compare per announce until it is published.
+ */
+bool _is_published(time_t published) {
+    return published <= g_now_seconds;
+}
+
 } // namespace torrent_acl
 } // namespace terasaur
@@ -0,0 +1,263 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/hash_util.hpp"
+#include <list>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+
+extern "C" {
+#include "trackerlogic.h" // for g_now_seconds, OT_PEER_COMPARE_SIZE
+}
+
+using std::endl;
+
+namespace terasaur {
+namespace torrent_cache {
+
+/**
+ * The cache is split into independently locked stripes so that UDP workers
+ * validating different torrents rarely wait on each other.  Each stripe
+ * keeps its entries in insertion order to pick eviction victims cheaply.
+ */
+#define TORRENT_CACHE_STRIPES 64
+
+typedef std::list<sha1_hash> order_list_t;
+
+struct cache_node_t {
+    cache_entry_t entry;
+    order_list_t::iterator order;
+};
+
+typedef boost::unordered_map<sha1_hash, cache_node_t, sha1_hash_hasher> cache_map_t;
+
+struct cache_stripe_t {
+    boost::mutex mutex;
+    cache_map_t entries;
+    order_list_t order;
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long misses;
+    unsigned long long expirations;
+    unsigned long long evictions;
+    unsigned long long stale_hits;
+    cache_stripe_t() : hits(0), negative_hits(0), misses(0), expirations(0), evictions(0), stale_hits(0) {}
+};
+
+static cache_stripe_t _stripes[TORRENT_CACHE_STRIPES];
+static std::size_t _max_entries_per_stripe = 0;
+static time_t _positive_ttl = 0;
+static time_t _negative_ttl = 0;
+
+static cache_stripe_t& _get_stripe(sha1_hash const& info_hash) {
+    return _stripes[info_hash[19] % TORRENT_CACHE_STRIPES];
+}
+
+static void _erase(cache_stripe_t& stripe, cache_map_t::iterator iter) {
+    stripe.order.erase(iter->second.order);
+    stripe.entries.erase(iter);
+}
+
+/**
+ * FNV-1a over the seedbank peers.  Identical lists get identical versions no
+ * matter how often the entry is refreshed from the database.
+ */
+static uint32_t _seedbank_version(seedbank_list_t const& seedbanks) {
+    uint32_t hash = 2166136261u;
+    seedbank_list_t::const_iterator iter;
+    for (iter = seedbanks.begin(); iter != seedbanks.end(); ++iter) {
+        for (std::size_t i = 0; i < OT_PEER_COMPARE_SIZE; ++i) {
+            hash = (hash ^ iter->data[i]) * 16777619u;
+        }
+    }
+    return hash ? hash : 1;
+}
+
+static void _put(sha1_hash const& info_hash, cache_entry_t const& entry) {
+    if (_max_entries_per_stripe == 0) {
+        return;
+    }
+
+    cache_stripe_t& stripe = _get_stripe(info_hash);
+    boost::mutex::scoped_lock lock(stripe.mutex);
+
+    cache_map_t::iterator iter = stripe.entries.find(info_hash);
+    if (iter != stripe.entries.end()) {
+        _erase(stripe, iter);
+    } else if (stripe.entries.size() >= _max_entries_per_stripe) {
+        iter = stripe.entries.find(stripe.order.front());
+        _erase(stripe, iter);
+        ++stripe.evictions;
+    }
+
+    cache_node_t node;
+    node.entry = entry;
+    node.order = stripe.order.insert(stripe.order.end(), info_hash);
+    stripe.entries[info_hash] = node;
+}
+
+/**
+ * Size the cache and set the time to live for found and not found entries,
+ * in seconds.  A max_entries of 0 disables caching altogether.
+ */
+void init(std::size_t max_entries, time_t positive_ttl, time_t negative_ttl) {
+    _max_entries_per_stripe = (max_entries + TORRENT_CACHE_STRIPES - 1) / TORRENT_CACHE_STRIPES;
+    _positive_ttl = positive_ttl;
+    _negative_ttl = negative_ttl;
+#ifdef _DEBUG
+    log_util::debug() << "torrent_cache::init: max entries " << max_entries << ", positive ttl "
+                      << positive_ttl << ", negative ttl " << negative_ttl << endl;
+#endif
+}
+
+bool enabled() {
+    return _max_entries_per_stripe > 0;
+}
+
+/**
+ * Returns true and fills in entry if a live cache entry exists for the given
+ * info hash.  Expired entries are reported as a miss, but stay around for
+ * get_stale() until they are replaced or evicted.
+ */
+bool get(sha1_hash const& info_hash, cache_entry_t& entry) {
+    cache_stripe_t& stripe = _get_stripe(info_hash);
+    boost::mutex::scoped_lock lock(stripe.mutex);
+
+    cache_map_t::iterator iter = stripe.entries.find(info_hash);
+    if (iter == stripe.entries.end()) {
+        ++stripe.misses;
+        return false;
+    }
+
+    if (iter->second.entry.expires <= g_now_seconds) {
+        ++stripe.expirations;
+        ++stripe.misses;
+        return false;
+    }
+
+    entry = iter->second.entry;
+    if (entry.found) {
+        ++stripe.hits;
+    } else {
+        ++stripe.negative_hits;
+    }
+    return true;
+}
+
+/**
+ * Like get(), but for callers that already went through get() for this
+ * request.  Does not count towards the hit and miss stats and leaves expired
+ * entries alone.
+ */
+bool peek(sha1_hash const& info_hash, cache_entry_t& entry) {
+    cache_stripe_t& stripe = _get_stripe(info_hash);
+    boost::mutex::scoped_lock lock(stripe.mutex);
+
+    cache_map_t::const_iterator iter = stripe.entries.find(info_hash);
+    if (iter == stripe.entries.end()) {
+        return false;
+    }
+    entry = iter->second.entry;
+    return true;
+}
+
+/**
+ * Last known answer for an info hash, expired or not.  For use when the
+ * torrent database cannot be asked.
+ */
+bool get_stale(sha1_hash const& info_hash, cache_entry_t& entry) {
+    cache_stripe_t& stripe = _get_stripe(info_hash);
+    boost::mutex::scoped_lock lock(stripe.mutex);
+
+    cache_map_t::const_iterator iter = stripe.entries.find(info_hash);
+    if (iter == stripe.entries.end()) {
+        return false;
+    }
+    entry = iter->second.entry;
+    ++stripe.stale_hits;
+    return true;
+}
+
+void put_found(sha1_hash const& info_hash, time_t published, seedbank_list_ptr const& seedbanks) {
+    cache_entry_t entry;
+    entry.found = true;
+    entry.published = published;
+    entry.expires = g_now_seconds + _positive_ttl;
+    if (seedbanks && !seedbanks->empty()) {
+        entry.seedbanks = seedbanks;
+        entry.seedbank_version = _seedbank_version(*seedbanks);
+    }
+    _put(info_hash, entry);
+}
+
+void put_not_found(sha1_hash const& info_hash) {
+    cache_entry_t entry;
+    entry.expires = g_now_seconds + _negative_ttl;
+    _put(info_hash, entry);
+}
+
+void invalidate(sha1_hash const& info_hash) {
+    cache_stripe_t& stripe = _get_stripe(info_hash);
+    boost::mutex::scoped_lock lock(stripe.mutex);
+
+    cache_map_t::iterator iter = stripe.entries.find(info_hash);
+    if (iter != stripe.entries.end()) {
+        _erase(stripe, iter);
+    }
+}
+
+/**
+ * Drop every entry, e.g. after a seedbank address changed.
+ */
+void clear() {
+    for (int i = 0; i < TORRENT_CACHE_STRIPES; ++i) {
+        cache_stripe_t& stripe = _stripes[i];
+        boost::mutex::scoped_lock lock(stripe.mutex);
+        stripe.entries.clear();
+        stripe.order.clear();
+    }
+}
+
+void write_stats(std::ostream& out) {
+    unsigned long long entries = 0, hits = 0, negative_hits = 0, misses = 0, expirations = 0, evictions = 0, stale_hits = 0;
+
+    for (int i = 0; i < TORRENT_CACHE_STRIPES; ++i) {
+        cache_stripe_t& stripe = _stripes[i];
+        boost::mutex::scoped_lock lock(stripe.mutex);
+        entries += stripe.entries.size();
+        hits += stripe.hits;
+        negative_hits += stripe.negative_hits;
+        misses += stripe.misses;
+        expirations += stripe.expirations;
+        evictions += stripe.evictions;
+        stale_hits += stripe.stale_hits;
+    }
+
+    out << "torrent_cache.entries: " << entries << "\n";
+    out << "torrent_cache.capacity: " << _max_entries_per_stripe * TORRENT_CACHE_STRIPES << "\n";
+    out << "torrent_cache.hits: " << hits << "\n";
+    out << "torrent_cache.negative_hits: " << negative_hits << "\n";
+    out << "torrent_cache.misses: " << misses << "\n";
+    out << "torrent_cache.expirations: " << expirations << "\n";
+    out << "torrent_cache.evictions: " << evictions << "\n";
+    out << "torrent_cache.stale_hits: " << stale_hits << "\n";
+}
+
+} // namespace torrent_cache
+} // namespace terasaur
@@ -0,0 +1,303 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/thread_util.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/date.hpp"
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+using std::endl;
+
+namespace terasaur {
+namespace torrent_filter {
+
+// Room left for torrents added between rebuilds, as a fraction of the index size
+#define TORRENT_FILTER_HEADROOM 0.25
+#define TORRENT_FILTER_MIN_CAPACITY 1024
+
+struct bloom_t {
+    std::vector<uint64_t> words;
+    uint64_t bits;
+    unsigned int hash_count;
+    unsigned long long capacity;
+    unsigned long long entries;
+};
+
+typedef boost::shared_ptr<bloom_t> bloom_ptr;
+
+static double _bits_per_entry = 0;
+
+// Guards the _filter and _building pointers, not the bits themselves.  Bits
+// are only ever set, with atomic ors, so they can be read without a lock.
+static boost::shared_mutex _mutex;
+static bloom_ptr _filter;
+static bloom_ptr _building;
+
+static boost::mutex _rebuild_mutex;
+static boost::condition_variable _rebuild_needed;
+static bool _rebuild_pending = false;
+static boost::scoped_ptr<boost::thread> _rebuilder;
+
+// counters, updated with atomic adds
+static unsigned long long _checks = 0;
+static unsigned long long _rejects = 0;
+static unsigned long long _false_positives = 0;
+static unsigned long long _rebuilds = 0;
+static unsigned long long _last_rebuild_ms = 0;
+
+/**
+ * Double hashing over two independent 64-bit slices of the info hash, which
+ * is already uniformly distributed.
+ */
+static void _hashes(sha1_hash const& info_hash, uint64_t& h1, uint64_t& h2) {
+    std::memcpy(&h1, info_hash.begin() + 4, sizeof(h1));
+    std::memcpy(&h2, info_hash.begin() + 12, sizeof(h2));
+    h2 |= 1;
+}
+
+static void _set(bloom_t& bloom, sha1_hash const& info_hash) {
+    uint64_t h1, h2;
+    _hashes(info_hash, h1, h2);
+    for (unsigned int i = 0; i < bloom.hash_count; ++i) {
+        uint64_t const bit = (h1 + i * h2) % bloom.bits;
+        __sync_fetch_and_or(&bloom.words[bit >> 6], (uint64_t)1 << (bit & 63));
+    }
+    __sync_fetch_and_add(&bloom.entries, 1);
+}
+
+static bool _test(bloom_t const& bloom, sha1_hash const& info_hash) {
+    uint64_t h1, h2;
+    _hashes(info_hash, h1, h2);
+    for (unsigned int i = 0; i < bloom.hash_count; ++i) {
+        uint64_t const bit = (h1 + i * h2) % bloom.bits;
+        if (!(bloom.words[bit >> 6] & ((uint64_t)1 << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bloom_ptr _create(std::size_t expected_entries) {
+    bloom_ptr bloom(new bloom_t());
+    bloom->capacity = (unsigned long long)(expected_entries * (1 + TORRENT_FILTER_HEADROOM));
+    if (bloom->capacity < TORRENT_FILTER_MIN_CAPACITY) {
+        bloom->capacity = TORRENT_FILTER_MIN_CAPACITY;
+    }
+    bloom->words.resize((std::size_t)(bloom->capacity * _bits_per_entry / 64) + 1, 0);
+    bloom->bits = bloom->words.size() * 64;
+    // k = (m / n) ln 2 minimizes the false positive rate
+    bloom->hash_count = (unsigned int)(_bits_per_entry * std::log(2.0) + 0.5);
+    if (bloom->hash_count < 1) {
+        bloom->hash_count = 1;
+    }
+    bloom->entries = 0;
+    return bloom;
+}
+
+class filter_builder : public torrent_index::hash_visitor {
+public:
+    filter_builder(bloom_t& bloom) : _bloom(bloom) {}
+    void visit(sha1_hash const& info_hash) {
+        _set(_bloom, info_hash);
+    }
+private:
+    bloom_t& _bloom;
+};
+
+/**
+ * Set the filter size in bits per expected torrent.  10 bits gives roughly
+ * a 1% false positive rate.  0 disables the filter.
+ */
+void init(double bits_per_entry) {
+    _bits_per_entry = bits_per_entry > 0 ? bits_per_entry : 0;
+}
+
+/**
+ * Build a new filter from the torrent index and swap it in.  Announces keep
+ * using the old filter meanwhile; torrents added during the build go into
+ * both.  Does nothing until the index has been loaded.
+ */
+bool rebuild() {
+    {
+        boost::mutex::scoped_lock lock(_rebuild_mutex);
+        _rebuild_pending = false;
+    }
+    if (_bits_per_entry <= 0 || !torrent_index::is_loaded()) {
+        return false;
+    }
+
+    boost::posix_time::ptime const start = date::get_now_utc();
+    bloom_ptr bloom = _create(torrent_index::size());
+    {
+        boost::unique_lock<boost::shared_mutex> lock(_mutex);
+        _building = bloom;
+    }
+
+    filter_builder builder(*bloom);
+    torrent_index::for_each_hash(builder);
+
+    {
+        boost::unique_lock<boost::shared_mutex> lock(_mutex);
+        _filter = bloom;
+        _building.reset();
+    }
+
+    unsigned long long const elapsed_ms = (date::get_now_utc() - start).total_milliseconds();
+    __sync_fetch_and_add(&_rebuilds, 1);
+    __sync_lock_test_and_set(&_last_rebuild_ms, elapsed_ms);
+#ifdef _DEBUG
+    log_util::debug() << "torrent_filter::rebuild: " << bloom->entries << " torrents, " << bloom->bits << " bits, "
+                      << bloom->hash_count << " hashes, " << elapsed_ms << " ms" << endl;
+#endif
+    return true;
+}
+
+/**
+ * Ask the background thread for a rebuild.  Cheap and safe to call from any
+ * thread, including ones holding the index lock.
+ */
+void request_rebuild() {
+    boost::mutex::scoped_lock lock(_rebuild_mutex);
+    _rebuild_pending = true;
+    _rebuild_needed.notify_one();
+}
+
+static void _rebuilder_loop() {
+    try {
+        while (true) {
+            {
+                boost::mutex::scoped_lock lock(_rebuild_mutex);
+                while (!_rebuild_pending) {
+                    _rebuild_needed.wait(lock);
+                }
+            }
+            rebuild();
+        }
+    } catch (boost::thread_interrupted const&) {
+#ifdef _DEBUG
+        log_util::debug() << "torrent_filter::_rebuilder_loop: interrupted" << endl;
+#endif
+    }
+}
+
+void start_rebuilder() {
+    if (_rebuilder || _bits_per_entry <= 0) {
+        return;
+    }
+    _rebuilder.reset(thread_util::create_thread(_rebuilder_loop));
+}
+
+void stop_rebuilder() {
+    if (!_rebuilder) {
+        return;
+    }
+    _rebuilder->interrupt();
+    if (_rebuilder->timed_join(boost::posix_time::seconds(5))) {
+        _rebuilder.reset();
+    } else {
+        log_util::error() << "torrent_filter: timed out waiting for rebuilder to stop" << endl;
+    }
+}
+
+/**
+ * False means the info hash is definitely not a registered torrent.
+ */
+bool may_contain(sha1_hash const& info_hash) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    if (!_filter) {
+        return true;
+    }
+    __sync_fetch_and_add(&_checks, 1);
+    if (_test(*_filter, info_hash)) {
+        return true;
+    }
+    __sync_fetch_and_add(&_rejects, 1);
+    return false;
+}
+
+void add(sha1_hash const& info_hash) {
+    bool full = false;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        if (_filter) {
+            _set(*_filter, info_hash);
+            full = _filter->entries > _filter->capacity;
+        }
+        if (_building) {
+            _set(*_building, info_hash);
+        }
+    }
+    if (full) {
+        request_rebuild();
+    }
+}
+
+/**
+ * Called when an info hash that passed the filter turned out to be unknown.
+ */
+void record_false_positive() {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    if (_filter) {
+        __sync_fetch_and_add(&_false_positives, 1);
+    }
+}
+
+void write_stats(std::ostream& out) {
+    unsigned long long entries = 0, capacity = 0, bits = 0;
+    unsigned int hash_count = 0;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        if (_filter) {
+            entries = __sync_fetch_and_add(&_filter->entries, 0);
+            capacity = _filter->capacity;
+            bits = _filter->bits;
+            hash_count = _filter->hash_count;
+        }
+    }
+
+    unsigned long long const rejects = __sync_fetch_and_add(&_rejects, 0);
+    unsigned long long const false_positives = __sync_fetch_and_add(&_false_positives, 0);
+    unsigned long long const unknown = rejects + false_positives;
+
+    out << "torrent_filter.active: " << (bits > 0) << "\n";
+    out << "torrent_filter.entries: " << entries << "\n";
+    out << "torrent_filter.capacity: " << capacity << "\n";
+    out << "torrent_filter.bits: " << bits << "\n";
+    out << "torrent_filter.hash_count: " << hash_count << "\n";
+    out << "torrent_filter.checks: " << __sync_fetch_and_add(&_checks, 0) << "\n";
+    out << "torrent_filter.rejects: " << rejects << "\n";
+    out << "torrent_filter.false_positives: " << false_positives << "\n";
+    // Share of unknown info hashes that got past the filter
+    out << "torrent_filter.false_positive_rate: " << (unknown ? (double)false_positives / unknown : 0.0) << "\n";
+    out << "torrent_filter.rebuilds: " << __sync_fetch_and_add(&_rebuilds, 0) << "\n";
+    out << "torrent_filter.last_rebuild_ms: " << __sync_fetch_and_add(&_last_rebuild_ms, 0) << "\n";
+}
+
+} // namespace torrent_filter
+} // namespace terasaur
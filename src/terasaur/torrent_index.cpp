@@ -0,0 +1,308 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/torrentdb.hpp"
+#include "terasaur/hash_util.hpp"
+#include "terasaur/thread_util.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/date.hpp"
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+extern "C" {
+#include "trackerlogic.h" // for g_now_seconds
+}
+
+using std::endl;
+
+namespace terasaur {
+namespace torrent_index {
+
+typedef boost::unordered_map<sha1_hash, index_entry_t, sha1_hash_hasher> index_map_t;
+
+static boost::shared_mutex _mutex;
+static index_map_t _index;
+static bool _loaded = false;
+
+// Only used by load() and the refresher thread, never concurrently
+static mongo::Date_t _max_updated;
+static boost::scoped_ptr<boost::thread> _refresher;
+
+// lookup counters, updated with atomic adds under the shared lock
+static unsigned long long _hits = 0;
+static unsigned long long _misses = 0;
+
+// load and refresh counters, protected by _stats_mutex
+static boost::mutex _stats_mutex;
+static unsigned long long _full_loads = 0;
+static unsigned long long _last_load_ms = 0;
+static unsigned long long _refreshes = 0;
+static unsigned long long _failed_refreshes = 0;
+static unsigned long long _refreshed_records = 0;
+static unsigned long long _changed_records = 0;
+
+static void _to_entry(terasaur::torrent const& torrent, index_entry_t& entry) {
+    entry.published = torrent.published;
+    entry.seedbank_ids = torrent.seedbank_ids;
+}
+
+/**
+ * Add or replace the entry for a torrent.  Returns true if the torrent was
+ * new or its authorization fields changed.
+ */
+static bool _insert(terasaur::torrent const& torrent) {
+    index_entry_t entry;
+    _to_entry(torrent, entry);
+
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    index_map_t::iterator iter = _index.find(torrent.info_hash);
+    if (iter == _index.end()) {
+        _index[torrent.info_hash] = entry;
+        torrent_filter::add(torrent.info_hash);
+        return true;
+    }
+    if (iter->second.published == entry.published && iter->second.seedbank_ids == entry.seedbank_ids) {
+        return false;
+    }
+    iter->second = entry;
+    return true;
+}
+
+/**
+ * Fills a fresh map during a full load, without taking the index lock.
+ */
+class map_loader : public torrentdb::torrent_visitor {
+public:
+    map_loader(index_map_t& index) : _index(index) {}
+    void visit(terasaur::torrent const& torrent) {
+        _to_entry(torrent, _index[torrent.info_hash]);
+    }
+private:
+    index_map_t& _index;
+};
+
+/**
+ * Applies incremental changes to the live index.  Cached authorization
+ * results for changed torrents are dropped so they are rebuilt from here.
+ */
+class refresh_applier : public torrentdb::torrent_visitor {
+public:
+    refresh_applier() : records(0), changed(0) {}
+    void visit(terasaur::torrent const& torrent) {
+        ++records;
+        if (_insert(torrent)) {
+            ++changed;
+            torrent_cache::invalidate(torrent.info_hash);
+        }
+    }
+    unsigned long long records;
+    unsigned long long changed;
+};
+
+/**
+ * Stream the seedbank and torrent collections into memory and replace the
+ * index with the result.  Called once at startup, before any announce is
+ * served, and then periodically by the refresher.
+ */
+bool load() {
+    ptime const start = date::get_now_utc();
+    mongo::Date_t const start_mongo = date::get_now_mongo();
+
+    if (!torrentdb::load_seedbanks()) {
+        log_util::error() << "torrent_index::load: loading seedbanks failed" << endl;
+        return false;
+    }
+
+    index_map_t loaded;
+    mongo::Date_t max_updated;
+    map_loader loader(loaded);
+    if (!torrentdb::scan_torrents(mongo::Date_t(), loader, max_updated)) {
+        log_util::error() << "torrent_index::load: loading torrents failed" << endl;
+        return false;
+    }
+
+    // No record has been updated yet, so refresh from the time this load started
+    _max_updated = max_updated.millis > 0 ? max_updated : start_mongo;
+
+    std::size_t const entries = loaded.size();
+    {
+        boost::unique_lock<boost::shared_mutex> lock(_mutex);
+        _index.swap(loaded);
+        _loaded = true;
+    }
+
+    unsigned long long const elapsed_ms = (date::get_now_utc() - start).total_milliseconds();
+    {
+        boost::mutex::scoped_lock lock(_stats_mutex);
+        ++_full_loads;
+        _last_load_ms = elapsed_ms;
+    }
+    log_util::debug() << "Loaded " << entries << " torrents into the torrent index in " << elapsed_ms << " ms" << endl;
+
+    // Deleted torrents only leave the filter when it is rebuilt
+    torrent_filter::request_rebuild();
+    return true;
+}
+
+bool is_loaded() {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    return _loaded;
+}
+
+std::size_t size() {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    return _index.size();
+}
+
+/**
+ * Call visitor for every info hash, holding the index read lock throughout.
+ * Inserts wait until the walk is done.
+ */
+void for_each_hash(hash_visitor& visitor) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    index_map_t::const_iterator iter;
+    for (iter = _index.begin(); iter != _index.end(); ++iter) {
+        visitor.visit(iter->first);
+    }
+}
+
+bool lookup(sha1_hash const& info_hash, index_entry_t& entry) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    index_map_t::const_iterator iter = _index.find(info_hash);
+    if (iter == _index.end()) {
+        __sync_fetch_and_add(&_misses, 1);
+        return false;
+    }
+    entry = iter->second;
+    __sync_fetch_and_add(&_hits, 1);
+    return true;
+}
+
+/**
+ * Add a torrent found by a direct database lookup.  Ignored until the index
+ * has been loaded, since the index is not consulted before then.
+ */
+void insert(terasaur::torrent const& torrent) {
+    if (is_loaded()) {
+        _insert(torrent);
+    }
+}
+
+/**
+ * Drop a torrent that was deleted from the database.  It stays in the
+ * torrent filter until the next rebuild.
+ */
+void remove(sha1_hash const& info_hash) {
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    _index.erase(info_hash);
+}
+
+static void _refresh() {
+    refresh_applier applier;
+    mongo::Date_t const since = _max_updated;
+    bool const success = torrentdb::scan_torrents(since, applier, _max_updated);
+
+    boost::mutex::scoped_lock lock(_stats_mutex);
+    ++_refreshes;
+    if (!success) {
+        ++_failed_refreshes;
+    }
+    _refreshed_records += applier.records;
+    _changed_records += applier.changed;
+}
+
+static void _refresher_loop(time_t refresh_interval, time_t full_reload_interval) {
+#ifdef _DEBUG
+    log_util::debug() << "torrent_index::_refresher_loop: start" << endl;
+#endif
+    time_t last_full_load = g_now_seconds;
+    try {
+        while (true) {
+            boost::this_thread::sleep(boost::posix_time::seconds(refresh_interval));
+
+            // A full reload also drops torrents deleted from the collection.
+            // Also retry here if the load at startup failed.
+            if (!is_loaded() || (full_reload_interval > 0 && g_now_seconds - last_full_load >= full_reload_interval)) {
+                load();
+                last_full_load = g_now_seconds;
+            } else {
+                _refresh();
+            }
+        }
+    } catch (boost::thread_interrupted const&) {
+#ifdef _DEBUG
+        log_util::debug() << "torrent_index::_refresher_loop: interrupted" << endl;
+#endif
+    }
+}
+
+/**
+ * Pull changed records every refresh_interval seconds and reload everything
+ * every full_reload_interval seconds (0 to never reload).
+ */
+void start_refresher(time_t refresh_interval, time_t full_reload_interval) {
+    if (_refresher || refresh_interval <= 0) {
+        return;
+    }
+    _refresher.reset(thread_util::create_thread(boost::bind(_refresher_loop, refresh_interval, full_reload_interval)));
+}
+
+void stop_refresher() {
+    if (!_refresher) {
+        return;
+    }
+    _refresher->interrupt();
+    if (_refresher->timed_join(boost::posix_time::seconds(5))) {
+        _refresher.reset();
+    } else {
+        log_util::error() << "torrent_index: timed out waiting for refresher to stop" << endl;
+    }
+}
+
+void write_stats(std::ostream& out) {
+    std::size_t entries;
+    bool loaded;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        entries = _index.size();
+        loaded = _loaded;
+    }
+
+    out << "torrent_index.loaded: " << loaded << "\n";
+    out << "torrent_index.entries: " << entries << "\n";
+    out << "torrent_index.hits: " << __sync_fetch_and_add(&_hits, 0) << "\n";
+    out << "torrent_index.misses: " << __sync_fetch_and_add(&_misses, 0) << "\n";
+
+    boost::mutex::scoped_lock lock(_stats_mutex);
+    out << "torrent_index.full_loads: " << _full_loads << "\n";
+    out << "torrent_index.last_load_ms: " << _last_load_ms << "\n";
+    out << "torrent_index.refreshes: " << _refreshes << "\n";
+    out << "torrent_index.failed_refreshes: " << _failed_refreshes << "\n";
+    out << "torrent_index.refreshed_records: " << _refreshed_records << "\n";
+    out << "torrent_index.changed_records: " << _changed_records << "\n";
+}
+
+} // namespace torrent_index
+} // namespace terasaur
@@ -0,0 +1,79 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Torrent stats snapshots taken under the bucket lock by the announce and
+ * clean paths.  Kept apart from ts_export.cpp so the unit tests can link it
+ * without the database layer.
+ */
+
+extern "C" {
+#include "trackerlogic.h" // for ot_torrent, ot_peerlist
+}
+
+#include <cstring>
+#include "terasaur/stats_writer.hpp"
+#include "terasaur/ts_export.h"
+#ifdef _DEBUG
+#include "terasaur/peer_util.h"
+#include "terasaur/log_util.hpp"
+#endif
+
+using namespace terasaur;
+
+/**
+ * Returns 1 if the counts of a torrent differ from what was last published
+ * for it and the stats writer's minimum interval has passed since.
+ */
+extern "C" int ts_torrent_stats_due(ot_peerlist const* peer_list) {
+    bool const counts_changed = peer_list->published_seed_count != (uint32_t)peer_list->seed_count
+                                || peer_list->published_peer_count != (uint32_t)peer_list->peer_count;
+    return counts_changed && g_now_seconds - peer_list->stats_published >= stats_writer::min_interval();
+}
+
+/**
+ * Copy the counts of a torrent for ts_update_torrent_stats.  Called under the
+ * bucket lock.
+ *
+ * Only marked as changed if ts_torrent_stats_due says so.  A completed
+ * download is always published so the increment is not lost.  Counts held
+ * back here go out with a later announce or clean run.
+ */
+extern "C" void ts_snapshot_torrent_stats(ot_torrent* torrent, int increment_completed, ts_torrent_stats* stats) {
+    ot_peerlist* peer_list = torrent->peer_list;
+
+    memcpy(stats->hash, torrent->hash, sizeof(ot_hash));
+    stats->seed_count = peer_list->seed_count;
+    stats->peer_count = peer_list->peer_count;
+    stats->increment_completed = increment_completed;
+
+    if (increment_completed || ts_torrent_stats_due(peer_list)) {
+        peer_list->published_seed_count = peer_list->seed_count;
+        peer_list->published_peer_count = peer_list->peer_count;
+        peer_list->stats_published = g_now_seconds;
+        stats->changed = 1;
+    } else {
+        stats->changed = 0;
+        stats_writer::count_suppressed();
+    }
+
+/* TODO: need to reenable this */
+#ifdef _DEBUG
+    log_util::debug() << "torrent_stats::ts_snapshot_torrent_stats: peer list" << std::endl;
+    print_peers_peerlist((ot_peerlist*)peer_list);
+#endif
+}
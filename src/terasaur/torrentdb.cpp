@@ -16,20 +16,16 @@
  */
 
 #include "terasaur/torrentdb.hpp"
+#include "terasaur/torrentdb_backend.hpp"
 #include "terasaur/string_map.hpp"
 #include "terasaur/log_util.hpp"
-#include "terasaur/date.hpp"
-#include <vector>
+#include "terasaur/db_breaker.hpp"
+#include <boost/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 using std::endl;
-typedef std::map<int, string_int_tuple> seedbank_map_t;
-
-using boost::scoped_ptr;
-using mongo::ScopedDbConnection;
-using mongo::DBClientBase;
-using mongo::DBClientCursor;
-using mongo::BSONObj;
-using mongo::BSONElement;
+using boost::posix_time::microsec_clock;
+using boost::posix_time::ptime;
 
 namespace terasaur {
 namespace torrentdb {
@@ -39,285 +35,128 @@ void set_param(string key, string val) {
     _param_map[key] = val;
 }
 
-seedbank_map_t _seedbank_map;
+// Set once by init_conn() during startup, before any other thread exists
+static boost::scoped_ptr<backend> _backend;
 
 /**
- * Perform initial connection and other tasks for startup sequence.
+ * Create the backend named by the "backend" param (mongodb if unset) and
+ * perform initial connection and other tasks for startup sequence.
  */
 bool init_conn() {
-    bool okay = false;
-    try {
-        scoped_ptr<ScopedDbConnection> scoped_conn(ScopedDbConnection::getScopedDbConnection(_param_map["connection_string"]));
-        DBClientBase* conn = scoped_conn->get();
-        conn->ensureIndex(_param_map["torrentdb_ns"], mongo::fromjson("{info_hash:1}"), true);
-        if (conn->getLastError().empty()) {
-            okay = true;
-        } else {
-            log_util::error() << conn->getLastError() << endl;
-        }
-        scoped_conn->done();
-    } catch (mongo::DBException &e) {
-        log_util::error() << "mongodb connection failed: " << e.what() << endl;
+    string const name = _param_map["backend"];
+    if (name.empty() || name == "mongodb") {
+        _backend.reset(create_mongo_backend(_param_map));
+    } else if (name == "local") {
+        _backend.reset(create_local_backend(_param_map));
+    } else {
+        log_util::error() << "torrentdb: unknown backend (" << name << ")" << endl;
+        return false;
     }
-    return okay;
+    return _backend->init_conn();
 }
 
 /**
- * Update the database with the given seed and peer counts.  If increment_completed is true,
- * also increment the completed downloads counter.  Data structure:
- *
- *  info_hash:
- *     seeds: <int>
- *     peers: <int>
- *     completed: <int>
- *     updated: <datetime>
+ * Report how a call went to the circuit breaker.
  */
-void update_stats(stats_update_t const& params) {
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::update_stats: start" << endl;
-#endif
-
-    scoped_ptr<ScopedDbConnection> scoped_conn(ScopedDbConnection::getScopedDbConnection(_param_map["connection_string"]));
-    try {
-        _execute_update_stats(scoped_conn, params);
-    } catch (mongo::UserException &e) {
-        log_util::error() << "(update_stats): bson exception: " << e.what() << endl;
-    } catch (mongo::DBException &e) {
-        log_util::error() << "(update_stats): mongodb exception: " << e.what() << endl;
-    } catch (std::exception& e) {
-        log_util::error() << "(update_stats): mongodb query failed: " << e.what() << endl;
-    }
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::update_stats: calling scoped_conn.done()" << endl;
-#endif
-    scoped_conn->done();
-
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::update_stats: returning" << endl;
-#endif
+static bool _call_done(bool success, ptime const& start) {
+    db_breaker::record(success, (microsec_clock::universal_time() - start).total_milliseconds());
+    return success;
 }
 
-void _execute_update_stats(scoped_ptr<ScopedDbConnection> const& scoped_conn, stats_update_t const& params) {
-    char ih_hex[41];
-    to_hex((char const*)&params.info_hash[0], sha1_hash::size, ih_hex);
-
-    DBClientBase* conn = scoped_conn->get();
-    if (conn->isFailed()) {
-        log_util::error() << "mongodb connection failed trying to update stats (torrent: " << ih_hex << ", inc_completed: " << params.increment_completed << ")" << endl;
-    } else {
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_execute_update_stats: Running mongodb update query (" << ih_hex << ")" << endl;
-#endif
-
-        mongo::Date_t now = terasaur::date::get_now_mongo();
-        mongo::Query query = QUERY("info_hash" << ih_hex);
-        BSONObj update_bson;
-
-        if (params.increment_completed) {
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_execute_update_stats: increment completed true" << endl;
-#endif
-            update_bson = BSON("$set" << BSON("seeds" << params.seeds << "peers" << params.peers << "updated" << now)
-                               << "$inc" << BSON( "completed" << 1));
-        } else {
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_execute_update_stats: increment completed false" << endl;
-#endif
-            update_bson = BSON("$set" << BSON("seeds" << params.seeds << "peers" << params.peers << "updated" << now));
-        }
-
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_execute_update_stats: query: " << query << endl;
-        log_util::debug() << "torrentdb::_execute_update_stats: update bson: " << update_bson << endl;
-        log_util::debug() << "torrentdb::_execute_update_stats: calling mongodb update()" << endl;
-#endif
-        conn->update(_param_map["torrentdb_ns"], query, update_bson);
-
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_execute_update_stats: calling mongodb getLastError()" << endl;
-#endif
-        string err = conn->getLastError();
-        bool success = err.empty();
-        if (success == false) {
-            log_util::error() << "torrentdb::_execute_update_stats: mongodb update returned error (" << err << ")" << endl;
-        }
-#ifdef _DEBUG
-        else {
-            log_util::debug() << "torrentdb::_execute_update_stats: mongodb update successful" << endl;
-        }
-#endif
+/**
+ * Stream torrent records to visitor.  Only the fields needed for announce
+ * authorization are fetched.  If updated_since is non-zero, only records
+ * updated at or after that time are returned.  max_updated is raised to the
+ * newest updated time seen.  Returns false if the scan did not complete.
+ */
+bool scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated) {
+    if (!db_breaker::allow()) {
+        return false;
     }
-
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::_execute_update_stats: returning" << endl;
-#endif
+    ptime const start = microsec_clock::universal_time();
+    return _call_done(_backend->scan_torrents(updated_since, visitor, max_updated), start);
 }
 
-boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash)
-{
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::look_up_info_hash: start (" << info_hash << ")" << endl;
-#endif
-    terasaur::torrent* torrent = NULL;
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::look_up_info_hash: getting scoped_conn" << endl;
-#endif
-    scoped_ptr<ScopedDbConnection> scoped_conn(ScopedDbConnection::getScopedDbConnection(_param_map["connection_string"]));
-
-    try {
-        BSONObj torrent_record = _look_up_info_hash(scoped_conn, info_hash);
-        torrent = new terasaur::torrent(torrent_record);
-    } catch (mongo::UserException &e) {
-        log_util::error() << "torrentdb::look_up_info_hash: bson exception: " << e.what() << endl;
-    } catch (mongo::DBException &e) {
-        log_util::error() << "torrentdb::look_up_info_hash: mongodb exception: " << e.what() << endl;
-    } catch (std::exception& e) {
-        log_util::error() << "torrentdb::look_up_info_hash: mongodb query failed: " << e.what() << endl;
+/**
+ * Load all seedbanks into the backend's seedbank id cache, so that resolving
+ * seedbanks for preloaded torrents needs no further queries.
+ */
+bool load_seedbanks() {
+    if (!db_breaker::allow()) {
+        return false;
     }
-
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::look_up_info_hash: calling scoped_conn->done()" << endl;
-#endif
-    scoped_conn->done();
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::look_up_info_hash: returning (" << info_hash << ")" << endl;
-#endif
-    return boost::shared_ptr<terasaur::torrent>(torrent);
+    ptime const start = microsec_clock::universal_time();
+    return _call_done(_backend->load_seedbanks(), start);
 }
 
-BSONObj _look_up_info_hash(scoped_ptr<ScopedDbConnection> const& scoped_conn, sha1_hash const& info_hash)
-{
-    BSONObj torrent_record;
-    char ih_hex[41];
-    to_hex((char const*)&info_hash[0], sha1_hash::size, ih_hex);
-
-    DBClientBase* conn = scoped_conn->get();
-    if (conn->isFailed()) {
-        log_util::error() << "torrentdb::_look_up_info_hash: mongodb connection failed" << endl;
-    } else {
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_look_up_info_hash: running mongodb query (" << ih_hex << ")" << endl;
-#endif
-        std::auto_ptr<DBClientCursor> cursor = conn->query(_param_map["torrentdb_ns"], QUERY("info_hash" << ih_hex));
-        bool found_results = false;
-
-        //if (conn->getLastError().empty()) {
-            while (cursor->more()) {
-                // TODO: verify no more than one record returned?
-                torrent_record = cursor->next();
-                found_results = true;
-            }
-        //}
-#ifdef _DEBUG
-        if (!found_results) {
-            log_util::debug() << "torrentdb::_look_up_info_hash: torrent not found" << endl;
-        }
-#endif
+/**
+ * Returns NULL if the lookup failed.  A torrent that does not exist comes
+ * back with an info hash that does not match the one asked for.  Also
+ * returns NULL straight away while the circuit breaker is open.
+ */
+boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash) {
+    if (!db_breaker::allow()) {
+        return boost::shared_ptr<terasaur::torrent>();
     }
-    return torrent_record;
+    ptime const start = microsec_clock::universal_time();
+    boost::shared_ptr<terasaur::torrent> torrent = _backend->look_up_info_hash(info_hash);
+    _call_done(torrent.get() != NULL, start);
+    return torrent;
 }
 
-// TODO: should this return list<tuple> instead?
 std::vector<string_int_tuple> get_seedbanks(sha1_hash const& info_hash) {
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::get_seedbanks: start (" << info_hash << ")" << endl;
-#endif
-
-    std::vector<string_int_tuple> sb_list;
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::get_seedbanks: getting scoped_conn" << info_hash << endl;
-#endif
-    scoped_ptr<ScopedDbConnection> scoped_conn(ScopedDbConnection::getScopedDbConnection(_param_map["connection_string"]));
-
-    try {
-        sb_list = _get_seedbanks(scoped_conn, info_hash);
-    } catch (mongo::UserException &e) {
-        log_util::error() << "torrentdb::get_seedbanks: bson exception: " << e.what() << endl;
-    } catch (mongo::DBException &e) {
-        log_util::error() << "torrentdb::get_seedbanks: mongodb exception: " << e.what() << endl;
-    } catch (std::exception& e) {
-        log_util::error() << "torrentdb::get_seedbanks: mongodb query failed: " << e.what() << endl;
+    if (!db_breaker::allow()) {
+        return std::vector<string_int_tuple>();
     }
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::get_seedbanks: calling scoped_conn->done()" << endl;
-#endif
-    scoped_conn->done();
-    return sb_list;
+    return _backend->get_seedbanks(info_hash);
 }
 
-std::vector<string_int_tuple> _get_seedbanks(scoped_ptr<ScopedDbConnection> const& scoped_conn, sha1_hash const& info_hash) {
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::_get_seedbanks: start (scoped_conn, " << info_hash << ")" << endl;
-#endif
+/**
+ * Resolve seedbank ids, as found in a torrent record, to ip address and port.
+ * Ids in the backend's seedbank cache are always answered; the rest are
+ * looked up only while the circuit breaker allows.  Ids without a seedbank
+ * record are left out.
+ */
+std::vector<string_int_tuple> get_seedbanks_for_ids(std::vector<int> const& seedbank_ids) {
     std::vector<string_int_tuple> sb_list;
-    BSONObj torrent_record;
-    int seedbank_id;
-    string_int_tuple ip_port;
-
-    torrent_record = _look_up_info_hash(scoped_conn, info_hash);
-    if (torrent_record["info_hash"].ok() && torrent_record["seedbanks"].ok() && !torrent_record["seedbanks"].isNull()) {
-        std::vector<BSONElement> seedbanks = torrent_record["seedbanks"].Array();
-        for (std::vector<BSONElement>::iterator iter = seedbanks.begin() ; iter != seedbanks.end(); ++iter) {
-            seedbank_id = ((BSONElement)(*iter)).Int();
-            ip_port = _get_seedbank_for_id(scoped_conn, seedbank_id);
-        }
-        sb_list.push_back(ip_port);
+    std::vector<int> missing;
+    _backend->find_seedbanks(seedbank_ids, sb_list, missing);
+    if (missing.empty() || !db_breaker::allow()) {
+        return sb_list;
     }
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::_get_seedbanks: returning" << endl;
-#endif
+    ptime const start = microsec_clock::universal_time();
+    _call_done(_backend->look_up_seedbanks(missing, sb_list), start);
     return sb_list;
 }
 
-string_int_tuple _get_seedbank_for_id(scoped_ptr<ScopedDbConnection> const& scoped_conn, int seedbank_id) {
-#ifdef _DEBUG
-    log_util::debug() << "torrentdb::_get_seedbank_for_id: start (" << seedbank_id << ")" << endl;
-#endif
-
-    string_int_tuple ip_port;
-    seedbank_map_t::iterator iter;
-    iter = _seedbank_map.find(seedbank_id);
-
-    if (iter == _seedbank_map.end()) {
-        BSONObj sb_record = _look_up_seedbank(scoped_conn, seedbank_id);
-        ip_port = boost::tuples::make_tuple(sb_record["ip_address"].String(), (uint16)sb_record["ip_port"].Int());
-        _seedbank_map[seedbank_id] = ip_port;
-
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_get_seedbank_for_id: found mongodb record for seedbank (" << sb_record["ip_address"].String() << ":" << (uint16)sb_record["ip_port"].Int() << ")" << endl;
-#endif
-    } else {
-        ip_port = iter->second;
+/**
+ * Write a batch of stats updates.  Returns false if any of them may not have
+ * been applied, including when the circuit breaker is open.
+ */
+bool update_stats_batch(std::vector<stats_update_t> const& batch) {
+    if (!db_breaker::allow()) {
+        return false;
     }
-    return ip_port;
+    ptime const start = microsec_clock::universal_time();
+    return _call_done(_backend->update_stats_batch(batch), start);
 }
 
-BSONObj _look_up_seedbank(scoped_ptr<ScopedDbConnection> const& scoped_conn, int seedbank_id)
-{
-    BSONObj sb_record;
-    DBClientBase* conn = scoped_conn->get();
-    if (conn->isFailed()) {
-        log_util::error() << "torrentdb::_look_up_seedbank: mongodb connection failed" << endl;
-    } else {
-#ifdef _DEBUG
-        log_util::debug() << "torrentdb::_look_up_seedbank: running mongodb query (" << seedbank_id << ")" << endl;
-#endif
-        std::auto_ptr<DBClientCursor> cursor = conn->query(_param_map["seedbankdb_ns"], QUERY("seedbank_id" << seedbank_id));
-        bool found_results = false;
+/**
+ * Tell the backend about a seedbank that was added or changed elsewhere, so
+ * it does not have to be looked up.  Never touches the database.
+ */
+void set_seedbank(int seedbank_id, string_int_tuple const& ip_port) {
+    _backend->set_seedbank(seedbank_id, ip_port);
+}
 
-        //if (conn->getLastError().empty()) {
-            while (cursor->more()) {
-                // TODO: verify no more than one record returned?
-                sb_record = cursor->next();
-                found_results = true;
-            }
-        //}
-        if (!found_results) {
-            log_util::error() << "torrentdb::_look_up_seedbank: mongodb result not found" << endl;
-        }
-    }
+void remove_seedbank(int seedbank_id) {
+    _backend->remove_seedbank(seedbank_id);
+}
 
-    return sb_record;
+void write_stats(std::ostream& out) {
+    if (_backend) {
+        _backend->write_stats(out);
+    }
 }
 
 } // namespace torrentdb
@@ -0,0 +1,359 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/torrentdb_backend.hpp"
+#include "terasaur/hash_util.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/date.hpp"
+#include "libtorrent/escape_string.hpp" // from_hex
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+using std::endl;
+
+namespace terasaur {
+namespace torrentdb {
+
+struct local_record_t {
+    terasaur::torrent torrent;
+    uint32_t seeds;
+    uint32_t peers;
+    unsigned long long completed;
+    unsigned long long updated; // millis, same meaning as the mongodb field
+    local_record_t() : torrent(), seeds(0), peers(0), completed(0), updated(0) {}
+};
+
+typedef boost::unordered_map<sha1_hash, local_record_t, sha1_hash_hasher> local_map_t;
+typedef std::map<int, string_int_tuple> local_seedbank_map_t;
+
+/**
+ * Torrents and seedbanks read from a flat file into memory at startup, for
+ * running the tracker without a MongoDB server.  Stats updates are applied in
+ * memory only and are lost on restart.
+ *
+ * Every call sleeps for latency_us first, so that a remote database can be
+ * stood in for when measuring how the tracker copes with slow lookups.
+ *
+ * File format, one record per line, '#' starts a comment:
+ *
+ *   torrent <info_hash hex> <published unix time> [seedbank_id,seedbank_id,...]
+ *   seedbank <seedbank_id> <ip address> <port>
+ */
+class local_backend : public backend {
+public:
+    local_backend(string_map const& params);
+    bool init_conn();
+    bool scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated);
+    bool load_seedbanks();
+    boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash);
+    std::vector<string_int_tuple> get_seedbanks(sha1_hash const& info_hash);
+    void find_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& found, std::vector<int>& missing);
+    bool look_up_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& sb_list);
+    bool update_stats_batch(std::vector<stats_update_t> const& batch);
+    void set_seedbank(int seedbank_id, string_int_tuple const& ip_port);
+    void remove_seedbank(int seedbank_id);
+    void write_stats(std::ostream& out);
+
+private:
+    void _delay();
+    bool _parse_line(string const& line, local_map_t& torrents, local_seedbank_map_t& seedbanks);
+    void _apply_update(stats_update_t const& params, unsigned long long now);
+    std::vector<string_int_tuple> _resolve_seedbanks(std::vector<int> const& seedbank_ids);
+
+    string _path;
+    long _latency_us;
+
+    boost::shared_mutex _mutex;
+    local_map_t _torrents;
+    local_seedbank_map_t _seedbanks;
+
+    // counters, updated with atomic builtins
+    unsigned long long _lookups;
+    unsigned long long _updates;
+};
+
+backend* create_local_backend(string_map const& params) {
+    return new local_backend(params);
+}
+
+local_backend::local_backend(string_map const& params)
+    : _latency_us(0),
+      _lookups(0),
+      _updates(0) {
+    string_map_iter iter;
+    if ((iter = params.find("local_path")) != params.end()) {
+        _path = iter->second;
+    }
+    if ((iter = params.find("local_latency_us")) != params.end() && !iter->second.empty()) {
+        try {
+            _latency_us = boost::lexical_cast<long>(iter->second);
+        } catch (boost::bad_lexical_cast const&) {
+            log_util::error() << "torrentdb: invalid local_latency_us (" << iter->second << ")" << endl;
+        }
+    }
+}
+
+void local_backend::_delay() {
+    if (_latency_us > 0) {
+        boost::this_thread::sleep(boost::posix_time::microseconds(_latency_us));
+    }
+}
+
+bool local_backend::_parse_line(string const& line, local_map_t& torrents, local_seedbank_map_t& seedbanks) {
+    std::istringstream in(line);
+    string type;
+    if (!(in >> type) || type[0] == '#') {
+        return true;
+    }
+
+    if (type == "torrent") {
+        string ih_hex, ids;
+        time_t published;
+        if (!(in >> ih_hex >> published) || ih_hex.size() != 40) {
+            return false;
+        }
+        local_record_t record;
+        if (!libtorrent::from_hex(ih_hex.c_str(), 40, (char*)&record.torrent.info_hash[0])) {
+            return false;
+        }
+        record.torrent.published = published;
+        if (in >> ids) {
+            std::istringstream id_in(ids);
+            string id;
+            while (std::getline(id_in, id, ',')) {
+                record.torrent.seedbank_ids.push_back(boost::lexical_cast<int>(id));
+            }
+        }
+        record.updated = date::get_now_mongo().millis;
+        torrents[record.torrent.info_hash] = record;
+        return true;
+    }
+
+    if (type == "seedbank") {
+        int seedbank_id;
+        string ip_address;
+        uint16 ip_port;
+        if (!(in >> seedbank_id >> ip_address >> ip_port)) {
+            return false;
+        }
+        seedbanks[seedbank_id] = boost::tuples::make_tuple(ip_address, ip_port);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Read the whole file.  Nothing is replaced unless the file could be read.
+ */
+bool local_backend::init_conn() {
+    std::ifstream in(_path.c_str());
+    if (!in) {
+        log_util::error() << "torrentdb: unable to open local torrent file (" << _path << ")" << endl;
+        return false;
+    }
+
+    local_map_t torrents;
+    local_seedbank_map_t seedbanks;
+    string line;
+    unsigned long long line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        bool parsed;
+        try {
+            parsed = _parse_line(line, torrents, seedbanks);
+        } catch (boost::bad_lexical_cast const&) {
+            parsed = false;
+        }
+        if (!parsed) {
+            log_util::error() << "torrentdb: malformed line " << line_number << " in " << _path << endl;
+        }
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    _torrents.swap(torrents);
+    _seedbanks.swap(seedbanks);
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb: loaded " << _torrents.size() << " torrents, " << _seedbanks.size()
+                      << " seedbanks from " << _path << endl;
+#endif
+    return true;
+}
+
+bool local_backend::scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated) {
+    _delay();
+
+    // Copy out first so the visitor runs without our lock held
+    std::vector<terasaur::torrent> matched;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        if (updated_since.millis == 0) {
+            matched.reserve(_torrents.size());
+        }
+        local_map_t::const_iterator iter;
+        for (iter = _torrents.begin(); iter != _torrents.end(); ++iter) {
+            if (iter->second.updated >= updated_since.millis) {
+                matched.push_back(iter->second.torrent);
+                if (iter->second.updated > max_updated.millis) {
+                    max_updated.millis = iter->second.updated;
+                }
+            }
+        }
+    }
+
+    std::vector<terasaur::torrent>::const_iterator iter;
+    for (iter = matched.begin(); iter != matched.end(); ++iter) {
+        visitor.visit(*iter);
+    }
+    return true;
+}
+
+/**
+ * Seedbanks are already in memory once the file is loaded.
+ */
+bool local_backend::load_seedbanks() {
+    return true;
+}
+
+boost::shared_ptr<terasaur::torrent> local_backend::look_up_info_hash(sha1_hash const& info_hash) {
+    _delay();
+    __sync_fetch_and_add(&_lookups, 1);
+
+    boost::shared_ptr<terasaur::torrent> torrent(new terasaur::torrent());
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    local_map_t::const_iterator iter = _torrents.find(info_hash);
+    if (iter != _torrents.end()) {
+        *torrent = iter->second.torrent;
+    }
+    return torrent;
+}
+
+std::vector<string_int_tuple> local_backend::_resolve_seedbanks(std::vector<int> const& seedbank_ids) {
+    std::vector<string_int_tuple> sb_list;
+    std::vector<int>::const_iterator iter;
+    for (iter = seedbank_ids.begin(); iter != seedbank_ids.end(); ++iter) {
+        local_seedbank_map_t::const_iterator sb_iter = _seedbanks.find(*iter);
+        if (sb_iter != _seedbanks.end()) {
+            sb_list.push_back(sb_iter->second);
+        } else {
+            log_util::error() << "torrentdb: unknown seedbank id (" << *iter << ")" << endl;
+        }
+    }
+    return sb_list;
+}
+
+std::vector<string_int_tuple> local_backend::get_seedbanks(sha1_hash const& info_hash) {
+    _delay();
+    __sync_fetch_and_add(&_lookups, 1);
+
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    local_map_t::const_iterator iter = _torrents.find(info_hash);
+    if (iter == _torrents.end()) {
+        return std::vector<string_int_tuple>();
+    }
+    return _resolve_seedbanks(iter->second.torrent.seedbank_ids);
+}
+
+/**
+ * Like the mongodb backend's seedbank cache, this never waits.  Unknown ids
+ * are left for look_up_seedbanks, as cache misses would be.
+ */
+void local_backend::find_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& found, std::vector<int>& missing) {
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    std::vector<int>::const_iterator iter;
+    for (iter = seedbank_ids.begin(); iter != seedbank_ids.end(); ++iter) {
+        local_seedbank_map_t::const_iterator sb_iter = _seedbanks.find(*iter);
+        if (sb_iter != _seedbanks.end()) {
+            found.push_back(sb_iter->second);
+        } else {
+            missing.push_back(*iter);
+        }
+    }
+}
+
+bool local_backend::look_up_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& sb_list) {
+    _delay();
+    __sync_fetch_and_add(&_lookups, 1);
+
+    boost::shared_lock<boost::shared_mutex> lock(_mutex);
+    std::vector<string_int_tuple> const resolved = _resolve_seedbanks(seedbank_ids);
+    sb_list.insert(sb_list.end(), resolved.begin(), resolved.end());
+    return true;
+}
+
+/**
+ * Caller must hold _mutex exclusively.  Unknown info hashes are ignored, as
+ * the mongodb update does not upsert.
+ */
+void local_backend::_apply_update(stats_update_t const& params, unsigned long long now) {
+    local_map_t::iterator iter = _torrents.find(params.info_hash);
+    if (iter == _torrents.end()) {
+        return;
+    }
+    iter->second.seeds = params.seeds;
+    iter->second.peers = params.peers;
+    iter->second.completed += params.completed;
+    iter->second.updated = now;
+}
+
+/**
+ * One delay per batch, the same as one round trip for the mongodb backend.
+ */
+bool local_backend::update_stats_batch(std::vector<stats_update_t> const& batch) {
+    _delay();
+    __sync_fetch_and_add(&_updates, batch.size());
+
+    unsigned long long const now = date::get_now_mongo().millis;
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    std::vector<stats_update_t>::const_iterator iter;
+    for (iter = batch.begin(); iter != batch.end(); ++iter) {
+        _apply_update(*iter, now);
+    }
+    return true;
+}
+
+void local_backend::set_seedbank(int seedbank_id, string_int_tuple const& ip_port) {
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    _seedbanks[seedbank_id] = ip_port;
+}
+
+void local_backend::remove_seedbank(int seedbank_id) {
+    boost::unique_lock<boost::shared_mutex> lock(_mutex);
+    _seedbanks.erase(seedbank_id);
+}
+
+void local_backend::write_stats(std::ostream& out) {
+    std::size_t torrents, seedbanks;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        torrents = _torrents.size();
+        seedbanks = _seedbanks.size();
+    }
+    out << "torrentdb_local.torrents: " << torrents << "\n";
+    out << "torrentdb_local.seedbanks: " << seedbanks << "\n";
+    out << "torrentdb_local.latency_us: " << _latency_us << "\n";
+    out << "torrentdb_local.lookups: " << __sync_fetch_and_add(&_lookups, 0) << "\n";
+    out << "torrentdb_local.updates: " << __sync_fetch_and_add(&_updates, 0) << "\n";
+}
+
+} // namespace torrentdb
+} // namespace terasaur
@@ -0,0 +1,580 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "terasaur/torrentdb_backend.hpp"
+#include "terasaur/log_util.hpp"
+#include "terasaur/date.hpp"
+#include "terasaur/db_conn.hpp"
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+using std::endl;
+typedef std::map<int, string_int_tuple> seedbank_map_t;
+
+using mongo::DBClientBase;
+using mongo::DBClientCursor;
+using mongo::BSONObj;
+using mongo::BSONElement;
+
+namespace terasaur {
+namespace torrentdb {
+
+/**
+ * Torrent and seedbank collections in MongoDB.  Connections are per thread,
+ * see db_conn.
+ */
+class mongo_backend : public backend {
+public:
+    mongo_backend(string_map const& params);
+    bool init_conn();
+    bool scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated);
+    bool load_seedbanks();
+    boost::shared_ptr<terasaur::torrent> look_up_info_hash(sha1_hash const& info_hash);
+    std::vector<string_int_tuple> get_seedbanks(sha1_hash const& info_hash);
+    void find_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& found, std::vector<int>& missing);
+    bool look_up_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& sb_list);
+    bool update_stats_batch(std::vector<stats_update_t> const& batch);
+    void set_seedbank(int seedbank_id, string_int_tuple const& ip_port);
+    void remove_seedbank(int seedbank_id);
+    void write_stats(std::ostream& out);
+
+private:
+    BSONObj _look_up_info_hash(db_conn::scoped_conn& scoped_conn, sha1_hash const& info_hash);
+    std::vector<string_int_tuple> _get_seedbanks(db_conn::scoped_conn& scoped_conn, sha1_hash const& info_hash);
+    bool _find_seedbank(int seedbank_id, string_int_tuple& ip_port);
+    bool _get_seedbank_for_id(db_conn::scoped_conn& scoped_conn, int seedbank_id, string_int_tuple& ip_port);
+    BSONObj _look_up_seedbank(db_conn::scoped_conn& scoped_conn, int seedbank_id);
+    void _send_update_stats(DBClientBase* conn, stats_update_t const& params);
+
+    string _connection_string;
+    string _torrentdb_ns;
+    string _seedbankdb_ns;
+
+    // Seedbank id to address cache, shared by all UDP workers
+    seedbank_map_t _seedbank_map;
+    boost::mutex _seedbank_map_mutex;
+};
+
+backend* create_mongo_backend(string_map const& params) {
+    return new mongo_backend(params);
+}
+
+mongo_backend::mongo_backend(string_map const& params) {
+    // Resolve these once rather than on every query
+    string_map_iter iter;
+    if ((iter = params.find("connection_string")) != params.end()) {
+        _connection_string = iter->second;
+    }
+    if ((iter = params.find("torrentdb_ns")) != params.end()) {
+        _torrentdb_ns = iter->second;
+    }
+    if ((iter = params.find("seedbankdb_ns")) != params.end()) {
+        _seedbankdb_ns = iter->second;
+    }
+}
+
+/**
+ * Perform initial connection and other tasks for startup sequence.
+ */
+bool mongo_backend::init_conn() {
+    db_conn::init(_connection_string);
+
+    bool okay = false;
+    db_conn::scoped_conn scoped_conn;
+    try {
+        DBClientBase* conn = scoped_conn.get();
+        if (conn->isFailed()) {
+            log_util::error() << "mongodb connection failed" << endl;
+        } else {
+            conn->ensureIndex(_torrentdb_ns, mongo::fromjson("{info_hash:1}"), true);
+            // Used by the torrent index refresher
+            conn->ensureIndex(_torrentdb_ns, mongo::fromjson("{updated:1}"));
+            if (conn->getLastError().empty()) {
+                okay = true;
+            } else {
+                scoped_conn.error();
+                log_util::error() << conn->getLastError() << endl;
+            }
+        }
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "mongodb connection failed: " << e.what() << endl;
+    }
+    scoped_conn.done();
+    return okay;
+}
+
+/**
+ * Stream torrent records to visitor.  Only the fields needed for announce
+ * authorization are fetched.  If updated_since is non-zero, only records
+ * updated at or after that time are returned.  max_updated is raised to the
+ * newest updated time seen.  Returns false if the scan did not complete.
+ */
+bool mongo_backend::scan_torrents(mongo::Date_t const& updated_since, torrent_visitor& visitor, mongo::Date_t& max_updated) {
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::scan_torrents: start (" << updated_since.millis << ")" << endl;
+#endif
+    bool success = false;
+    unsigned long long count = 0, skipped = 0;
+    BSONObj const fields = BSON("info_hash" << 1 << "published" << 1 << "seedbanks" << 1 << "updated" << 1);
+    mongo::Query query;
+    if (updated_since.millis > 0) {
+        // $gte so records written in the same millisecond as the last scan are not missed
+        query = QUERY("updated" << BSON("$gte" << updated_since));
+    }
+
+    db_conn::scoped_conn scoped_conn;
+    try {
+        DBClientBase* conn = scoped_conn.get();
+        if (conn->isFailed()) {
+            log_util::error() << "torrentdb::scan_torrents: mongodb connection failed" << endl;
+        } else {
+            std::auto_ptr<DBClientCursor> cursor = conn->query(_torrentdb_ns, query, 0, 0, &fields,
+                                                               mongo::QueryOption_NoCursorTimeout);
+            while (cursor->more()) {
+                BSONObj torrent_record = cursor->next();
+                try {
+                    terasaur::torrent const torrent(torrent_record);
+                    visitor.visit(torrent);
+                    ++count;
+                    if (torrent_record["updated"].ok() && !torrent_record["updated"].isNull()) {
+                        mongo::Date_t const updated = torrent_record["updated"].Date();
+                        if (updated.millis > max_updated.millis) {
+                            max_updated = updated;
+                        }
+                    }
+                } catch (mongo::DBException &e) {
+                    // Malformed record, keep going with the rest
+                    ++skipped;
+                }
+            }
+            success = true;
+        }
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::scan_torrents: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::scan_torrents: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::scan_torrents: mongodb query failed: " << e.what() << endl;
+    }
+    scoped_conn.done();
+
+    if (skipped > 0) {
+        log_util::error() << "torrentdb::scan_torrents: skipped " << skipped << " malformed torrent records" << endl;
+    }
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::scan_torrents: returning (" << success << ", " << count << " records)" << endl;
+#endif
+    return success;
+}
+
+/**
+ * Load the whole seedbank collection into the seedbank id cache, so that
+ * resolving seedbanks for preloaded torrents needs no further queries.
+ */
+bool mongo_backend::load_seedbanks() {
+    bool success = false;
+    seedbank_map_t loaded;
+
+    db_conn::scoped_conn scoped_conn;
+    try {
+        DBClientBase* conn = scoped_conn.get();
+        if (conn->isFailed()) {
+            log_util::error() << "torrentdb::load_seedbanks: mongodb connection failed" << endl;
+        } else {
+            BSONObj const fields = BSON("seedbank_id" << 1 << "ip_address" << 1 << "ip_port" << 1);
+            std::auto_ptr<DBClientCursor> cursor = conn->query(_seedbankdb_ns, mongo::Query(), 0, 0, &fields);
+            while (cursor->more()) {
+                BSONObj sb_record = cursor->next();
+                loaded[sb_record["seedbank_id"].Int()] = boost::tuples::make_tuple(sb_record["ip_address"].String(), (uint16)sb_record["ip_port"].Int());
+            }
+            success = true;
+        }
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::load_seedbanks: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::load_seedbanks: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::load_seedbanks: mongodb query failed: " << e.what() << endl;
+    }
+    scoped_conn.done();
+
+    if (success) {
+        boost::mutex::scoped_lock lock(_seedbank_map_mutex);
+        _seedbank_map.swap(loaded);
+    }
+    return success;
+}
+
+/**
+ * Send a batch of stats updates over a single connection.  The updates are
+ * pipelined and checked with one getLastError call at the end of the batch.
+ * Returns false if the connection failed or the server reported an error.
+ */
+bool mongo_backend::update_stats_batch(std::vector<stats_update_t> const& batch) {
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::update_stats_batch: start (" << batch.size() << " updates)" << endl;
+#endif
+    bool success = false;
+
+    db_conn::scoped_conn scoped_conn;
+    try {
+        DBClientBase* conn = scoped_conn.get();
+        if (conn->isFailed()) {
+            log_util::error() << "torrentdb::update_stats_batch: mongodb connection failed (" << batch.size() << " updates)" << endl;
+        } else {
+            std::vector<stats_update_t>::const_iterator iter;
+            for (iter = batch.begin(); iter != batch.end(); ++iter) {
+                _send_update_stats(conn, *iter);
+            }
+
+            string err = conn->getLastError();
+            success = err.empty();
+            if (!success) {
+                scoped_conn.error();
+                log_util::error() << "torrentdb::update_stats_batch: mongodb update returned error (" << err << ")" << endl;
+            }
+        }
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::update_stats_batch: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::update_stats_batch: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::update_stats_batch: mongodb query failed: " << e.what() << endl;
+    }
+    scoped_conn.done();
+
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::update_stats_batch: returning (" << success << ")" << endl;
+#endif
+    return success;
+}
+
+/**
+ * Issue the update query for one torrent without waiting for the result.
+ * Sets the seed and peer counts; if completed is non-zero, also increments
+ * the completed downloads counter by that amount.  Data structure:
+ *
+ *  info_hash:
+ *     seeds: <int>
+ *     peers: <int>
+ *     completed: <int>
+ *     updated: <datetime>
+ */
+void mongo_backend::_send_update_stats(DBClientBase* conn, stats_update_t const& params) {
+    char ih_hex[41];
+    to_hex((char const*)&params.info_hash[0], sha1_hash::size, ih_hex);
+
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_send_update_stats: Running mongodb update query (" << ih_hex << ")" << endl;
+#endif
+
+    mongo::Date_t now = terasaur::date::get_now_mongo();
+    mongo::Query query = QUERY("info_hash" << ih_hex);
+    BSONObj update_bson;
+
+    if (params.completed > 0) {
+        update_bson = BSON("$set" << BSON("seeds" << params.seeds << "peers" << params.peers << "updated" << now)
+                           << "$inc" << BSON( "completed" << params.completed));
+    } else {
+        update_bson = BSON("$set" << BSON("seeds" << params.seeds << "peers" << params.peers << "updated" << now));
+    }
+
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_send_update_stats: query: " << query << endl;
+    log_util::debug() << "torrentdb::_send_update_stats: update bson: " << update_bson << endl;
+#endif
+    conn->update(_torrentdb_ns, query, update_bson);
+}
+
+boost::shared_ptr<terasaur::torrent> mongo_backend::look_up_info_hash(sha1_hash const& info_hash)
+{
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::look_up_info_hash: start (" << info_hash << ")" << endl;
+#endif
+    terasaur::torrent* torrent = NULL;
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::look_up_info_hash: getting scoped_conn" << endl;
+#endif
+    db_conn::scoped_conn scoped_conn;
+
+    try {
+        BSONObj torrent_record = _look_up_info_hash(scoped_conn, info_hash);
+        // A failed connection is a failed lookup, not a missing torrent
+        if (!scoped_conn.get()->isFailed()) {
+            torrent = new terasaur::torrent(torrent_record);
+        }
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_info_hash: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_info_hash: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_info_hash: mongodb query failed: " << e.what() << endl;
+    }
+
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::look_up_info_hash: calling scoped_conn.done()" << endl;
+#endif
+    scoped_conn.done();
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::look_up_info_hash: returning (" << info_hash << ")" << endl;
+#endif
+    return boost::shared_ptr<terasaur::torrent>(torrent);
+}
+
+BSONObj mongo_backend::_look_up_info_hash(db_conn::scoped_conn& scoped_conn, sha1_hash const& info_hash)
+{
+    BSONObj torrent_record;
+    char ih_hex[41];
+    to_hex((char const*)&info_hash[0], sha1_hash::size, ih_hex);
+
+    DBClientBase* conn = scoped_conn.get();
+    if (conn->isFailed()) {
+        log_util::error() << "torrentdb::_look_up_info_hash: mongodb connection failed" << endl;
+    } else {
+#ifdef _DEBUG
+        log_util::debug() << "torrentdb::_look_up_info_hash: running mongodb query (" << ih_hex << ")" << endl;
+#endif
+        std::auto_ptr<DBClientCursor> cursor = conn->query(_torrentdb_ns, QUERY("info_hash" << ih_hex));
+        bool found_results = false;
+
+        //if (conn->getLastError().empty()) {
+            while (cursor->more()) {
+                // TODO: verify no more than one record returned?
+                torrent_record = cursor->next();
+                found_results = true;
+            }
+        //}
+#ifdef _DEBUG
+        if (!found_results) {
+            log_util::debug() << "torrentdb::_look_up_info_hash: torrent not found" << endl;
+        }
+#endif
+    }
+    return torrent_record;
+}
+
+// TODO: should this return list<tuple> instead?
+std::vector<string_int_tuple> mongo_backend::get_seedbanks(sha1_hash const& info_hash) {
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::get_seedbanks: start (" << info_hash << ")" << endl;
+#endif
+
+    std::vector<string_int_tuple> sb_list;
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::get_seedbanks: getting scoped_conn" << info_hash << endl;
+#endif
+    db_conn::scoped_conn scoped_conn;
+
+    try {
+        sb_list = _get_seedbanks(scoped_conn, info_hash);
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::get_seedbanks: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::get_seedbanks: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::get_seedbanks: mongodb query failed: " << e.what() << endl;
+    }
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::get_seedbanks: calling scoped_conn.done()" << endl;
+#endif
+    scoped_conn.done();
+    return sb_list;
+}
+
+std::vector<string_int_tuple> mongo_backend::_get_seedbanks(db_conn::scoped_conn& scoped_conn, sha1_hash const& info_hash) {
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_get_seedbanks: start (scoped_conn, " << info_hash << ")" << endl;
+#endif
+    std::vector<string_int_tuple> sb_list;
+    BSONObj torrent_record;
+    int seedbank_id;
+    string_int_tuple ip_port;
+
+    torrent_record = _look_up_info_hash(scoped_conn, info_hash);
+    if (torrent_record["info_hash"].ok() && torrent_record["seedbanks"].ok() && !torrent_record["seedbanks"].isNull()) {
+        std::vector<BSONElement> seedbanks = torrent_record["seedbanks"].Array();
+        for (std::vector<BSONElement>::iterator iter = seedbanks.begin() ; iter != seedbanks.end(); ++iter) {
+            seedbank_id = ((BSONElement)(*iter)).Int();
+            if (_get_seedbank_for_id(scoped_conn, seedbank_id, ip_port)) {
+                sb_list.push_back(ip_port);
+            }
+        }
+    }
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_get_seedbanks: returning" << endl;
+#endif
+    return sb_list;
+}
+
+/**
+ * Resolve seedbank ids from the seedbank cache alone.  Ids not in the cache
+ * are added to missing.
+ */
+void mongo_backend::find_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& found, std::vector<int>& missing) {
+    std::vector<int>::const_iterator iter;
+    for (iter = seedbank_ids.begin(); iter != seedbank_ids.end(); ++iter) {
+        string_int_tuple ip_port;
+        if (_find_seedbank(*iter, ip_port)) {
+            found.push_back(ip_port);
+        } else {
+            missing.push_back(*iter);
+        }
+    }
+}
+
+/**
+ * Query the seedbank collection for each id and append the addresses found
+ * to sb_list.  Ids without a seedbank record are skipped.  Returns false if
+ * the connection failed or a query threw.
+ */
+bool mongo_backend::look_up_seedbanks(std::vector<int> const& seedbank_ids, std::vector<string_int_tuple>& sb_list) {
+    bool success = false;
+
+    db_conn::scoped_conn scoped_conn;
+    try {
+        if (scoped_conn.get()->isFailed()) {
+            log_util::error() << "torrentdb::look_up_seedbanks: mongodb connection failed (" << seedbank_ids.size() << " seedbanks)" << endl;
+        } else {
+            std::vector<int>::const_iterator iter;
+            for (iter = seedbank_ids.begin(); iter != seedbank_ids.end(); ++iter) {
+                string_int_tuple ip_port;
+                if (_get_seedbank_for_id(scoped_conn, *iter, ip_port)) {
+                    sb_list.push_back(ip_port);
+                }
+            }
+            success = true;
+        }
+    } catch (mongo::UserException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_seedbanks: bson exception: " << e.what() << endl;
+    } catch (mongo::DBException &e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_seedbanks: mongodb exception: " << e.what() << endl;
+    } catch (std::exception& e) {
+        scoped_conn.error();
+        log_util::error() << "torrentdb::look_up_seedbanks: mongodb query failed: " << e.what() << endl;
+    }
+    scoped_conn.done();
+    return success;
+}
+
+bool mongo_backend::_find_seedbank(int seedbank_id, string_int_tuple& ip_port) {
+    boost::mutex::scoped_lock lock(_seedbank_map_mutex);
+    seedbank_map_t::const_iterator iter = _seedbank_map.find(seedbank_id);
+    if (iter == _seedbank_map.end()) {
+        return false;
+    }
+    ip_port = iter->second;
+    return true;
+}
+
+/**
+ * Returns false if there is no seedbank record for the id, leaving ip_port
+ * untouched.
+ */
+bool mongo_backend::_get_seedbank_for_id(db_conn::scoped_conn& scoped_conn, int seedbank_id, string_int_tuple& ip_port) {
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_get_seedbank_for_id: start (" << seedbank_id << ")" << endl;
+#endif
+
+    if (_find_seedbank(seedbank_id, ip_port)) {
+        return true;
+    }
+
+    // Query without holding the lock; a concurrent lookup of the same id just
+    // stores the same value twice.
+    BSONObj sb_record = _look_up_seedbank(scoped_conn, seedbank_id);
+    if (!sb_record["ip_address"].ok() || !sb_record["ip_port"].ok()) {
+        return false;
+    }
+    ip_port = boost::tuples::make_tuple(sb_record["ip_address"].String(), (uint16)sb_record["ip_port"].Int());
+
+    {
+        boost::mutex::scoped_lock lock(_seedbank_map_mutex);
+        _seedbank_map[seedbank_id] = ip_port;
+    }
+
+#ifdef _DEBUG
+    log_util::debug() << "torrentdb::_get_seedbank_for_id: found mongodb record for seedbank (" << sb_record["ip_address"].String() << ":" << (uint16)sb_record["ip_port"].Int() << ")" << endl;
+#endif
+    return true;
+}
+
+BSONObj mongo_backend::_look_up_seedbank(db_conn::scoped_conn& scoped_conn, int seedbank_id)
+{
+    BSONObj sb_record;
+    DBClientBase* conn = scoped_conn.get();
+    if (conn->isFailed()) {
+        log_util::error() << "torrentdb::_look_up_seedbank: mongodb connection failed" << endl;
+    } else {
+#ifdef _DEBUG
+        log_util::debug() << "torrentdb::_look_up_seedbank: running mongodb query (" << seedbank_id << ")" << endl;
+#endif
+        std::auto_ptr<DBClientCursor> cursor = conn->query(_seedbankdb_ns, QUERY("seedbank_id" << seedbank_id));
+        bool found_results = false;
+
+        //if (conn->getLastError().empty()) {
+            while (cursor->more()) {
+                // TODO: verify no more than one record returned?
+                sb_record = cursor->next();
+                found_results = true;
+            }
+        //}
+        if (!found_results) {
+            log_util::error() << "torrentdb::_look_up_seedbank: mongodb result not found" << endl;
+        }
+    }
+
+    return sb_record;
+}
+
+/**
+ * Only the seedbank id cache is updated; the collection is written by the
+ * control plane.  A removed id is looked up again if a torrent still uses it.
+ */
+void mongo_backend::set_seedbank(int seedbank_id, string_int_tuple const& ip_port) {
+    boost::mutex::scoped_lock lock(_seedbank_map_mutex);
+    _seedbank_map[seedbank_id] = ip_port;
+}
+
+void mongo_backend::remove_seedbank(int seedbank_id) {
+    boost::mutex::scoped_lock lock(_seedbank_map_mutex);
+    _seedbank_map.erase(seedbank_id);
+}
+
+void mongo_backend::write_stats(std::ostream& out) {
+    db_conn::write_stats(out);
+}
+
+} // namespace torrentdb
+} // namespace terasaur
@@ -17,20 +17,28 @@
 
 extern "C" {
 #include "trackerlogic.h" // for ot_hash, ot_peerlist
-#include <libowfat/ip6.h> // for scan_ip6
 #include <libowfat/scan.h> // for scan_ushort
 #include <libowfat/socket.h> /* for uint16 */
 }
 
 #include <limits> /* for numeric_limits */
 #include "terasaur/peer_util.h"
-#include <arpa/inet.h> /* for htons */
 #include "terasaur/torrentdb.hpp"
 #include <boost/shared_ptr.hpp>
 #include "terasaur/converter.hpp"
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 #include "terasaur/log_util.hpp"
 #include "terasaur/torrent_acl.hpp"
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/stats_writer.hpp"
+#include "terasaur/stats_journal.hpp"
+#include "terasaur/db_breaker.hpp"
+#include "terasaur/control_socket.hpp"
+#include "terasaur/epoch.hpp"
+#include "terasaur/ts_export.h"
+#include <sstream>
 
 using libtorrent::sha1_hash;
 using std::endl;
@@ -51,77 +59,97 @@ extern "C" int ts_torrentdb_hashisvalid(ot_hash* hash) {
     return is_valid;
 }
 
-static bool _tuple_to_ot_peer(const string_int_tuple& ip_port, ot_peer* peer) {
-    bool success = false;
-    memset(peer, 0, sizeof(ot_peer));
-    ot_ip6 tmp_addr;
-    memset(tmp_addr, 0, sizeof(ot_ip6));
-
-    string ip_addr = boost::tuples::get<0>(ip_port);
-    uint16 tmp_port = htons(boost::tuples::get<1>(ip_port));
-
-    if (scan_ip6(ip_addr.c_str(), tmp_addr)) {
-        OT_SETIP(peer, tmp_addr);
-        OT_SETPORT(peer, &tmp_port);
-        OT_PEERFLAG(peer) = 0;
-        OT_PEERFLAG(peer) |= PEER_FLAG_SEEDING;
-        //OT_PEERFLAG(peer) |= PEER_FLAG_COMPLETED;
-        OT_PEERTIME(peer) = 0;
-        success = true;
-    } else {
-        success = false;
-    }
-    return success;
-}
-
-extern "C" void ts_torrentdb_add_seedbanks(ot_hash* hash, ot_peerlist *peer_list) {
+/**
+ * Authorize an announce and resolve the torrent's seedbanks.  Called before
+ * the bucket lock is taken, since either step may need the torrent database.
+ * The seedbank peers come from the torrent cache entry filled in by the
+ * hashisvalid lookup.
+ */
+extern "C" int ts_torrentdb_authorize(ot_hash* hash, ts_seedbank_list* seedbanks) {
     sha1_hash info_hash;
     ot_hash_to_sha1_hash(hash, info_hash);
 
+    seedbanks->version = 0;
+    seedbanks->count = 0;
+
+    if (!torrent_acl::hashisvalid(info_hash)) {
+        return 0;
+    }
+
+    torrent_cache::cache_entry_t entry;
+    if (!torrent_cache::peek(info_hash, entry)) {
+        // Cache disabled or entry just evicted, so look up and merge every time
+        entry.seedbanks = torrent_acl::look_up_seedbanks(info_hash);
+        entry.seedbank_version = 0;
+    }
+
+    if (entry.seedbanks) {
+        torrent_cache::seedbank_list_t::const_iterator iter;
+        for (iter = entry.seedbanks->begin(); iter != entry.seedbanks->end(); ++iter) {
+            if (seedbanks->count == TS_MAX_SEEDBANKS) {
+                log_util::error() << "ts_export::ts_torrentdb_authorize: too many seed banks, ignoring the rest (" << info_hash << ")" << endl;
+                break;
+            }
+            seedbanks->peers[seedbanks->count++] = *iter;
+        }
+        seedbanks->version = entry.seedbank_version;
+    }
+    return 1;
+}
+
+/**
+ * Merge seedbanks into the torrent's peer list.  Runs under the bucket lock
+ * and only touches memory.  Seedbanks are only merged when the cached list
+ * changed since the last merge, or every TS_SEEDBANK_REFRESH minutes to keep
+ * them from timing out.  Uncached lists (version 0) are always merged.
+ */
+extern "C" void ts_torrentdb_add_seedbanks(ts_seedbank_list const* seedbanks, ot_peerlist *peer_list) {
     int exactmatch;
     ot_peer *peer_dest;
     ot_peer tmp_peer;
 
-    // Get seed bank list for given torrent
-    std::vector<string_int_tuple> sb_list = torrentdb::get_seedbanks(info_hash);
-    std::vector<string_int_tuple>::iterator iter;
-    for (iter = sb_list.begin(); iter != sb_list.end(); ++iter) {
+    if (seedbanks->version != 0
+        && seedbanks->version == peer_list->seedbank_version
+        && g_now_minutes - peer_list->seedbank_merged < TS_SEEDBANK_REFRESH) {
+        return;
+    }
 
-        // Convert ip address/port tuple to ot_peer
-        if (_tuple_to_ot_peer(*iter, &tmp_peer)) {
+    for (size_t i = 0; i < seedbanks->count; ++i) {
 #ifdef _DEBUG
-            log_util::debug() << "ts_export::ts_torrentdb_add_seedbanks: adding seed bank to peer list (" << boost::tuples::get<0>(*iter) << ":" << boost::tuples::get<1>(*iter) << ")" << endl;
+        log_util::debug() << "ts_export::ts_torrentdb_add_seedbanks: adding seed bank to peer list" << endl;
 #endif
-            // Add ot_peer to peer list for the torrent
-            exactmatch = 0;
-            peer_dest = vector_find_or_insert_peer(&(peer_list->peers), &tmp_peer, &exactmatch);
-
-            /**
-             * Oddly, the find_or_insert function doesn't insert.  It only finds and makes a
-             * provisional hole to put the new object in.
-             *
-             * If exactmatch is 1, the seed bank is already in the peer list.
-             * If exactmatch is 0, the find function didn't find a match.  peer_dest is a pointer
-             * to the location in memory where we should copy the new peer data.  That's not
-             * at all confusing.
-             */
-            if (exactmatch == 0) {
-                if (peer_dest) {
-                    memcpy(peer_dest, &tmp_peer, sizeof(ot_peer));
-                    // A seed is counted as both seed and peer
-                    ++peer_list->seed_count;
-                    ++peer_list->peer_count;
-                } else {
-                    log_util::error() << "ts_export::ts_torrentdb_add_seedbanks: got null from vector_find_or_insert_peer" << endl;
-                }
-            }
-#ifdef _DEBUG
-            else {
-                log_util::debug() << "ts_export::ts_torrentdb_add_seedbanks: seed bank already in the peer list" << endl;
+        // Add ot_peer to peer list for the torrent
+        tmp_peer = seedbanks->peers[i];
+        exactmatch = 0;
+        peer_dest = vector_find_or_insert_peer(&(peer_list->peers), &tmp_peer, &exactmatch);
+
+        /**
+         * Oddly, the find_or_insert function doesn't insert.  It only finds and makes a
+         * provisional hole to put the new object in.
+         *
+         * If exactmatch is 1, the seed bank is already in the peer list.
+         * If exactmatch is 0, the find function didn't find a match.  peer_dest is a pointer
+         * to the location in memory where we should copy the new peer data.  That's not
+         * at all confusing.
+         */
+        if (exactmatch == 0) {
+            if (peer_dest) {
+                memcpy(peer_dest, &tmp_peer, sizeof(ot_peer));
+                // A seed is counted as both seed and peer
+                ++peer_list->seed_count;
+                ++peer_list->peer_count;
+            } else {
+                log_util::error() << "ts_export::ts_torrentdb_add_seedbanks: got null from vector_find_or_insert_peer" << endl;
             }
-#endif
+        } else if (peer_dest) {
+            // Already in the peer list, just make it fresh again
+            OT_PEERTIME(peer_dest) = 0;
         }
     }
+
+    peer_list->seedbank_version = seedbanks->version;
+    peer_list->seedbank_merged = g_now_minutes;
+
 /* TODO: need to reenable this */
 #ifdef _DEBUG
     log_util::debug() << "ts_export::ts_torrentdb_add_seedbanks: peer list" << endl;
@@ -130,59 +158,91 @@ extern "C" void ts_torrentdb_add_seedbanks(ot_hash* hash, ot_peerlist *peer_list
 
 }
 
-extern "C" void ts_update_torrent_stats(ot_torrent const* torrent, int increment_completed) {
+/**
+ * Hand a torrent stats snapshot to the stats writer.  Called after the bucket
+ * lock has been released.
+ */
+extern "C" void ts_update_torrent_stats(ts_torrent_stats const* stats) {
+    if (!stats->changed) {
+        return;
+    }
+
     torrentdb::stats_update_t params;
-    ot_hash_to_sha1_hash((ot_hash*)torrent->hash, params.info_hash);
+    ot_hash_to_sha1_hash((ot_hash*)stats->hash, params.info_hash);
 
 #ifdef _DEBUG
-    log_util::debug() << "ts_export::ts_update_torrent_stats: start (" << params.info_hash << ", " << increment_completed << ")" << endl;
+    log_util::debug() << "ts_export::ts_update_torrent_stats: start (" << params.info_hash << ", " << stats->increment_completed << ")" << endl;
 #endif
 
-    ot_peerlist *peer_list = torrent->peer_list;
-
     // Convert from int to uint, need to prevent negative counts
     // Note that params peers and seeds are initialized to 0
-    if (peer_list->peer_count > 0 && peer_list->peer_count < UINT32_MAX) {
+    if (stats->peer_count > 0 && stats->peer_count < UINT32_MAX) {
         // Seeds in opentracker are considered both peers and seeds, which means
         // they're double counted.  Fix that here.  Perform a sanity check first,
         // though.
-        if (peer_list->peer_count < peer_list->seed_count) {
-            log_util::error() << "ts_export::ts_update_torrent_stats: peers (" << peer_list->peer_count << ") less than seeds (" << peer_list->seed_count << ")" << endl;
+        if (stats->peer_count < stats->seed_count) {
+            log_util::error() << "ts_export::ts_update_torrent_stats: peers (" << stats->peer_count << ") less than seeds (" << stats->seed_count << ")" << endl;
         } else {
-            params.peers = peer_list->peer_count - peer_list->seed_count;
+            params.peers = stats->peer_count - stats->seed_count;
         }
     }
-    if (peer_list->seed_count > 0 && peer_list->seed_count < UINT32_MAX) {
-        params.seeds = peer_list->seed_count;
+    if (stats->seed_count > 0 && stats->seed_count < UINT32_MAX) {
+        params.seeds = stats->seed_count;
     }
 
-    if (increment_completed > 0) {
-        params.increment_completed = true;
-    } else {
-        params.increment_completed = false;
+    if (stats->increment_completed > 0) {
+        params.completed = 1;
     }
 
 #ifdef _DEBUG
     log_util::debug() << "ts_export::ts_update_torrent_stats: peers: " << params.peers << endl;
     log_util::debug() << "ts_export::ts_update_torrent_stats: seeds: " << params.seeds << endl;
-    log_util::debug() << "ts_export::ts_update_torrent_stats: increment_completed: " << params.increment_completed << endl;
+    log_util::debug() << "ts_export::ts_update_torrent_stats: completed: " << params.completed << endl;
 #endif
 
-    torrentdb::update_stats(params);
+    stats_writer::enqueue(params);
 
 #ifdef _DEBUG
-    log_util::debug() << "ts_export::ts_update_torrent_stats: after torrentdb::update_stats" << endl;
+    log_util::debug() << "ts_export::ts_update_torrent_stats: returning" << endl;
 #endif
+}
 
-/* TODO: need to reenable this */
-#ifdef _DEBUG
-    log_util::debug() << "ts_export::ts_update_torrent_stats: peer list" << endl;
-    print_peers_peerlist(peer_list);
-#endif
+/**
+ * Write plain text stats for the terasaur torrent database layer into reply.
+ * Output is truncated to reply_size bytes.
+ */
+extern "C" size_t ts_stats_torrentdb(char* reply, size_t reply_size) {
+    std::ostringstream out;
+    torrent_cache::write_stats(out);
+    torrent_index::write_stats(out);
+    torrent_filter::write_stats(out);
+    db_breaker::write_stats(out);
+    torrentdb::write_stats(out);
+    stats_writer::write_stats(out);
+    stats_journal::write_stats(out);
+    control_socket::write_stats(out);
+    epoch::write_stats(out);
+
+    std::string const stats = out.str();
+    size_t const len = stats.size() < reply_size ? stats.size() : reply_size;
+    memcpy(reply, stats.data(), len);
+    return len;
+}
 
-#ifdef _DEBUG
-    log_util::debug() << "ts_export::ts_update_torrent_stats: returning" << endl;
-#endif
+extern "C" void ts_epoch_enter() {
+    epoch::enter();
+}
+
+extern "C" void ts_epoch_leave() {
+    epoch::leave();
+}
+
+extern "C" void ts_epoch_retire(void* ptr) {
+    epoch::retire(ptr);
+}
+
+extern "C" void ts_epoch_reclaim() {
+    epoch::reclaim();
 }
 
 extern "C" void ts_log_debug(const char* msg) {
@@ -17,10 +17,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h> // for sysconf
 #include <getopt.h>
 #include "terasaur/daemonize.hpp"
 #include "terasaur/config.hpp"
 #include "terasaur/torrentdb.hpp"
+#include "terasaur/torrent_cache.hpp"
+#include "terasaur/torrent_index.hpp"
+#include "terasaur/torrent_filter.hpp"
+#include "terasaur/stats_writer.hpp"
+#include "terasaur/stats_journal.hpp"
+#include "terasaur/db_breaker.hpp"
+#include "terasaur/control_socket.hpp"
 #include "terasaur/log_util.hpp"
 #include <boost/lexical_cast.hpp>
 #include <iostream>
@@ -29,7 +37,7 @@ extern "C" {
 #include <libowfat/io.h> // for int64, io_block
 #include <libowfat/ip6.h> // for scan_ip6
 #include "opentracker.h"
-#include "ot_udp.h" // for udp_init
+#include "ot_udp.h" // for udp_bind_shards
 #include "ot_accesslist.h" // for accesslist_blessip
 }
 
@@ -41,6 +49,9 @@ extern char *g_redirecturl; // see opentracker.c
 using std::endl;
 using namespace terasaur;
 
+static int64 _udp_socket = 0;
+static bool _udp_shards = false;
+
 void _usage(void) {
     printf ("Usage: terasaur_tracker [options]\n\n");
     printf ("Options:\n");
@@ -64,6 +75,37 @@ void _set_ot_config_options() {
     config::set_ot_global(&g_redirecturl, config::get_value("main.redirect_url"));
 }
 
+/**
+ * Must run before opentracker_main, which allocates the torrent buckets.
+ */
+bool _set_ot_bucket_count() {
+    string bits = config::get_value("main.bucket_count_bits");
+    unsigned int tmp_bits;
+    try {
+        tmp_bits = boost::lexical_cast<unsigned int>(bits);
+    } catch (boost::bad_lexical_cast const&) {
+        tmp_bits = 0;
+    }
+    if (tmp_bits < OT_BUCKET_COUNT_BITS_MIN || tmp_bits > OT_BUCKET_COUNT_BITS_MAX) {
+        log_util::error() << "Invalid bucket_count_bits in config file (" << bits << "), must be between "
+                          << OT_BUCKET_COUNT_BITS_MIN << " and " << OT_BUCKET_COUNT_BITS_MAX << endl;
+        return false;
+    }
+    g_bucket_count_bits = tmp_bits;
+    return true;
+}
+
+bool _set_ot_torrent_lock_peers() {
+    string peers = config::get_value("main.torrent_lock_peers");
+    try {
+        g_torrent_lock_peers = boost::lexical_cast<size_t>(peers);
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid torrent_lock_peers in config file (" << peers << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
 void _set_ot_stats_acl() {
     string addr = config::get_value("main.access_stats");
     ot_ip6 tmp_addr;
@@ -78,6 +120,19 @@ void _set_ot_stats_acl() {
 }
 
 bool _torrentdb_init() {
+    try {
+        db_breaker::init(boost::lexical_cast<unsigned int>(config::get_value("torrent_db.breaker_failures")),
+                         boost::lexical_cast<time_t>(config::get_value("torrent_db.breaker_retry_interval")),
+                         boost::lexical_cast<long>(config::get_value("torrent_db.breaker_slow_call_ms")));
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid torrent_db breaker setting in config file" << endl;
+        return false;
+    }
+
+    torrentdb::set_param("backend", config::get_value("torrent_db.backend"));
+    torrentdb::set_param("local_path", config::get_value("torrent_db.local_path"));
+    torrentdb::set_param("local_latency_us", config::get_value("torrent_db.local_latency_us"));
+
     std::stringstream ss;
     ss << config::get_value("torrent_db.db_host") << ":" << config::get_value("torrent_db.db_port");
     torrentdb::set_param("connection_string", ss.str());
@@ -92,6 +147,119 @@ bool _torrentdb_init() {
     return torrentdb::init_conn();
 }
 
+bool _torrent_cache_init() {
+    try {
+        torrent_cache::init(boost::lexical_cast<size_t>(config::get_value("torrent_cache.max_entries")),
+                            boost::lexical_cast<time_t>(config::get_value("torrent_cache.positive_ttl")),
+                            boost::lexical_cast<time_t>(config::get_value("torrent_cache.negative_ttl")));
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid torrent_cache setting in config file" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Load the torrent index before any announce comes in, so a restart does not
+ * send one query per torrent to MongoDB.  Failure is not fatal; announces
+ * fall back to database lookups until the refresher manages a load.
+ */
+bool _torrent_index_load() {
+    bool preload;
+    try {
+        preload = boost::lexical_cast<bool>(config::get_value("torrent_index.preload"));
+        torrent_filter::init(boost::lexical_cast<double>(config::get_value("torrent_filter.bits_per_entry")));
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid torrent_index or torrent_filter setting in config file" << endl;
+        return false;
+    }
+    if (preload && !torrent_index::load()) {
+        log_util::error() << "Torrent index preload failed, using database lookups" << endl;
+    }
+    // Have the filter in place before the first announce
+    torrent_filter::rebuild();
+    return true;
+}
+
+void _torrent_index_stop() {
+    torrent_index::stop_refresher();
+    torrent_filter::stop_rebuilder();
+}
+
+bool _torrent_index_start() {
+    try {
+        bool const preload = boost::lexical_cast<bool>(config::get_value("torrent_index.preload"));
+        if (!preload) {
+            return true;
+        }
+        torrent_index::start_refresher(boost::lexical_cast<time_t>(config::get_value("torrent_index.refresh_interval")),
+                                       boost::lexical_cast<time_t>(config::get_value("torrent_index.full_reload_interval")));
+        torrent_filter::start_rebuilder();
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid torrent_index setting in config file" << endl;
+        return false;
+    }
+    atexit(_torrent_index_stop);
+    return true;
+}
+
+void _stats_writer_stop() {
+    stats_writer::stop();
+}
+
+bool _stats_writer_start() {
+    try {
+        // Opened before opentracker drops privileges.  Without a journal,
+        // updates wait in memory while the database is unavailable.
+        string const journal_path = config::get_value("stats_writer.journal_path");
+        if (!journal_path.empty()
+                && !stats_journal::open(journal_path, boost::lexical_cast<size_t>(config::get_value("stats_writer.journal_max_entries")))) {
+            log_util::error() << "Stats journal unavailable, continuing without it" << endl;
+        }
+        stats_writer::start(boost::lexical_cast<size_t>(config::get_value("stats_writer.batch_size")),
+                            boost::lexical_cast<long>(config::get_value("stats_writer.flush_interval_ms")),
+                            boost::lexical_cast<time_t>(config::get_value("stats_writer.min_interval")));
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid stats_writer setting in config file" << endl;
+        return false;
+    }
+    atexit(_stats_writer_stop);
+    return true;
+}
+
+void _control_socket_stop() {
+    control_socket::stop();
+}
+
+/**
+ * Bind the control socket while still privileged.  A failure is logged and
+ * the tracker runs without it, relying on the torrent index refresher.
+ */
+void _control_socket_open() {
+    string const path = config::get_value("control.socket_path");
+    if (!path.empty() && !control_socket::open(path, config::get_value("main.user"))) {
+        log_util::error() << "Control socket unavailable, continuing without it" << endl;
+    }
+}
+
+/**
+ * Number of UDP workers from the config.  "auto" means one per online CPU.
+ * Returns 0 if the setting is invalid.
+ */
+unsigned int _udp_worker_count() {
+    string workers = config::get_value("main.udp_workers");
+    if (workers == "auto") {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    try {
+        return boost::lexical_cast<unsigned int>(workers);
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid udp_workers in config file (" << workers << ")" << endl;
+        return 0;
+    }
+}
+
 bool _bind_socket(const string& addr, const string& port, const string& proto) {
     bool success = true;
     PROTO_FLAG flag;
@@ -123,6 +291,12 @@ bool _bind_socket(const string& addr, const string& port, const string& proto) {
         }
     }
 
+    if (success && flag == FLAG_UDP && _udp_shards) {
+        // One socket per worker, started by opentracker_main after tracker init
+        log_util::debug() << "Binding to udp shard sockets (" << addr << ":" << port << ")" << endl;
+        return udp_bind_shards(tmp_addr, tmp_port, _udp_worker_count());
+    }
+
     if (success) {
         log_util::debug() << "Binding to " << proto << " socket (" << addr << ":" << port << ")" << endl;
         bind_socket = ot_try_bind(tmp_addr, tmp_port, flag);
@@ -130,16 +304,46 @@ bool _bind_socket(const string& addr, const string& port, const string& proto) {
     }
 
     if ((flag == FLAG_UDP) && bind_socket) {
-        // Initialize udp worker pool
-        int64 udp_workers = boost::lexical_cast<int64>(config::get_value("main.udp_workers"));
-        log_util::debug() << "Initializing UDP worker pool with " << udp_workers << " workers" << endl;
+        // Workers are started by opentracker_main after tracker init
         io_block(bind_socket);
-        udp_init(bind_socket, udp_workers);
+        _udp_socket = bind_socket;
     }
 
     return success;
 }
 
+bool _set_udp_shards() {
+    try {
+        _udp_shards = boost::lexical_cast<bool>(config::get_value("main.udp_shards"));
+    } catch (boost::bad_lexical_cast const&) {
+        log_util::error() << "Invalid udp_shards in config file (" << config::get_value("main.udp_shards") << ")" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Must run after _bind_socket, ot_try_bind would start the workers itself.
+ * opentracker_main starts them once the torrent buckets are allocated.
+ */
+bool _set_ot_udp_workers() {
+    if (_udp_shards) {
+        // Shard workers are counted by udp_bind_shards
+        return true;
+    }
+    if (!_udp_socket) {
+        return true;
+    }
+    unsigned int const udp_workers = _udp_worker_count();
+    if (udp_workers == 0) {
+        return false;
+    }
+    log_util::debug() << "UDP worker pool of " << udp_workers << " workers" << endl;
+    g_udp_socket = _udp_socket;
+    g_udp_workers = udp_workers;
+    return true;
+}
+
 /**
  * Core runtime main function.  Parse args, possibly fork, then call bnbtmain()
  */
@@ -184,13 +388,24 @@ int main(int argc, char *argv[])
 
     // Set config variables used by parts of opentracker
     _set_ot_config_options();
+    if (!_set_ot_bucket_count() || !_set_ot_torrent_lock_peers() || !_set_udp_shards()) {
+        exit(1);
+    }
 
     // Setup for stats ACLs
     _set_ot_stats_acl();
 
-    // MongoDB init
+    // Torrent database init
     if (!_torrentdb_init()) {
-        log_util::error() << "MongoDB init failed.  Exiting." << endl;
+        log_util::error() << "Torrent database init failed.  Exiting." << endl;
+        exit(1);
+    }
+
+    if (!_torrent_cache_init()) {
+        exit(1);
+    }
+
+    if (!_torrent_index_load()) {
         exit(1);
     }
 
@@ -208,14 +423,24 @@ int main(int argc, char *argv[])
                                    "udp");
     }
 
-    if (!okay_to_run) {
+    if (!okay_to_run || !_set_ot_udp_workers()) {
         exit(1);
     }
 
+    _control_socket_open();
+
     if (do_fork) {
         daemonize();
     }
 
+    // Started after daemonize() since threads do not survive the fork.  The
+    // UDP workers start in opentracker_main, after tracker init.
+    if (!_stats_writer_start() || !_torrent_index_start()) {
+        exit(1);
+    }
+    control_socket::start();
+    atexit(_control_socket_stop);
+
     // handoff to opentracker code
     return opentracker_main();
 }
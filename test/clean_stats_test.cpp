@@ -0,0 +1,166 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Stats snapshots taken by clean_single_torrent: counts an announce held
+ * back for the stats writer's minimum interval must go out with the next
+ * clean run once the interval has passed.
+ */
+
+extern "C" {
+#include "io.h" // for int64
+#include "trackerlogic.h"
+#include "ot_mutex.h"
+#include "ot_vector.h"
+#include "ot_clean.h"
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "test_util.h"
+
+// Stand-ins for the tracker around ot_clean.c and ot_vector.c
+extern "C" {
+time_t g_now_seconds;
+volatile int g_opentracker_running = 1;
+unsigned int g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+size_t g_torrent_lock_peers = 0;
+
+void free_peerlist(ot_peerlist* peer_list) {
+    free(peer_list->peers.data);
+    free(peer_list);
+}
+
+// Only used by clean_worker, which is never started here
+ot_vector* mutex_bucket_lock(int) { abort(); }
+void mutex_bucket_unlock(int, int) { abort(); }
+void mutex_bucket_caller(ot_lock_caller) {}
+int mutex_torrent_demote(ot_peerlist*) { abort(); }
+void mutex_torrent_hold(ot_peerlist*) { abort(); }
+void mutex_torrent_lock(ot_peerlist*) { abort(); }
+void mutex_torrent_unlock(ot_peerlist*) { abort(); }
+void mutex_torrent_release(ot_peerlist*) { abort(); }
+void stats_cleanup() {}
+void ts_update_torrent_stats(ts_torrent_stats const*) { abort(); }
+void ts_log_debug(const char*) {}
+}
+
+namespace terasaur {
+namespace stats_writer {
+static time_t _min_interval = 30;
+static unsigned long long _suppressed = 0;
+
+time_t min_interval() {
+    return _min_interval;
+}
+void count_suppressed() {
+    ++_suppressed;
+}
+} // namespace stats_writer
+} // namespace terasaur
+
+using namespace terasaur;
+
+static void _add_peer(ot_peerlist* peer_list, uint8_t last_octet) {
+    ot_peer peer;
+    int exactmatch;
+    memset(&peer, 0, sizeof(peer));
+    ((uint8_t*)&peer)[0] = 10;
+    ((uint8_t*)&peer)[3] = last_octet;
+    ((uint8_t*)&peer)[4] = 0x1a;
+    ((uint8_t*)&peer)[5] = 0xe1;
+    vector_find_or_insert_peer(&peer_list->peers, &peer, &exactmatch);
+    ++peer_list->peer_count;
+}
+
+/**
+ * What an announce does with the counts, see
+ * add_peer_to_torrent_and_return_peers.
+ */
+static ts_torrent_stats _announce(ot_torrent* torrent, uint8_t last_octet) {
+    ts_torrent_stats stats;
+    _add_peer(torrent->peer_list, last_octet);
+    ts_snapshot_torrent_stats(torrent, 0, &stats);
+    return stats;
+}
+
+static ts_torrent_stats _clean(ot_torrent* torrent) {
+    ts_torrent_stats stats;
+    stats.changed = 0;
+    TEST_CHECK(clean_single_torrent(torrent, &stats) == 0);
+    return stats;
+}
+
+int main() {
+    ot_torrent torrent;
+    memset(&torrent, 0, sizeof(torrent));
+    memset(torrent.hash, 0x5a, sizeof(ot_hash));
+    torrent.peer_list = (ot_peerlist*)calloc(1, sizeof(ot_peerlist));
+
+    // Start on a minute boundary, the clean runs below are one minute apart
+    g_now_seconds = 600000;
+    torrent.peer_list->base = g_now_minutes;
+
+    // First announce publishes, the second one within min_interval is held back
+    TEST_CHECK(_announce(&torrent, 1).changed == 1);
+    g_now_seconds += 10;
+    ts_torrent_stats held_back = _announce(&torrent, 2);
+    TEST_CHECK(held_back.changed == 0);
+    TEST_CHECK(stats_writer::_suppressed == 1);
+
+    // Next clean run, no peer timed out but the held back counts are due
+    g_now_seconds = 600060;
+    ts_torrent_stats cleaned = _clean(&torrent);
+    TEST_CHECK(cleaned.changed == 1);
+    TEST_CHECK(cleaned.peer_count == 2);
+    TEST_CHECK(cleaned.seed_count == 0);
+    TEST_CHECK(memcmp(cleaned.hash, torrent.hash, sizeof(ot_hash)) == 0);
+    TEST_CHECK(torrent.peer_list->published_peer_count == 2);
+    TEST_CHECK(torrent.peer_list->stats_published == 600060);
+
+    // Nothing new: the clean run neither publishes nor counts a suppression
+    g_now_seconds = 600120;
+    TEST_CHECK(_clean(&torrent).changed == 0);
+    TEST_CHECK(stats_writer::_suppressed == 1);
+
+    // Held back again, and the clean run comes before min_interval is over
+    stats_writer::_min_interval = 300;
+    g_now_seconds = 600130;
+    TEST_CHECK(_announce(&torrent, 3).changed == 0);
+    TEST_CHECK(stats_writer::_suppressed == 2);
+    g_now_seconds = 600180;
+    TEST_CHECK(_clean(&torrent).changed == 0);
+    TEST_CHECK(torrent.peer_list->published_peer_count == 2);
+
+    // Once it is over, the next clean run flushes
+    g_now_seconds = 600360;
+    cleaned = _clean(&torrent);
+    TEST_CHECK(cleaned.changed == 1);
+    TEST_CHECK(cleaned.peer_count == 3);
+
+    // Peers timing out are published as before
+    stats_writer::_min_interval = 30;
+    g_now_seconds = 600360 + 60 * (OT_PEER_TIMEOUT + 1);
+    cleaned = _clean(&torrent);
+    TEST_CHECK(cleaned.changed == 1);
+    TEST_CHECK(cleaned.peer_count == 0);
+    TEST_CHECK(torrent.peer_list->peer_count == 0);
+
+    free_peerlist(torrent.peer_list);
+    return test_report("clean_stats");
+}
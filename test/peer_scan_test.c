@@ -0,0 +1,149 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * vector_scan_peer against a plain loop over the peer keys, for every count
+ * up to OT_PEER_SCAN_MAX.  The Jamfile builds this with the default flags
+ * (SSE2 on x86-64), with -mavx2 and with -mno-sse2 for the scalar loop, so
+ * all three have to agree with the reference.
+ *
+ * The scan is static, so ot_vector.c is compiled in here.
+ */
+
+#include "io.h" /* for int64 */
+#include "../src/opentracker/ot_vector.c"
+#include "test_util.h"
+
+#ifdef WANT_PEER_HASH
+#error "Sorted peer vectors only, the peer set has no scan"
+#endif
+
+/* Room for an unaligned start and a decoy behind the last peer */
+#define SCAN_SLOTS (OT_PEER_SCAN_MAX + 2)
+
+/* Only referenced by vector_remove_torrent */
+void free_peerlist(ot_peerlist *peer_list) {
+    (void)peer_list;
+}
+
+static uint64_t _random_state = 0x853c49e6748fea9bULL;
+
+static uint64_t _random(void) {
+    _random_state ^= _random_state << 13;
+    _random_state ^= _random_state >> 7;
+    _random_state ^= _random_state << 17;
+    return _random_state;
+}
+
+static long _reference_scan(ot_peer *peers, size_t count, ot_peer *peer) {
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        if (!memcmp(peers + i, peer, OT_PEER_COMPARE_SIZE)) {
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+static long _scan(ot_peer *peers, size_t count, ot_peer *peer) {
+    ot_peer *match = vector_scan_peer(peers, count, peer);
+    return match ? match - peers : -1;
+}
+
+static void _random_peer(ot_peer *peer) {
+    uint64_t r = _random();
+    memcpy(peer, &r, sizeof(ot_peer));
+}
+
+/* Same address and port, other time and flag bytes */
+static ot_peer _reannounce(const ot_peer *peer) {
+    ot_peer copy = *peer;
+    OT_PEERTIME(&copy) ^= 0xa5;
+    OT_PEERFLAG(&copy) ^= 0x81;
+    return copy;
+}
+
+/* Returns the number of needles the scan got wrong */
+static unsigned long _check(ot_peer *peers, size_t count, ot_peer *needle) {
+    return _scan(peers, count, needle) != _reference_scan(peers, count, needle);
+}
+
+static unsigned long _check_count(ot_peer *peers, size_t count) {
+    unsigned long wrong = 0;
+    size_t i;
+    ot_peer needle;
+
+    for (i = 0; i < count; ++i) {
+        needle = _reannounce(peers + i);
+        wrong += _check(peers, count, &needle);
+
+        /* Only one half of the address and port matches: the SSE2 scan
+           compares 32 bit halves and must not take either alone */
+        needle = peers[i];
+        ((uint8_t*)&needle)[1] ^= 0x10;
+        wrong += _check(peers, count, &needle);
+        needle = peers[i];
+        ((uint8_t*)&needle)[5] ^= 0x01;
+        wrong += _check(peers, count, &needle);
+    }
+
+    /* Not there, and just behind the end */
+    _random_peer(&needle);
+    wrong += _check(peers, count, &needle);
+    needle = _reannounce(peers + count);
+    wrong += _check(peers, count, &needle);
+    return wrong;
+}
+
+int main(void) {
+    ot_peer slots[SCAN_SLOTS];
+    size_t offset, count, i;
+    int round;
+
+#ifdef __AVX2__
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("peer_scan: no AVX2 on this CPU, skipped\n");
+        return 0;
+    }
+#endif
+
+    for (round = 0; round < 64; ++round) {
+        /* Aligned and unaligned starts */
+        for (offset = 0; offset < 2; ++offset) {
+            ot_peer *peers = slots + offset;
+            for (count = 0; count <= OT_PEER_SCAN_MAX; ++count) {
+                for (i = 0; i < SCAN_SLOTS; ++i) {
+                    _random_peer(slots + i);
+                }
+                /* Sorted vectors hold each peer once, but the first match
+                   has to win anyway */
+                if (count > 2 && round % 4 == 0) {
+                    peers[count - 1] = _reannounce(peers + count / 2);
+                }
+                TEST_CHECK(_check_count(peers, count) == 0);
+            }
+        }
+    }
+
+#if defined( __AVX2__ )
+    return test_report("peer_scan (AVX2)");
+#elif defined( __SSE2__ )
+    return test_report("peer_scan (SSE2)");
+#else
+    return test_report("peer_scan (scalar)");
+#endif
+}
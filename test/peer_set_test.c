@@ -0,0 +1,181 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * The peers of one torrent: a sorted array by default, an open addressing
+ * set with WANT_PEER_HASH.  Both are run through inserts, lookups and
+ * removals across several resizes, checking after every removal that each
+ * remaining peer can still be found and that no slot holds a removed one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "io.h" /* for int64 */
+#include "trackerlogic.h"
+#include "ot_vector.h"
+#include "terasaur/slab.h"
+#include "test_util.h"
+
+#define PEER_COUNT 3000
+
+/* Only referenced by vector_remove_torrent */
+void free_peerlist(ot_peerlist *peer_list) {
+    (void)peer_list;
+}
+
+static uint64_t _random_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t _random(void) {
+    _random_state ^= _random_state << 13;
+    _random_state ^= _random_state >> 7;
+    _random_state ^= _random_state << 17;
+    return _random_state;
+}
+
+/**
+ * Distinct addresses, some sharing an IP and only differing in port.  Time
+ * and flag bytes are random, lookups must ignore them.  Every third peer
+ * seeds.
+ */
+static void _make_peers(ot_peer *peers, size_t count) {
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        uint8_t *peer = (uint8_t*)(peers + i);
+        uint64_t r = _random();
+        peer[0] = 10;
+        peer[1] = (uint8_t)(i >> 8);
+        peer[2] = (uint8_t)i;
+        peer[3] = (uint8_t)(i % 5 ? r : 1);
+        peer[4] = (uint8_t)(r >> 8);
+        peer[5] = (uint8_t)(i % 5 ? r >> 16 : i);
+        OT_PEERTIME(peers + i) = (uint8_t)(r >> 24);
+        OT_PEERFLAG(peers + i) = i % 3 ? 0 : PEER_FLAG_SEEDING;
+    }
+}
+
+/* Same address and port, other time and flag bytes */
+static ot_peer _reannounce(const ot_peer *peer) {
+    ot_peer copy = *peer;
+    OT_PEERTIME(&copy) ^= 0x5a;
+    OT_PEERFLAG(&copy) ^= 0x01;
+    return copy;
+}
+
+static int _insert(ot_vector *vector, ot_peer *peer) {
+    int exactmatch;
+    ot_peer *match = vector_find_or_insert_peer(vector, peer, &exactmatch);
+    if (!match) {
+        return -1;
+    }
+    if (!exactmatch) {
+        *match = *peer;
+    }
+    return exactmatch ? 1 : 0;
+}
+
+/**
+ * Number of present peers that cannot be found, plus the number of used
+ * slots that do not hold a present peer.
+ */
+static size_t _check_all(ot_vector *vector, ot_peer *peers, const int *present, size_t count) {
+    size_t i, wrong = 0, expected = 0, used = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (present[i]) {
+            ot_peer lookup = _reannounce(peers + i);
+            ++expected;
+            if (_insert(vector, &lookup) != 1) {
+                ++wrong;
+            }
+        }
+    }
+    for (i = 0; i < OT_PEER_SLOTS(vector); ++i) {
+        if (OT_PEER_SLOT_USED((ot_peer*)vector->data + i)) {
+            ++used;
+        }
+    }
+    wrong += used > expected ? used - expected : expected - used;
+    return wrong + (vector->size != expected);
+}
+
+int main(void) {
+    static ot_peer peers[PEER_COUNT];
+    static int present[PEER_COUNT];
+    static size_t order[PEER_COUNT];
+    ot_vector vector = { NULL, 0, 0 };
+    size_t i, resizes = 0, space, lost = 0, largest;
+    int seeders_removed = 0;
+
+    _make_peers(peers, PEER_COUNT);
+
+    /* Insert, looking everything up again whenever the storage grew */
+    space = vector.space;
+    for (i = 0; i < PEER_COUNT; ++i) {
+        TEST_CHECK(_insert(&vector, peers + i) == 0);
+        present[i] = 1;
+        if (vector.space != space) {
+            ++resizes;
+            space = vector.space;
+            lost += _check_all(&vector, peers, present, i + 1);
+        }
+    }
+    TEST_CHECK(resizes >= 5);
+    TEST_CHECK(lost == 0);
+    TEST_CHECK(vector.size == PEER_COUNT);
+    TEST_CHECK(_check_all(&vector, peers, present, PEER_COUNT) == 0);
+    largest = vector.space;
+
+    /* Remove in random order, every other peer stays reachable */
+    for (i = 0; i < PEER_COUNT; ++i) {
+        order[i] = i;
+    }
+    for (i = PEER_COUNT - 1; i > 0; --i) {
+        size_t j = _random() % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    lost = 0;
+    for (i = 0; i < PEER_COUNT; ++i) {
+        ot_peer *peer = peers + order[i];
+        ot_peer stop = _reannounce(peer);
+        int const expect = (OT_PEERFLAG(peer) & PEER_FLAG_SEEDING) ? 2 : 1;
+        TEST_CHECK(vector_remove_peer(&vector, &stop) == expect);
+        TEST_CHECK(vector_remove_peer(&vector, &stop) == 0);
+        seeders_removed += expect == 2;
+        present[order[i]] = 0;
+        /* Checking each removal is quadratic, the first and last ones run
+           through all resizes already */
+        if (i < PEER_COUNT / 4 || i >= PEER_COUNT - PEER_COUNT / 8 || i % 16 == 0) {
+            lost += _check_all(&vector, peers, present, PEER_COUNT);
+        }
+        if (i == PEER_COUNT - PEER_COUNT / 32) {
+            /* Storage shrinks while emptying */
+            TEST_CHECK(vector.space < largest);
+        }
+    }
+    TEST_CHECK(lost == 0);
+    TEST_CHECK(seeders_removed == (PEER_COUNT + 2) / 3);
+    TEST_CHECK(vector.size == 0);
+
+    ts_slab_free_peers(vector.data, vector.space);
+#ifdef WANT_PEER_HASH
+    return test_report("peer_set (hash set)");
+#else
+    return test_report("peer_set (sorted)");
+#endif
+}
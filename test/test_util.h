@@ -0,0 +1,46 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef TEST_UTIL_H_INCLUDED
+#define TEST_UTIL_H_INCLUDED
+
+#include <stdio.h>
+
+/**
+ * Checks for the unit tests, usable from C and C++.  A failed check is
+ * printed and the test goes on; main returns test_report() so the test run
+ * fails if any check did.
+ */
+static unsigned long test_checks = 0;
+static unsigned long test_failures = 0;
+
+#define TEST_CHECK(cond) test_check((cond) ? 1 : 0, #cond, __FILE__, __LINE__)
+
+static inline int test_check(int ok, const char *what, const char *file, int line) {
+    ++test_checks;
+    if (!ok) {
+        ++test_failures;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    }
+    return ok;
+}
+
+static inline int test_report(const char *name) {
+    printf("%s: %lu checks, %lu failed\n", name, test_checks, test_failures);
+    return test_failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,199 @@
+/**
+ * Copyright 2013 ibiblio
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * The torrent index of one bucket: sorted array by default, open addressing
+ * table with WANT_TORRENT_HASH.  Both are run through inserts, lookups and
+ * removals across several resizes, checking after every removal that each
+ * remaining torrent can still be found.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "io.h" /* for int64 */
+#include "trackerlogic.h"
+#include "ot_vector.h"
+#include "test_util.h"
+
+#define TORRENT_COUNT 3000
+
+/* Every torrent gets this as its peer list, free_peerlist only counts */
+static ot_peerlist _peer_list;
+static unsigned long _freed = 0;
+
+void free_peerlist(ot_peerlist *peer_list) {
+    if (peer_list == &_peer_list) {
+        ++_freed;
+    }
+}
+
+static uint64_t _random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t _random(void) {
+    _random_state ^= _random_state << 13;
+    _random_state ^= _random_state >> 7;
+    _random_state ^= _random_state << 17;
+    return _random_state;
+}
+
+/**
+ * Every fourth hash shares its first 8 bytes with its predecessor, so the
+ * sorted search has to compare past the prefix.  Every eighth hash also has
+ * the home slot bytes of the one before, so hash tables get long runs.
+ */
+static void _make_hashes(ot_hash *hashes, size_t count) {
+    size_t i, j;
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < sizeof(ot_hash); ++j) {
+            hashes[i][j] = (uint8_t)_random();
+        }
+        if (i && i % 4 == 0) {
+            memcpy(hashes[i], hashes[i - 1], 8);
+        } else if (i && i % 8 == 1) {
+            memcpy(hashes[i] + 4, hashes[i - 1] + 4, 4);
+        }
+    }
+}
+
+static size_t _find_all(ot_vector *vector, ot_hash *hashes, const int *present, size_t count) {
+    size_t i, wrong = 0;
+    for (i = 0; i < count; ++i) {
+        ot_torrent *torrent = vector_find_torrent(vector->data, OT_TORRENT_SLOTS(vector), hashes[i]);
+        if (present[i] ? !torrent || memcmp(torrent->hash, hashes[i], sizeof(ot_hash)) : torrent != NULL) {
+            ++wrong;
+        }
+    }
+    return wrong;
+}
+
+static size_t _used_slots(ot_vector *vector) {
+    ot_torrent *torrents = vector->data;
+    size_t i, used = 0;
+    for (i = 0; i < OT_TORRENT_SLOTS(vector); ++i) {
+        if (torrents[i].peer_list) {
+            ++used;
+        }
+    }
+    return used;
+}
+
+static int _insert(ot_vector *vector, ot_hash hash) {
+    int exactmatch;
+    ot_torrent *torrent = vector_find_or_insert_torrent(vector, hash, &exactmatch);
+    if (!torrent) {
+        return -1;
+    }
+    if (!exactmatch) {
+        memcpy(torrent->hash, hash, sizeof(ot_hash));
+        torrent->peer_list = &_peer_list;
+    }
+    return exactmatch ? 1 : 0;
+}
+
+static int _remove(ot_vector *vector, ot_hash hash) {
+    ot_torrent *torrent = vector_find_torrent(vector->data, OT_TORRENT_SLOTS(vector), hash);
+    if (!torrent) {
+        return 0;
+    }
+    vector_remove_torrent(vector, torrent);
+    return 1;
+}
+
+int main(void) {
+    static ot_hash hashes[TORRENT_COUNT];
+    static int present[TORRENT_COUNT];
+    static size_t order[TORRENT_COUNT];
+    ot_vector vector = { NULL, 0, 0 };
+    size_t i, resizes = 0, space, lost = 0;
+
+    _make_hashes(hashes, TORRENT_COUNT);
+
+    /* Insert, looking everything up again whenever the storage grew */
+    space = vector.space;
+    for (i = 0; i < TORRENT_COUNT; ++i) {
+        TEST_CHECK(_insert(&vector, hashes[i]) == 0);
+        present[i] = 1;
+        if (vector.space != space) {
+            ++resizes;
+            space = vector.space;
+            lost += _find_all(&vector, hashes, present, i + 1);
+        }
+    }
+    TEST_CHECK(resizes >= 5);
+    TEST_CHECK(lost == 0);
+    TEST_CHECK(vector.size == TORRENT_COUNT);
+    TEST_CHECK(_used_slots(&vector) == TORRENT_COUNT);
+    TEST_CHECK(_find_all(&vector, hashes, present, TORRENT_COUNT) == 0);
+
+    /* Inserting again finds the existing torrents */
+    for (i = 0; i < TORRENT_COUNT; i += 7) {
+        TEST_CHECK(_insert(&vector, hashes[i]) == 1);
+    }
+    TEST_CHECK(vector.size == TORRENT_COUNT);
+
+    /* Remove in random order, every other torrent stays reachable */
+    for (i = 0; i < TORRENT_COUNT; ++i) {
+        order[i] = i;
+    }
+    for (i = TORRENT_COUNT - 1; i > 0; --i) {
+        size_t j = _random() % (i + 1), tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    lost = 0;
+    for (i = 0; i < TORRENT_COUNT * 3 / 4; ++i) {
+        TEST_CHECK(_remove(&vector, hashes[order[i]]) == 1);
+        present[order[i]] = 0;
+        lost += _find_all(&vector, hashes, present, TORRENT_COUNT);
+    }
+    TEST_CHECK(lost == 0);
+    TEST_CHECK(_remove(&vector, hashes[order[0]]) == 0);
+    TEST_CHECK(_freed == TORRENT_COUNT * 3 / 4);
+    TEST_CHECK(vector.size == TORRENT_COUNT - TORRENT_COUNT * 3 / 4);
+    TEST_CHECK(_used_slots(&vector) == vector.size);
+
+    /* Storage shrinks again, with WANT_TORRENT_HASH on the next insert */
+    space = vector.space;
+    for (i = 0; i < TORRENT_COUNT / 8; ++i) {
+        TEST_CHECK(_remove(&vector, hashes[order[TORRENT_COUNT * 3 / 4 + i]]) == 1);
+        present[order[TORRENT_COUNT * 3 / 4 + i]] = 0;
+    }
+    TEST_CHECK(_insert(&vector, hashes[order[0]]) == 0);
+    present[order[0]] = 1;
+    TEST_CHECK(vector.space < space);
+    TEST_CHECK(_find_all(&vector, hashes, present, TORRENT_COUNT) == 0);
+    TEST_CHECK(_used_slots(&vector) == vector.size);
+
+    /* And down to empty */
+    for (i = 0; i < TORRENT_COUNT; ++i) {
+        if (present[i]) {
+            TEST_CHECK(_remove(&vector, hashes[i]) == 1);
+            present[i] = 0;
+        }
+    }
+    TEST_CHECK(vector.size == 0);
+    TEST_CHECK(_used_slots(&vector) == 0);
+    TEST_CHECK(_find_all(&vector, hashes, present, TORRENT_COUNT) == 0);
+
+    free(vector.data);
+#ifdef WANT_TORRENT_HASH
+    return test_report("torrent_index (hash table)");
+#else
+    return test_report("torrent_index (sorted)");
+#endif
+}